@@ -0,0 +1,606 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "synthetic.hpp"
+#include "util_mmd.hpp"
+#include "util_mmd_batch.hpp"
+#include "util_mmd_eval.hpp"
+#include "util_mmd_prefetch.hpp"
+#include "util_mmd_textures.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_mapped.hpp"
+#include "util_mmd_probe.hpp"
+#include "util_mmd_sampler.hpp"
+#include "util_mmd_springs.hpp"
+#include "util_mmd_stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Usage: util_mmd_bench [--iterations N] [--warmup N] [--filter SUBSTRING] [--json]
+//        util_mmd_bench --load FILE
+//        util_mmd_bench --check-allocations
+// Every benchmark runs on synthetic data generated in memory, so results don't depend on the disk, except for
+// the io.* and batch.* benchmarks: They write their inputs to the temporary directory and compare the I/O backends
+// with a hot page cache and with a cold one. The cold variants evict the files with posix_fadvise(DONTNEED)
+// before every iteration and are only available on Linux.
+// --load loads a single PMX or VMD file instead and prints its load statistics.
+// --check-allocations evaluates every model preset frame by frame and fails if any frame allocates
+// heap memory once the evaluation workspace has been created.
+
+// Heap allocations are counted while g_countAllocations is set
+static std::atomic<bool> g_countAllocations = false;
+static std::atomic<uint64_t> g_allocationCount = 0;
+static void *allocate(std::size_t size)
+{
+	if(g_countAllocations.load(std::memory_order_relaxed))
+		g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+	if(auto *p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc {};
+}
+void *operator new(std::size_t size) { return allocate(size); }
+void *operator new[](std::size_t size) { return allocate(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+namespace mmd {
+	namespace bench {
+		struct Options {
+			uint32_t iterations = 20;
+			uint32_t warmup = 3;
+			std::string filter;
+			bool json = false;
+		};
+
+		struct Result {
+			std::string name;
+			uint64_t bytes = 0; // Input size, used for the throughput
+			uint32_t iterations = 0;
+			double minNs = 0.0;
+			double medianNs = 0.0;
+			double meanNs = 0.0;
+			double stddevNs = 0.0;
+		};
+
+		// Prevents the compiler from discarding benchmarked work
+		static volatile uint64_t g_sink = 0;
+		static void consume(uint64_t value) { g_sink = g_sink + value; }
+
+		class Runner {
+		  public:
+			Runner(const Options &options) : m_options {options} {}
+			// setup is called before every iteration and is not included in the measurement
+			void Run(const std::string &name, uint64_t bytes, const std::function<void()> &func, const std::function<void()> &setup = nullptr)
+			{
+				if(!m_options.filter.empty() && name.find(m_options.filter) == std::string::npos)
+					return;
+				for(uint32_t i = 0; i < m_options.warmup; ++i) {
+					if(setup)
+						setup();
+					func();
+				}
+				std::vector<double> samples;
+				samples.reserve(m_options.iterations);
+				for(uint32_t i = 0; i < m_options.iterations; ++i) {
+					if(setup)
+						setup();
+					auto t0 = std::chrono::steady_clock::now();
+					func();
+					auto t1 = std::chrono::steady_clock::now();
+					samples.push_back(std::chrono::duration<double, std::nano> {t1 - t0}.count());
+				}
+				if(samples.empty())
+					return;
+				std::sort(samples.begin(), samples.end());
+				Result result {};
+				result.name = name;
+				result.bytes = bytes;
+				result.iterations = samples.size();
+				result.minNs = samples.front();
+				auto mid = samples.size() / 2;
+				result.medianNs = (samples.size() % 2 == 0) ? (samples[mid - 1] + samples[mid]) * 0.5 : samples[mid];
+				for(auto s : samples)
+					result.meanNs += s;
+				result.meanNs /= samples.size();
+				for(auto s : samples)
+					result.stddevNs += (s - result.meanNs) * (s - result.meanNs);
+				result.stddevNs = std::sqrt(result.stddevNs / samples.size());
+				if(!m_options.json)
+					Print(result);
+				m_results.push_back(std::move(result));
+			}
+			void PrintJson() const
+			{
+				printf("[\n");
+				for(size_t i = 0; i < m_results.size(); ++i) {
+					auto &r = m_results[i];
+					printf("  {\"name\": \"%s\", \"bytes\": %llu, \"iterations\": %u, \"min_ns\": %.0f, \"median_ns\": %.0f, \"mean_ns\": %.0f, \"stddev_ns\": %.0f, \"mb_per_s\": %.2f}%s\n", r.name.c_str(),
+					  static_cast<unsigned long long>(r.bytes), r.iterations, r.minNs, r.medianNs, r.meanNs, r.stddevNs, GetThroughput(r), (i + 1 < m_results.size()) ? "," : "");
+				}
+				printf("]\n");
+			}
+		  private:
+			static double GetThroughput(const Result &r) { return (r.bytes > 0 && r.medianNs > 0.0) ? (r.bytes / (r.medianNs * 1e-9)) / (1024.0 * 1024.0) : 0.0; }
+			static void Print(const Result &r)
+			{
+				printf("%-40s median %12.3f ms  min %12.3f ms  stddev %6.2f%%", r.name.c_str(), r.medianNs * 1e-6, r.minNs * 1e-6, (r.meanNs > 0.0) ? (r.stddevNs / r.meanNs * 100.0) : 0.0);
+				if(r.bytes > 0)
+					printf("  %10.2f MB/s", GetThroughput(r));
+				printf("\n");
+				fflush(stdout);
+			}
+			Options m_options;
+			std::vector<Result> m_results;
+		};
+
+		struct ModelPreset {
+			const char *name;
+			PmxConfig config;
+		};
+		static std::vector<ModelPreset> get_model_presets()
+		{
+			std::vector<ModelPreset> presets;
+			auto &small = presets.emplace_back(ModelPreset {"small_utf8_bdef2", {}}).config;
+			small.vertexCount = 2'000;
+			small.triangleCount = 3'000;
+			small.boneCount = 50;
+			small.morphCount = 10;
+			small.verticesPerMorph = 50;
+			small.weightMode = WeightMode::BDEF2;
+			small.textEncoding = pmx::TextEncoding::UTF8;
+
+			auto &medium = presets.emplace_back(ModelPreset {"medium_utf16_mixed", {}}).config;
+			medium.vertexCount = 30'000;
+			medium.triangleCount = 45'000;
+			medium.boneCount = 300;
+			medium.morphCount = 100;
+			medium.verticesPerMorph = 300;
+			medium.rigidBodyCount = 64;
+			medium.additionalUvCount = 1;
+
+			auto &large = presets.emplace_back(ModelPreset {"large_bdef4_index4", {}}).config;
+			large.vertexCount = 200'000;
+			large.triangleCount = 300'000;
+			large.materialCount = 40;
+			large.textureCount = 40;
+			large.boneCount = 800;
+			large.morphCount = 300;
+			large.verticesPerMorph = 1'000;
+			large.rigidBodyCount = 200;
+			large.weightMode = WeightMode::BDEF4;
+			large.vertexIndexSize = 4;
+			large.otherIndexSize = 4;
+			return presets;
+		}
+
+		static void run_model_benchmarks(Runner &runner)
+		{
+			for(auto &preset : get_model_presets()) {
+				auto data = generate_pmx(preset.config);
+				std::string prefix = preset.name;
+				runner.Run("pmx.load/" + prefix, data.size(), [&data]() {
+					SpanFile f {data};
+					auto mdl = pmx::load(f);
+					consume(mdl ? mdl->vertices.size() : 0);
+				});
+				runner.Run("pmx.load_monotonic/" + prefix, data.size(), [&data]() {
+					// The model has to be released before the arena
+					std::pmr::monotonic_buffer_resource arena;
+					SpanFile f {data};
+					auto mdl = pmx::load(f, pmx::LoadFlags::Default, nullptr, &arena);
+					consume(mdl ? mdl->vertices.size() : 0);
+				});
+				runner.Run("pmx.load_all/" + prefix, data.size(), [&data]() {
+					SpanFile f {data};
+					auto mdl = pmx::load(f, pmx::LoadFlags::All);
+					consume(mdl ? mdl->vertices.size() : 0);
+				});
+				runner.Run("pmx.probe/" + prefix, data.size(), [&data]() {
+					auto info = pmx::probe(std::span<const uint8_t> {data});
+					consume(info ? info->morphCount : 0);
+				});
+
+				if(preset.config.rigidBodyCount == 0)
+					continue;
+				SpanFile f {data};
+				auto mdl = pmx::load(f);
+				auto rig = springs::Rig::Create(*mdl);
+				std::vector<springs::BoneTransform> boneTransforms(mdl->bones.size());
+				for(size_t i = 0; i < boneTransforms.size(); ++i)
+					boneTransforms[i].translation = mdl->bones[i].position;
+				constexpr uint32_t numSteps = 60;
+				runner.Run("springs.step_60/" + prefix, 0, [&rig, &boneTransforms]() {
+					springs::Instance instance {rig};
+					springs::Settings settings {};
+					for(uint32_t i = 0; i < numSteps; ++i)
+						instance.Step(boneTransforms, 1.f / 60.f, settings);
+					consume(static_cast<uint64_t>(instance.GetParticlePosition(0).y));
+				});
+			}
+		}
+
+		static void run_motion_benchmarks(Runner &runner)
+		{
+			VmdConfig config {};
+			config.boneCount = 150;
+			config.keysPerBone = 1'500;
+			config.morphCount = 50;
+			config.keysPerMorph = 500;
+			config.cameraKeyCount = 3'000;
+			auto data = generate_vmd(config);
+			runner.Run("vmd.load/dance", data.size(), [&data]() {
+				SpanFile f {data};
+				auto anim = vmd::load(f);
+				consume(anim ? anim->keyframes.size() : 0);
+			});
+			runner.Run("vmd.load_monotonic/dance", data.size(), [&data]() {
+				std::pmr::monotonic_buffer_resource arena;
+				SpanFile f {data};
+				auto anim = vmd::load(f, nullptr, &arena);
+				consume(anim ? anim->keyframes.size() : 0);
+			});
+			runner.Run("vmd.probe/dance", data.size(), [&data]() {
+				auto info = vmd::probe(std::span<const uint8_t> {data});
+				consume(info ? info->maxFrame : 0);
+			});
+			runner.Run("vmd.mapped_track_index/dance", data.size(), [&data]() {
+				auto anim = vmd::MappedAnimation::Create(data);
+				consume(anim->GetBoneTrackIndex().names.size());
+			});
+
+			SpanFile f {data};
+			auto anim = vmd::load(f);
+			auto lastFrame = anim->cameras.empty() ? 0u : anim->cameras.back().frameIndex;
+			runner.Run("vmd.sample_camera/dance", 0, [&anim, lastFrame]() {
+				vmd::CameraSampler sampler {*anim};
+				vmd::CameraState state {};
+				for(uint32_t frame = 0; frame <= lastFrame; ++frame)
+					sampler.Sample(static_cast<float>(frame), state);
+				consume(static_cast<uint64_t>(state.distance));
+			});
+			runner.Run("vmd.bezier_evaluate/dance", 0, [&anim]() {
+				float sum = 0.f;
+				for(auto &key : anim->keyframes) {
+					auto &ip = key.interpolation;
+					auto curve = vmd::BezierCurve::FromBytes(ip[0], ip[4], ip[8], ip[12]);
+					sum += curve.Evaluate(0.5f);
+				}
+				consume(static_cast<uint64_t>(sum));
+			});
+		}
+
+		static bool write_file(const std::string &path, const std::vector<uint8_t> &data)
+		{
+			std::ofstream f {path, std::ios::binary};
+			return static_cast<bool>(f.write(reinterpret_cast<const char *>(data.data()), data.size()));
+		}
+		// Evicts the file from the page cache
+		static void drop_page_cache(const std::string &path)
+		{
+#ifdef __linux__
+			auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if(fd == -1)
+				return;
+			fdatasync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+#endif
+		}
+		static constexpr bool CAN_DROP_PAGE_CACHE =
+#ifdef __linux__
+		  true;
+#else
+		  false;
+#endif
+
+		static void run_io_benchmarks(Runner &runner)
+		{
+			auto dir = std::filesystem::temp_directory_path() / "util_mmd_bench";
+			std::error_code ec;
+			std::filesystem::create_directories(dir, ec);
+			auto modelConfig = get_model_presets()[1].config;
+			auto modelData = generate_pmx(modelConfig);
+			auto modelPath = (dir / "model.pmx").string();
+			VmdConfig motionConfig {};
+			auto motionData = generate_vmd(motionConfig);
+			auto motionPath = (dir / "motion.vmd").string();
+			// Many small models, as in a scene with props
+			PmxConfig propConfig {};
+			propConfig.vertexCount = 5'000;
+			propConfig.triangleCount = 8'000;
+			propConfig.boneCount = 30;
+			auto propData = generate_pmx(propConfig);
+			std::vector<std::string> propPaths;
+			for(uint32_t i = 0; i < 64; ++i)
+				propPaths.push_back((dir / ("prop_" + std::to_string(i) + ".pmx")).string());
+			auto success = write_file(modelPath, modelData) && write_file(motionPath, motionData);
+			for(auto &path : propPaths)
+				success = success && write_file(path, propData);
+			if(!success) {
+				fprintf(stderr, "Failed to write benchmark files to '%s'\n", dir.string().c_str());
+				return;
+			}
+
+			for(auto cold : {false, true}) {
+				if(cold && !CAN_DROP_PAGE_CACHE)
+					continue;
+				std::string cache = cold ? "cold" : "hot";
+				for(uint32_t i = 0; i < umath::to_integral(IoBackendType::Count); ++i) {
+					auto &backend = get_io_backend(static_cast<IoBackendType>(i));
+					auto prefix = "io." + std::string {to_string(static_cast<IoBackendType>(i))} + "." + cache;
+					runner.Run(
+					  prefix + "/pmx_medium", modelData.size(),
+					  [&modelPath, &backend]() {
+						  auto mdl = pmx::load(modelPath, pmx::LoadFlags::Default, nullptr, nullptr, &backend);
+						  consume(mdl ? mdl->vertices.size() : 0);
+					  },
+					  cold ? std::function<void()> {[&modelPath]() { drop_page_cache(modelPath); }} : nullptr);
+					runner.Run(
+					  prefix + "/vmd_dance", motionData.size(),
+					  [&motionPath, &backend]() {
+						  auto anim = vmd::load(motionPath, nullptr, nullptr, &backend);
+						  consume(anim ? anim->keyframes.size() : 0);
+					  },
+					  cold ? std::function<void()> {[&motionPath]() { drop_page_cache(motionPath); }} : nullptr);
+				}
+				for(auto batchBackend : {BatchBackend::IoUring, BatchBackend::ThreadPool}) {
+					if(batchBackend == BatchBackend::IoUring && !is_io_uring_supported())
+						continue;
+					BatchSettings settings {};
+					settings.backend = batchBackend;
+					runner.Run(
+					  "batch." + std::string {to_string(batchBackend)} + "." + cache + "/props_64", propData.size() * propPaths.size(),
+					  [&propPaths, settings]() {
+						  auto models = pmx::load(propPaths, pmx::LoadFlags::Default, settings);
+						  consume(models.size());
+					  },
+					  cold ? std::function<void()> {[&propPaths]() {
+						  for(auto &path : propPaths)
+							  drop_page_cache(path);
+					  }}
+					       : nullptr);
+				}
+			}
+			std::filesystem::remove_all(dir, ec);
+		}
+
+		// Texture paths as they are typically stored in models, resolved against differently cased files
+		static void run_texture_benchmarks(Runner &runner)
+		{
+			constexpr uint32_t numModels = 1'000;
+			auto dir = std::filesystem::temp_directory_path() / "util_mmd_bench_textures";
+			std::error_code ec;
+			std::filesystem::remove_all(dir, ec);
+			auto success = true;
+			auto touch = [&success](const std::filesystem::path &path) { success = success && static_cast<bool>(std::ofstream {path}); };
+			std::vector<std::string> modelRoots;
+			modelRoots.reserve(numModels);
+			std::filesystem::create_directories(dir / "shared", ec);
+			touch(dir / "shared" / "Toon01.bmp");
+			for(uint32_t i = 0; i < numModels; ++i) {
+				auto root = dir / ("model_" + std::to_string(i));
+				std::filesystem::create_directories(root / "Tex", ec);
+				std::filesystem::create_directories(root / "spa", ec);
+				for(auto *name : {"Tex/Body.png", "Tex/Face.PNG", "hair.bmp", "spa/Sphere.spa"})
+					touch(root / name);
+				modelRoots.push_back(root.string());
+			}
+			if(!success) {
+				fprintf(stderr, "Failed to write benchmark files to '%s'\n", dir.string().c_str());
+				return;
+			}
+			std::vector<std::string> texturePaths {"tex\\body.png", "TEX\\face.png", "Hair.bmp", "SPA\\sphere.spa", "..\\shared\\toon01.bmp", "missing.png"};
+			runner.Run("textures.resolve/models_1000", 0, [&modelRoots, &texturePaths]() {
+				TextureResolver resolver {};
+				for(auto &root : modelRoots) {
+					for(auto &texPath : texturePaths)
+						consume(resolver.Resolve(root, texPath));
+				}
+				consume(resolver.GetPaths().size());
+			});
+
+			// Reading the textures of a model one after another, as a decoder would, with and without read-ahead
+			constexpr uint32_t numTextures = 32;
+			constexpr size_t textureSize = 1024 * 1024;
+			auto texDir = dir / "textures";
+			std::filesystem::create_directories(texDir, ec);
+			std::vector<uint8_t> texData(textureSize);
+			for(size_t i = 0; i < texData.size(); ++i)
+				texData[i] = static_cast<uint8_t>(i * 2654435761u >> 24);
+			std::vector<std::string> texFiles;
+			for(uint32_t i = 0; i < numTextures; ++i) {
+				texFiles.push_back((texDir / ("tex_" + std::to_string(i) + ".png")).string());
+				success = success && write_file(texFiles.back(), texData);
+			}
+			if(!success) {
+				fprintf(stderr, "Failed to write benchmark files to '%s'\n", texDir.string().c_str());
+				std::filesystem::remove_all(dir, ec);
+				return;
+			}
+			auto dropTextures = [&texFiles]() {
+				for(auto &path : texFiles)
+					drop_page_cache(path);
+			};
+			for(auto cold : {false, true}) {
+				if(cold && !CAN_DROP_PAGE_CACHE)
+					continue;
+				std::string cache = cold ? "cold" : "hot";
+				auto setup = cold ? std::function<void()> {dropTextures} : nullptr;
+				runner.Run(
+				  "textures.read." + cache + "/files_32", textureSize * numTextures,
+				  [&texFiles]() {
+					  std::vector<uint8_t> data;
+					  for(auto &path : texFiles) {
+						  read_file(path, data);
+						  consume(data.size());
+					  }
+				  },
+				  setup);
+				runner.Run(
+				  "textures.prefetch." + cache + "/files_32", textureSize * numTextures,
+				  [&texFiles]() {
+					  TexturePrefetcher prefetcher {};
+					  for(auto &path : texFiles)
+						  prefetcher.Prefetch(path);
+					  std::vector<uint8_t> data;
+					  for(auto &path : texFiles) {
+						  prefetcher.ReadFile(path, data);
+						  consume(data.size());
+					  }
+				  },
+				  setup);
+			}
+			std::filesystem::remove_all(dir, ec);
+		}
+
+		static VmdConfig get_eval_motion_config(const PmxConfig &mdlConfig)
+		{
+			VmdConfig config {};
+			config.boneCount = mdlConfig.boneCount;
+			config.keysPerBone = 100;
+			config.morphCount = mdlConfig.morphCount;
+			config.keysPerMorph = 100;
+			config.cameraKeyCount = 0;
+			return config;
+		}
+
+		static std::unique_ptr<eval::EvalWorkspace> create_eval_workspace(const PmxConfig &mdlConfig, uint32_t &outLastFrame)
+		{
+			auto mdlBytes = generate_pmx(mdlConfig);
+			auto motionConfig = get_eval_motion_config(mdlConfig);
+			auto motionBytes = generate_vmd(motionConfig);
+			SpanFile mdlFile {mdlBytes};
+			SpanFile motionFile {motionBytes};
+			std::shared_ptr<const pmx::ModelData> mdl = pmx::load(mdlFile);
+			std::shared_ptr<const vmd::AnimationData> anim = vmd::load(motionFile);
+			if(!mdl || !anim)
+				return nullptr;
+			outLastFrame = (motionConfig.keysPerBone - 1) * motionConfig.frameStep;
+			return eval::EvalWorkspace::Create(mdl, anim);
+		}
+
+		static void run_eval_benchmarks(Runner &runner)
+		{
+			for(auto &preset : get_model_presets()) {
+				uint32_t lastFrame = 0;
+				auto ws = create_eval_workspace(preset.config, lastFrame);
+				if(!ws)
+					continue;
+				auto frame = 0.f;
+				runner.Run(std::string {"eval.frame/"} + preset.name, 0, [&ws, &frame, lastFrame]() {
+					ws->Evaluate(frame);
+					frame = (frame + 1.f <= lastFrame) ? (frame + 1.f) : 0.f;
+					if(frame == 0.f)
+						ws->Reset();
+					consume(static_cast<uint64_t>(ws->GetSkinnedPositions().front().y));
+				});
+			}
+		}
+
+		// Plays back every model preset twice. The first pass is the warmup, during the second pass no frame may allocate.
+		static int check_allocations()
+		{
+			auto failed = false;
+			for(auto &preset : get_model_presets()) {
+				uint32_t lastFrame = 0;
+				auto ws = create_eval_workspace(preset.config, lastFrame);
+				if(!ws) {
+					fprintf(stderr, "Failed to create evaluation workspace for '%s'\n", preset.name);
+					return 1;
+				}
+				for(uint32_t frame = 0; frame <= lastFrame; ++frame)
+					ws->Evaluate(static_cast<float>(frame));
+				ws->Reset();
+				uint64_t allocatingFrames = 0;
+				uint64_t totalAllocations = 0;
+				for(uint32_t frame = 0; frame <= lastFrame; ++frame) {
+					g_allocationCount = 0;
+					g_countAllocations = true;
+					ws->Evaluate(static_cast<float>(frame) + 0.5f);
+					g_countAllocations = false;
+					if(g_allocationCount > 0) {
+						++allocatingFrames;
+						totalAllocations += g_allocationCount;
+					}
+				}
+				printf("%-40s %u frames, %llu allocating frames, %llu allocations\n", (std::string {"eval.frame/"} + preset.name).c_str(), lastFrame + 1, static_cast<unsigned long long>(allocatingFrames),
+				  static_cast<unsigned long long>(totalAllocations));
+				failed = failed || (allocatingFrames > 0);
+			}
+			return failed ? 1 : 0;
+		}
+
+		static int load_file(const std::string &path)
+		{
+			LoadStats stats {};
+			auto isMotion = (path.size() >= 4 && path.compare(path.size() - 4, 4, ".vmd") == 0);
+			auto loaded = isMotion ? (vmd::load(path, &stats) != nullptr) : (pmx::load(path, pmx::LoadFlags::All, &stats) != nullptr);
+			if(!loaded) {
+				fprintf(stderr, "Failed to load '%s'\n", path.c_str());
+				return 1;
+			}
+			for(size_t i = 0; i < stats.sections.size(); ++i) {
+				auto &section = stats.sections[i];
+				if(section.nanoseconds == 0 && section.bytes == 0)
+					continue;
+				printf("%-16s %12.3f ms %12llu bytes\n", std::string {to_string(static_cast<LoadSection>(i))}.c_str(), section.nanoseconds * 1e-6, static_cast<unsigned long long>(section.bytes));
+			}
+			printf("total %.3f ms, %llu reads, %llu bytes read, %llu bytes transcoded, %llu allocations, %llu bytes in memory\n", stats.totalNanoseconds * 1e-6, static_cast<unsigned long long>(stats.readCalls),
+			  static_cast<unsigned long long>(stats.bytesRead), static_cast<unsigned long long>(stats.bytesTranscoded), static_cast<unsigned long long>(stats.allocationCount), static_cast<unsigned long long>(stats.memoryFootprint));
+			return 0;
+		}
+	};
+};
+
+int main(int argc, char *argv[])
+{
+	using namespace mmd::bench;
+	Options options {};
+	for(int i = 1; i < argc; ++i) {
+		auto hasValue = (i + 1 < argc);
+		if(strcmp(argv[i], "--iterations") == 0 && hasValue)
+			options.iterations = std::max(std::stoi(argv[++i]), 1);
+		else if(strcmp(argv[i], "--warmup") == 0 && hasValue)
+			options.warmup = std::max(std::stoi(argv[++i]), 0);
+		else if(strcmp(argv[i], "--filter") == 0 && hasValue)
+			options.filter = argv[++i];
+		else if(strcmp(argv[i], "--json") == 0)
+			options.json = true;
+		else if(strcmp(argv[i], "--load") == 0 && hasValue)
+			return load_file(argv[++i]);
+		else if(strcmp(argv[i], "--check-allocations") == 0)
+			return check_allocations();
+		else {
+			fprintf(stderr, "Usage: %s [--iterations N] [--warmup N] [--filter SUBSTRING] [--json] | --load FILE | --check-allocations\n", argv[0]);
+			return 1;
+		}
+	}
+	Runner runner {options};
+	run_model_benchmarks(runner);
+	run_motion_benchmarks(runner);
+	run_eval_benchmarks(runner);
+	run_io_benchmarks(runner);
+	run_texture_benchmarks(runner);
+	if(options.json)
+		runner.PrintJson();
+	return 0;
+}
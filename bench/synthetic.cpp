@@ -0,0 +1,291 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "synthetic.hpp"
+#include "util_mmd_encoding.hpp"
+#include <sharedutils/util_ifile.hpp>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace mmd {
+	namespace bench {
+		class ByteWriter {
+		  public:
+			template<typename T>
+			void Write(const T &value)
+			{
+				auto offset = m_data.size();
+				m_data.resize(offset + sizeof(T));
+				memcpy(m_data.data() + offset, &value, sizeof(T));
+			}
+			void WriteFloats(std::initializer_list<float> values)
+			{
+				for(auto v : values)
+					Write(v);
+			}
+			void WriteIndex(int64_t index, uint8_t size)
+			{
+				switch(size) {
+				case 1:
+					Write(static_cast<int8_t>(index));
+					break;
+				case 2:
+					Write(static_cast<int16_t>(index));
+					break;
+				default:
+					Write(static_cast<int32_t>(index));
+					break;
+				}
+			}
+			void WriteText(const std::string &text, pmx::TextEncoding encoding)
+			{
+				// Names are generated as ASCII, so UTF-16 is a plain widening
+				if(encoding == pmx::TextEncoding::UTF8) {
+					Write(static_cast<int32_t>(text.size()));
+					m_data.insert(m_data.end(), text.begin(), text.end());
+					return;
+				}
+				Write(static_cast<int32_t>(text.size() * 2));
+				for(auto c : text)
+					Write(static_cast<uint16_t>(c));
+			}
+			std::vector<uint8_t> &GetData() { return m_data; }
+		  private:
+			std::vector<uint8_t> m_data;
+		};
+
+		// Write-only file over a growing buffer
+		class VectorFile : public ufile::IFile {
+		  public:
+			virtual size_t Read(void *, size_t) override { return 0; }
+			virtual size_t Write(const void *data, size_t size) override
+			{
+				auto *bytes = static_cast<const uint8_t *>(data);
+				m_data.insert(m_data.end(), bytes, bytes + size);
+				return size;
+			}
+			virtual size_t Tell() override { return m_data.size(); }
+			virtual void Seek(size_t, ufile::Whence = ufile::Whence::Set) override {}
+			virtual int32_t ReadChar() override { return -1; }
+			std::vector<uint8_t> &GetData() { return m_data; }
+		  private:
+			std::vector<uint8_t> m_data;
+		};
+
+		static uint8_t get_index_size(uint8_t configured, uint64_t count, bool isUnsigned)
+		{
+			if(configured != 0)
+				return configured;
+			if(count < (isUnsigned ? 256u : 128u))
+				return 1;
+			if(count < (isUnsigned ? 65536u : 32768u))
+				return 2;
+			return 4;
+		}
+	};
+};
+
+std::vector<uint8_t> mmd::bench::generate_pmx(const PmxConfig &config)
+{
+	using namespace pmx;
+	std::mt19937 rng {config.seed};
+	std::uniform_real_distribution<float> dist {-1.f, 1.f};
+	auto rand = [&rng, &dist]() { return dist(rng); };
+
+	auto boneCount = std::max(config.boneCount, 1u);
+	auto materialCount = std::max(config.materialCount, 1u);
+	auto vertexIndexSize = get_index_size(config.vertexIndexSize, config.vertexCount, true);
+	auto textureIndexSize = get_index_size(config.otherIndexSize, config.textureCount, false);
+	auto materialIndexSize = get_index_size(config.otherIndexSize, materialCount, false);
+	auto boneIndexSize = get_index_size(config.otherIndexSize, boneCount, false);
+	auto morphIndexSize = get_index_size(config.otherIndexSize, config.morphCount, false);
+	auto rigidBodyIndexSize = get_index_size(config.otherIndexSize, config.rigidBodyCount, false);
+	auto encoding = config.textEncoding;
+
+	ByteWriter w;
+	w.Write(std::array<char, 4> {'P', 'M', 'X', ' '});
+	w.Write(2.f);
+	w.Write(static_cast<uint8_t>(8));
+	w.Write(static_cast<uint8_t>(encoding));
+	w.Write(config.additionalUvCount);
+	for(auto size : {vertexIndexSize, textureIndexSize, materialIndexSize, boneIndexSize, morphIndexSize, rigidBodyIndexSize})
+		w.Write(size);
+	w.WriteText("synthetic", encoding);
+	w.WriteText("synthetic", encoding);
+	w.WriteText("Generated by util_mmd_bench", encoding);
+	w.WriteText("Generated by util_mmd_bench", encoding);
+
+	w.Write(static_cast<int32_t>(config.vertexCount));
+	auto randomBone = [&rng, boneCount]() { return static_cast<int32_t>(rng() % boneCount); };
+	for(uint32_t i = 0; i < config.vertexCount; ++i) {
+		w.WriteFloats({rand() * 10.f, rand() * 10.f + 10.f, rand() * 10.f, 0.f, 1.f, 0.f, (rand() + 1.f) * 0.5f, (rand() + 1.f) * 0.5f});
+		for(uint8_t j = 0; j < config.additionalUvCount; ++j)
+			w.WriteFloats({rand(), rand(), rand(), rand()});
+		auto mode = config.weightMode;
+		if(mode == WeightMode::Mixed)
+			mode = static_cast<WeightMode>(i % umath::to_integral(WeightMode::Mixed));
+		w.Write(static_cast<uint8_t>(mode));
+		switch(mode) {
+		case WeightMode::BDEF1:
+			w.WriteIndex(randomBone(), boneIndexSize);
+			break;
+		case WeightMode::BDEF2:
+			w.WriteIndex(randomBone(), boneIndexSize);
+			w.WriteIndex(randomBone(), boneIndexSize);
+			w.Write(0.5f);
+			break;
+		case WeightMode::BDEF4:
+			for(uint8_t j = 0; j < 4; ++j)
+				w.WriteIndex(randomBone(), boneIndexSize);
+			w.WriteFloats({0.4f, 0.3f, 0.2f, 0.1f});
+			break;
+		default:
+			w.WriteIndex(randomBone(), boneIndexSize);
+			w.WriteIndex(randomBone(), boneIndexSize);
+			w.Write(0.5f);
+			w.WriteFloats({0.f, 10.f, 0.f, 0.f, 11.f, 0.f, 0.f, 9.f, 0.f});
+			break;
+		}
+		w.Write(1.f); // Edge scale
+	}
+
+	w.Write(static_cast<int32_t>(config.triangleCount * 3));
+	for(uint32_t i = 0; i < config.triangleCount * 3; ++i)
+		w.WriteIndex((config.vertexCount > 0) ? (rng() % config.vertexCount) : 0, vertexIndexSize);
+
+	w.Write(static_cast<int32_t>(config.textureCount));
+	for(uint32_t i = 0; i < config.textureCount; ++i)
+		w.WriteText("tex/texture_" + std::to_string(i) + ".png", encoding);
+
+	w.Write(static_cast<int32_t>(materialCount));
+	auto indicesPerMaterial = (config.triangleCount / materialCount) * 3;
+	for(uint32_t i = 0; i < materialCount; ++i) {
+		auto name = "material_" + std::to_string(i);
+		w.WriteText(name, encoding);
+		w.WriteText(name, encoding);
+		w.WriteFloats({1.f, 1.f, 1.f, 1.f, 0.f, 0.f, 0.f, 5.f, 0.5f, 0.5f, 0.5f});
+		w.Write(static_cast<uint8_t>(DrawingMode::NoCull | DrawingMode::HasEdge));
+		w.WriteFloats({0.f, 0.f, 0.f, 1.f, 1.f});
+		w.WriteIndex((config.textureCount > 0) ? static_cast<int64_t>(i % config.textureCount) : -1, textureIndexSize);
+		w.WriteIndex(-1, textureIndexSize);
+		w.Write(static_cast<int8_t>(0)); // Sphere mode
+		w.Write(static_cast<int8_t>(1)); // Shared toon
+		w.Write(static_cast<int8_t>(i % 10));
+		w.WriteText("", encoding);
+		auto faceCount = (i == materialCount - 1) ? (config.triangleCount * 3 - indicesPerMaterial * i) : indicesPerMaterial;
+		w.Write(static_cast<int32_t>(faceCount));
+	}
+
+	w.Write(static_cast<int32_t>(boneCount));
+	constexpr auto boneFlags = BoneFlag::Rotatable | BoneFlag::Translatable | BoneFlag::IsVisible | BoneFlag::Enabled;
+	for(uint32_t i = 0; i < boneCount; ++i) {
+		auto name = "bone_" + std::to_string(i);
+		w.WriteText(name, encoding);
+		w.WriteText(name, encoding);
+		w.WriteFloats({0.f, static_cast<float>(i) * 0.5f, 0.f});
+		w.WriteIndex(static_cast<int64_t>(i) - 1, boneIndexSize);
+		w.Write(static_cast<int32_t>(0));
+		w.Write(boneFlags);
+		w.WriteFloats({0.f, 0.5f, 0.f});
+	}
+
+	w.Write(static_cast<int32_t>(config.morphCount));
+	for(uint32_t i = 0; i < config.morphCount; ++i) {
+		auto name = "morph_" + std::to_string(i);
+		w.WriteText(name, encoding);
+		w.WriteText(name, encoding);
+		w.Write(static_cast<int8_t>(1 + (i % 4)));
+		w.Write(MorphType::Vertex);
+		auto count = (config.vertexCount > 0) ? std::min(config.verticesPerMorph, config.vertexCount) : 0u;
+		w.Write(static_cast<int32_t>(count));
+		for(uint32_t j = 0; j < count; ++j) {
+			w.WriteIndex(rng() % config.vertexCount, vertexIndexSize);
+			w.WriteFloats({rand() * 0.1f, rand() * 0.1f, rand() * 0.1f});
+		}
+	}
+
+	w.Write(static_cast<int32_t>(0)); // Display frames
+
+	w.Write(static_cast<int32_t>(config.rigidBodyCount));
+	for(uint32_t i = 0; i < config.rigidBodyCount; ++i) {
+		auto name = "rigid_body_" + std::to_string(i);
+		w.WriteText(name, encoding);
+		w.WriteText(name, encoding);
+		auto boneIndex = i % boneCount;
+		w.WriteIndex(boneIndex, boneIndexSize);
+		w.Write(static_cast<uint8_t>(i % 16));
+		w.Write(static_cast<uint16_t>(0xFFFF));
+		w.Write(RigidBodyShape::Capsule);
+		w.WriteFloats({0.2f, 0.5f, 0.f, 0.f, static_cast<float>(boneIndex) * 0.5f + 0.25f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.5f, 0.5f, 0.f, 0.5f});
+		// Every chain starts with a kinematic body
+		w.Write((boneIndex == 0) ? PhysicsMode::FollowBone : PhysicsMode::Physics);
+	}
+
+	auto jointCount = (config.rigidBodyCount > 0) ? (config.rigidBodyCount - 1) : 0;
+	w.Write(static_cast<int32_t>(jointCount));
+	for(uint32_t i = 0; i < jointCount; ++i) {
+		auto name = "joint_" + std::to_string(i);
+		w.WriteText(name, encoding);
+		w.WriteText(name, encoding);
+		w.Write(JointType::Spring6Dof);
+		w.WriteIndex(i, rigidBodyIndexSize);
+		w.WriteIndex(i + 1, rigidBodyIndexSize);
+		w.WriteFloats({0.f, static_cast<float>(i % boneCount) * 0.5f + 0.5f, 0.f, 0.f, 0.f, 0.f});
+		w.WriteFloats({0.f, 0.f, 0.f, 0.f, 0.f, 0.f, -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f});
+		w.WriteFloats({0.f, 0.f, 0.f, 10.f, 10.f, 10.f});
+	}
+	return std::move(w.GetData());
+}
+
+std::vector<uint8_t> mmd::bench::generate_vmd(const VmdConfig &config)
+{
+	using namespace vmd;
+	std::mt19937 rng {config.seed};
+	std::uniform_real_distribution<float> dist {-1.f, 1.f};
+	auto rand = [&rng, &dist]() { return dist(rng); };
+
+	AnimationData animData {};
+	animData.modelName = "synthetic";
+	animData.keyframes.reserve(config.boneCount * config.keysPerBone);
+	for(uint32_t i = 0; i < config.boneCount; ++i) {
+		std::array<char, 15> name {};
+		encode_name("bone_" + std::to_string(i), name);
+		for(uint32_t j = 0; j < config.keysPerBone; ++j) {
+			auto &key = animData.keyframes.emplace_back();
+			key.boneName = name;
+			key.frameIndex = j * config.frameStep;
+			key.position = {rand(), rand(), rand()};
+			key.rotation = {0.f, 0.f, 0.f, 1.f};
+			for(uint32_t k = 0; k < 16; ++k)
+				key.interpolation[k] = static_cast<uint8_t>(20 + rng() % 88);
+		}
+	}
+	animData.morphs.reserve(config.morphCount * config.keysPerMorph);
+	for(uint32_t i = 0; i < config.morphCount; ++i) {
+		std::array<char, 15> name {};
+		encode_name("morph_" + std::to_string(i), name);
+		for(uint32_t j = 0; j < config.keysPerMorph; ++j) {
+			auto &key = animData.morphs.emplace_back();
+			key.morphName = name;
+			key.frameIndex = j * config.frameStep;
+			key.weight = (rand() + 1.f) * 0.5f;
+		}
+	}
+	animData.cameras.reserve(config.cameraKeyCount);
+	for(uint32_t i = 0; i < config.cameraKeyCount; ++i) {
+		auto &key = animData.cameras.emplace_back();
+		key.frameIndex = i * config.frameStep;
+		key.negDistance = -45.f + rand();
+		key.position = {rand(), 10.f + rand(), rand()};
+		key.angles = {rand() * 0.2f, rand(), 0.f};
+		for(auto &b : key.interpolation)
+			b = static_cast<uint8_t>(20 + rng() % 88);
+		key.viewingngle = 30;
+		key.perspective = 0;
+	}
+	VectorFile f;
+	write(animData, f);
+	return std::move(f.GetData());
+}
@@ -0,0 +1,48 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_BENCH_SYNTHETIC_HPP__
+#define __UTIL_MMD_BENCH_SYNTHETIC_HPP__
+
+#include "util_mmd.hpp"
+#include <cinttypes>
+#include <vector>
+
+namespace mmd {
+	namespace bench {
+		enum class WeightMode : uint8_t { BDEF1 = 0, BDEF2, BDEF4, SDEF, Mixed };
+
+		struct PmxConfig {
+			uint32_t vertexCount = 10'000;
+			uint32_t triangleCount = 15'000;
+			uint32_t materialCount = 8;
+			uint32_t textureCount = 8;
+			uint32_t boneCount = 200;
+			uint32_t morphCount = 50;
+			uint32_t verticesPerMorph = 200;
+			uint32_t rigidBodyCount = 0; // Rigid bodies form chains along the bones, connected by joints
+			uint8_t additionalUvCount = 0;
+			WeightMode weightMode = WeightMode::Mixed;
+			pmx::TextEncoding textEncoding = pmx::TextEncoding::UTF16;
+			// Index sizes in bytes, 0 picks the smallest size that can address all elements
+			uint8_t vertexIndexSize = 0;
+			uint8_t otherIndexSize = 0;
+			uint32_t seed = 1;
+		};
+		std::vector<uint8_t> generate_pmx(const PmxConfig &config);
+
+		struct VmdConfig {
+			uint32_t boneCount = 100;
+			uint32_t keysPerBone = 300;
+			uint32_t morphCount = 30;
+			uint32_t keysPerMorph = 100;
+			uint32_t cameraKeyCount = 500;
+			uint32_t frameStep = 3; // Frames between consecutive keys of a track
+			uint32_t seed = 1;
+		};
+		std::vector<uint8_t> generate_vmd(const VmdConfig &config);
+	};
+};
+
+#endif
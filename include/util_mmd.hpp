@@ -7,9 +7,15 @@
 
 #include <array>
 #include <cinttypes>
+#include <cstddef>
 #include <vector>
 #include <memory>
+#include <memory_resource>
+#include <span>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include "util_mmd_string.hpp"
 #include <mathutil/umath.h>
 #include <mathutil/umat.h>
 
@@ -17,6 +23,11 @@ namespace ufile {
 	struct IFile;
 };
 namespace mmd {
+	struct LoadStats;
+	class IoBackend;
+	// All containers of pmx::ModelData and vmd::AnimationData allocate from the memory resource of this allocator
+	// (see pmx::load and vmd::load). Default-constructed data uses std::pmr::get_default_resource().
+	using Allocator = std::pmr::polymorphic_allocator<std::byte>;
 	namespace pmx {
 		enum class DrawingMode : uint8_t { NoCull = 1, GroundShadow = NoCull << 1u, DrawShadow = GroundShadow << 1u, ReceiveShadow = DrawShadow << 1u, HasEdge = ReceiveShadow << 1u, VertexColor = HasEdge << 1u, PointDrawing = VertexColor << 1u, LineDrawing = PointDrawing << 1u };
 		REGISTER_BASIC_BITWISE_OPERATORS(DrawingMode);
@@ -40,6 +51,31 @@ namespace mmd {
 
 		enum class MorphType : int8_t { Group = 0, Vertex, Bone, Uv, Uva1, Uva2, Uva3, Uva4, Material, Flip, Impulse };
 
+		enum class TextEncoding : char { UTF16 = 0, UTF8 };
+		enum class IndexType : char { Byte = 1, Short = 2, Int = 4 };
+
+		enum class LoadFlags : uint32_t {
+			None = 0,
+			DisplayFrames = 1,
+			Physics = DisplayFrames << 1, // Rigid bodies and joints
+			SoftBodies = Physics << 1,
+
+			Default = Physics | SoftBodies,
+			All = DisplayFrames | Physics | SoftBodies
+		};
+		REGISTER_BASIC_BITWISE_OPERATORS(LoadFlags);
+
+		enum class DisplayFrameTargetType : uint8_t { Bone = 0, Morph };
+
+		enum class RigidBodyShape : uint8_t { Sphere = 0, Box, Capsule };
+		enum class PhysicsMode : uint8_t { FollowBone = 0, Physics, PhysicsWithBone };
+		enum class JointType : uint8_t { Spring6Dof = 0, SixDof, P2P, ConeTwist, Slider, Hinge };
+
+		enum class SoftBodyShape : uint8_t { TriMesh = 0, Rope };
+		enum class SoftBodyFlag : uint8_t { None = 0, BLink = 1, ClusterCreation = BLink << 1, LinkCrossing = ClusterCreation << 1 };
+		REGISTER_BASIC_BITWISE_OPERATORS(SoftBodyFlag);
+		enum class SoftBodyAeroModel : int32_t { VPoint = 0, VTwoSided, VOneSided, FTwoSided, FOneSided };
+
 		struct VertexData {
 			std::array<float, 3> position;
 			std::array<float, 3> normal;
@@ -49,7 +85,17 @@ namespace mmd {
 		};
 
 		struct MaterialData {
-			std::string name;
+			using allocator_type = Allocator;
+			MaterialData() = default;
+			explicit MaterialData(const allocator_type &alloc) : name {alloc}, memo {alloc} {}
+			MaterialData(const MaterialData &other, const allocator_type &alloc) : MaterialData {alloc} { *this = other; }
+			MaterialData(MaterialData &&other, const allocator_type &alloc) : MaterialData {alloc} { *this = std::move(other); }
+			MaterialData(const MaterialData &) = default;
+			MaterialData(MaterialData &&) = default;
+			MaterialData &operator=(const MaterialData &) = default;
+			MaterialData &operator=(MaterialData &&) = default;
+
+			std::pmr::string name;
 			std::array<float, 4> diffuseColor;
 			std::array<float, 3> specularColor;
 			float specularity = 0.f;
@@ -62,18 +108,50 @@ namespace mmd {
 			char sphereMode = 0;
 			char toonFlag = 0;
 			int32_t toonIndex = -1;
-			std::string memo;
+			std::pmr::string memo;
 			int32_t faceCount = -1;
 		};
 
 		struct Bone {
-			std::string nameJp;
-			std::string name;
+			using allocator_type = Allocator;
+			Bone() = default;
+			explicit Bone(const allocator_type &alloc) : nameJp {alloc}, name {alloc} {}
+			Bone(const Bone &other, const allocator_type &alloc) : Bone {alloc} { *this = other; }
+			Bone(Bone &&other, const allocator_type &alloc) : Bone {alloc} { *this = std::move(other); }
+			Bone(const Bone &) = default;
+			Bone(Bone &&) = default;
+			Bone &operator=(const Bone &) = default;
+			Bone &operator=(Bone &&) = default;
+
+			std::pmr::string nameJp;
+			std::pmr::string name;
 			Vector3 position;
 			int32_t parentBoneIdx = -1;
 			int32_t layer = -1;
 			BoneFlag flags = BoneFlag::None;
 			Mat3 rotation = umat::identity();
+			int32_t ikChainIndex = -1; // Index into ModelData::ikChains if the bone has the IK flag
+			// Bone whose local rotation and/or translation is added to this bone, scaled by inheritInfluence.
+			// Only used with the InheritRotation or InheritTranslation flag.
+			int32_t inheritBoneIdx = -1;
+			float inheritInfluence = 0.f;
+		};
+
+		struct IkLink {
+			int32_t boneIndex = -1;
+			bool hasLimits = false;
+			std::array<float, 3> minAngle = {0.f, 0.f, 0.f};
+			std::array<float, 3> maxAngle = {0.f, 0.f, 0.f};
+		};
+
+		// The links of a chain are ModelData::ikLinks[linkOffset] to ModelData::ikLinks[linkOffset +linkCount -1]
+		struct IkChain {
+			int32_t boneIndex = -1;
+			int32_t targetBoneIndex = -1;
+			int32_t loopCount = 0;
+			float limitAngle = 0.f;
+			uint32_t linkOffset = 0;
+			uint32_t linkCount = 0;
 		};
 
 		struct BaseMorph {};
@@ -120,36 +198,272 @@ namespace mmd {
 			Vector3 velocity;
 			Vector3 torque;
 		};
+
+		// Rigid bodies as a structure of arrays, so that a physics engine can be initialized with bulk copies.
+		// All arrays have the same length.
+		struct RigidBodies {
+			using allocator_type = Allocator;
+			RigidBodies() = default;
+			explicit RigidBodies(const allocator_type &alloc);
+			size_t size() const { return boneIndices.size(); }
+			std::pmr::vector<std::pmr::string> namesLocal;
+			std::pmr::vector<std::pmr::string> namesGlobal;
+			std::pmr::vector<int32_t> boneIndices;
+			std::pmr::vector<uint8_t> groups;
+			std::pmr::vector<uint16_t> noCollisionMasks;
+			std::pmr::vector<RigidBodyShape> shapes;
+			// Sphere: (radius, -, -), box: half extents, capsule: (radius, height, -)
+			std::pmr::vector<Vector3> sizes;
+			std::pmr::vector<Vector3> positions;
+			std::pmr::vector<Vector3> rotations; // Euler angles in radians
+			std::pmr::vector<float> masses;
+			std::pmr::vector<float> linearDampings;
+			std::pmr::vector<float> angularDampings;
+			std::pmr::vector<float> restitutions;
+			std::pmr::vector<float> frictions;
+			std::pmr::vector<PhysicsMode> physicsModes;
+
+			// Derived data, see compute_rigid_body_transforms
+			std::pmr::vector<Vector4> orientations; // Quaternion (x, y, z, w)
+			std::pmr::vector<Vector3> boneOffsets;  // Position relative to the rest position of the bone
+			std::pmr::vector<Vector3> aabbMin;      // Rest pose bounds
+			std::pmr::vector<Vector3> aabbMax;
+		};
+
+		// Joints as a structure of arrays; All arrays have the same length.
+		struct Joints {
+			using allocator_type = Allocator;
+			Joints() = default;
+			explicit Joints(const allocator_type &alloc);
+			size_t size() const { return types.size(); }
+			std::pmr::vector<std::pmr::string> namesLocal;
+			std::pmr::vector<std::pmr::string> namesGlobal;
+			std::pmr::vector<JointType> types;
+			std::pmr::vector<int32_t> rigidBodyA;
+			std::pmr::vector<int32_t> rigidBodyB;
+			std::pmr::vector<Vector3> positions;
+			std::pmr::vector<Vector3> rotations; // Euler angles in radians
+			std::pmr::vector<Vector3> positionMin;
+			std::pmr::vector<Vector3> positionMax;
+			std::pmr::vector<Vector3> rotationMin;
+			std::pmr::vector<Vector3> rotationMax;
+			std::pmr::vector<Vector3> springPositions;
+			std::pmr::vector<Vector3> springRotations;
+
+			// Derived data, see compute_rigid_body_transforms
+			std::pmr::vector<Vector4> orientations; // Quaternion (x, y, z, w)
+		};
+
+		// Soft body parameters (PMX 2.1), named after the corresponding Bullet soft body configuration
+		struct SoftBodyConfig {
+			float vcf; // Velocity correction factor
+			float dp;  // Damping
+			float dg;  // Drag
+			float lf;  // Lift
+			float pr;  // Pressure
+			float vc;  // Volume conservation
+			float df;  // Dynamic friction
+			float mt;  // Pose matching
+			float chr; // Rigid contact hardness
+			float khr; // Kinetic contact hardness
+			float shr; // Soft contact hardness
+			float ahr; // Anchor hardness
+		};
+		struct SoftBodyClusterConfig {
+			float srhr;
+			float skhr;
+			float sshr;
+			float srSplt;
+			float skSplt;
+			float ssSplt;
+		};
+		struct SoftBodyIterations {
+			int32_t velocity;
+			int32_t position;
+			int32_t drift;
+			int32_t cluster;
+		};
+		struct SoftBodyMaterial {
+			float linearStiffness;
+			float angularStiffness;
+			float volumeStiffness;
+		};
 #pragma pack(pop)
 
+		struct SoftBodyAnchor {
+			int32_t rigidBodyIndex = -1;
+			int32_t vertexIndex = -1;
+			bool nearMode = false;
+		};
+
+		// The anchors and pinned vertices of all soft bodies are stored in contiguous arrays in ModelData,
+		// the offset/count pairs refer to those.
+		struct SoftBody {
+			using allocator_type = Allocator;
+			SoftBody() = default;
+			explicit SoftBody(const allocator_type &alloc) : nameLocal {alloc}, nameGlobal {alloc} {}
+			SoftBody(const SoftBody &other, const allocator_type &alloc) : SoftBody {alloc} { *this = other; }
+			SoftBody(SoftBody &&other, const allocator_type &alloc) : SoftBody {alloc} { *this = std::move(other); }
+			SoftBody(const SoftBody &) = default;
+			SoftBody(SoftBody &&) = default;
+			SoftBody &operator=(const SoftBody &) = default;
+			SoftBody &operator=(SoftBody &&) = default;
+
+			std::pmr::string nameLocal;
+			std::pmr::string nameGlobal;
+			SoftBodyShape shape = SoftBodyShape::TriMesh;
+			int32_t materialIndex = -1;
+			uint8_t group = 0;
+			uint16_t noCollisionMask = 0;
+			SoftBodyFlag flags = SoftBodyFlag::None;
+			int32_t bLinkDistance = 0;
+			int32_t clusterCount = 0;
+			float totalMass = 0.f;
+			float collisionMargin = 0.f;
+			SoftBodyAeroModel aeroModel = SoftBodyAeroModel::VPoint;
+			SoftBodyConfig config;
+			SoftBodyClusterConfig cluster;
+			SoftBodyIterations iterations;
+			SoftBodyMaterial material;
+			uint32_t anchorOffset = 0;
+			uint32_t anchorCount = 0;
+			uint32_t pinnedVertexOffset = 0;
+			uint32_t pinnedVertexCount = 0;
+		};
+
+		struct DisplayFrameEntry {
+			DisplayFrameTargetType type = DisplayFrameTargetType::Bone;
+			int32_t index = -1;
+		};
+
+		// The entries of all display frames are stored in ModelData::displayFrameEntries,
+		// entryOffset/entryCount refer to that array.
+		struct DisplayFrame {
+			using allocator_type = Allocator;
+			DisplayFrame() = default;
+			explicit DisplayFrame(const allocator_type &alloc) : nameLocal {alloc}, nameGlobal {alloc} {}
+			DisplayFrame(const DisplayFrame &other, const allocator_type &alloc) : DisplayFrame {alloc} { *this = other; }
+			DisplayFrame(DisplayFrame &&other, const allocator_type &alloc) : DisplayFrame {alloc} { *this = std::move(other); }
+			DisplayFrame(const DisplayFrame &) = default;
+			DisplayFrame(DisplayFrame &&) = default;
+			DisplayFrame &operator=(const DisplayFrame &) = default;
+			DisplayFrame &operator=(DisplayFrame &&) = default;
+
+			std::pmr::string nameLocal;
+			std::pmr::string nameGlobal;
+			bool special = false;
+			uint32_t entryOffset = 0;
+			uint32_t entryCount = 0;
+		};
+
+		struct Header {
+			TextEncoding textEncoding = TextEncoding::UTF16;
+			uint8_t appendixDataCount = 0;
+			IndexType vertexIndexSize = IndexType::Int;
+			IndexType textureIndexSize = IndexType::Int;
+			IndexType materialIndexSize = IndexType::Int;
+			IndexType boneIndexSize = IndexType::Int;
+			IndexType morphIndexSize = IndexType::Int;
+			IndexType rigidBodyIndexSize = IndexType::Int;
+		};
+
+		struct Morph;
+		// Returns the memory of the morph to the resource it was allocated from
+		struct MorphDeleter {
+			void operator()(Morph *morph) const;
+		};
+		using MorphPtr = std::unique_ptr<Morph, MorphDeleter>;
 		struct Morph {
+			using allocator_type = Allocator;
+			// Allocates the morph itself from the allocator as well
+			static MorphPtr Create(const allocator_type &alloc = {});
+			explicit Morph(const allocator_type &alloc = {}) : nameLocal {alloc}, nameGlobal {alloc} {}
+			Morph(const Morph &) = delete;
+			Morph &operator=(const Morph &) = delete;
 			~Morph();
-			std::string nameLocal;
-			std::string nameGlobal;
+			// Allocates the morph array from the allocator of the morph, the elements are freed by the destructor
+			template<class T>
+			T *AllocateMorphs(int32_t count)
+			{
+				auto *elements = allocator_type {nameLocal.get_allocator()}.template allocate_object<T>(count);
+				std::uninitialized_default_construct_n(elements, count);
+				morphs = elements;
+				this->count = count;
+				return elements;
+			}
+			std::pmr::string nameLocal;
+			std::pmr::string nameGlobal;
 			int8_t panelType;
 			MorphType type;
-			int32_t count;
+			int32_t count = 0;
 
-			BaseMorph *morphs;
+			BaseMorph *morphs = nullptr;
 		};
 
 		struct ModelData {
+			using allocator_type = Allocator;
+			ModelData() = default;
+			explicit ModelData(const allocator_type &alloc);
 			float version = 0.f;
-			std::string characterName;
-			std::string comment;
-			std::vector<VertexData> vertices;
-			std::vector<uint32_t> faces;
-			std::vector<std::string> textures;
-			std::vector<MaterialData> materials;
-			std::vector<Bone> bones;
-			std::vector<std::unique_ptr<Morph>> morphs;
-		};
-
-		std::shared_ptr<ModelData> load(const std::string &path);
-		std::shared_ptr<ModelData> load(ufile::IFile &f);
+			Header header;
+			std::pmr::string characterName;
+			std::pmr::string comment;
+			std::pmr::vector<VertexData> vertices;
+			std::pmr::vector<uint32_t> faces;
+			std::pmr::vector<std::pmr::string> textures;
+			std::pmr::vector<MaterialData> materials;
+			std::pmr::vector<Bone> bones;
+			std::pmr::vector<IkChain> ikChains;
+			std::pmr::vector<IkLink> ikLinks;
+			std::pmr::vector<MorphPtr> morphs;
+			std::pmr::vector<DisplayFrame> displayFrames;
+			std::pmr::vector<DisplayFrameEntry> displayFrameEntries;
+			// File offset of the display frame section, or 0 if unknown
+			uint64_t displayFrameSectionOffset = 0;
+			RigidBodies rigidBodies;
+			Joints joints;
+			std::pmr::vector<SoftBody> softBodies;
+			std::pmr::vector<SoftBodyAnchor> softBodyAnchors;
+			std::pmr::vector<int32_t> softBodyPinnedVertices;
+		};
+
+		// If stats is not nullptr, it is filled with profiling information about the load (see util_mmd_stats.hpp)
+		// If resource is not nullptr, the model and all of its containers are allocated from it (e.g. a std::pmr::monotonic_buffer_resource
+		// that is released once the model is no longer needed); The resource has to outlive the model.
+		// The file is opened with the given I/O backend, or the default backend if io is nullptr (see util_mmd_io.hpp).
+		std::shared_ptr<ModelData> load(const std::string &path, LoadFlags flags = LoadFlags::Default, LoadStats *stats = nullptr, std::pmr::memory_resource *resource = nullptr, IoBackend *io = nullptr);
+		std::shared_ptr<ModelData> load(ufile::IFile &f, LoadFlags flags = LoadFlags::Default, LoadStats *stats = nullptr, std::pmr::memory_resource *resource = nullptr);
+		// Loads the display frames of a model that was loaded without LoadFlags::DisplayFrames.
+		// f has to be the file the model was loaded from.
+		bool load_display_frames(ufile::IFile &f, ModelData &mdlData);
+
+		// Computes the orientations, bone offsets and bounds of the rigid bodies and joints from their
+		// positions and rotations. Called by the loaders, only required if the physics data is modified.
+		void compute_rigid_body_transforms(ModelData &mdlData);
+
+		// Name lookup for the bones (Japanese names) and morphs (local names) of a model
+		class NameIndexMap {
+		  public:
+			NameIndexMap(const ModelData &mdlData);
+			int32_t FindBone(std::string_view name) const;
+			int32_t FindMorph(std::string_view name) const;
+		  private:
+			StringMap<int32_t> m_bones;
+			StringMap<int32_t> m_morphs;
+		};
+	};
+
+	namespace pmd {
+		// Loads a legacy PMD model and converts it to the PMX representation: Vertices use BDEF2 weights,
+		// face morphs are converted to vertex morphs and toon textures are mapped to shared or regular texture indices.
+		std::shared_ptr<pmx::ModelData> load(const std::string &path);
+		std::shared_ptr<pmx::ModelData> load(ufile::IFile &f);
+		std::shared_ptr<pmx::ModelData> load(std::span<const uint8_t> data);
 	};
 
 	namespace vmd {
+		enum class SelfShadowMode : uint8_t { Off = 0, Mode1, Mode2 };
+
 #pragma pack(push, 1)
 		struct Keyframe {
 			std::array<char, 15> boneName;
@@ -177,16 +491,84 @@ namespace mmd {
 			std::array<float, 3> color;
 			std::array<float, 3> position;
 		};
+		struct SelfShadow {
+			uint32_t frameIndex;
+			SelfShadowMode mode;
+			float distance;
+		};
+		struct IkState {
+			std::array<char, 20> boneName;
+			uint8_t enabled;
+		};
 #pragma pack(pop)
+		// Show/IK keyframes have a variable number of IK states, which are stored
+		// in AnimationData::ikStates. ikStateOffset/ikStateCount refer to that array.
+		struct ShowIk {
+			uint32_t frameIndex;
+			bool show;
+			uint32_t ikStateOffset;
+			uint32_t ikStateCount;
+		};
 		struct AnimationData {
-			std::string modelName;
-			std::vector<Keyframe> keyframes;
-			std::vector<Morph> morphs;
-			std::vector<Camera> cameras;
-			std::vector<Light> lights;
-		};
-		std::shared_ptr<AnimationData> load(const std::string &path);
-		std::shared_ptr<AnimationData> load(ufile::IFile &f);
+			using allocator_type = Allocator;
+			AnimationData() = default;
+			explicit AnimationData(const allocator_type &alloc);
+			AnimationData(const AnimationData &other, const allocator_type &alloc) : AnimationData {alloc} { *this = other; }
+			AnimationData(AnimationData &&other, const allocator_type &alloc) : AnimationData {alloc} { *this = std::move(other); }
+			AnimationData(const AnimationData &) = default;
+			AnimationData(AnimationData &&) = default;
+			AnimationData &operator=(const AnimationData &) = default;
+			AnimationData &operator=(AnimationData &&) = default;
+			std::pmr::string modelName; // UTF-8
+			std::pmr::vector<Keyframe> keyframes;
+			std::pmr::vector<Morph> morphs;
+			std::pmr::vector<Camera> cameras;
+			std::pmr::vector<Light> lights;
+			std::pmr::vector<SelfShadow> selfShadows;
+			std::pmr::vector<ShowIk> showIks;
+			std::pmr::vector<IkState> ikStates;
+		};
+		// See pmx::load for stats, resource and io
+		std::shared_ptr<AnimationData> load(const std::string &path, LoadStats *stats = nullptr, std::pmr::memory_resource *resource = nullptr, IoBackend *io = nullptr);
+		std::shared_ptr<AnimationData> load(ufile::IFile &f, LoadStats *stats = nullptr, std::pmr::memory_resource *resource = nullptr);
+
+		// Writes the motion as a version 2 VMD file. The model name is encoded to Shift-JIS, bone and morph names
+		// are written as they are stored in the keyframes. Bone interpolation tables are written in the canonical
+		// redundant layout that MMD expects.
+		bool write(const AnimationData &animData, ufile::IFile &f);
+		// Rebuilds rows 1-3 of a bone interpolation table from row 0
+		void canonicalize_interpolation(std::array<uint8_t, 64> &interpolation);
+	};
+
+	namespace vpd {
+		struct BonePose {
+			std::string name;
+			Vector3 translation;
+			Vector4 rotation; // Quaternion (x, y, z, w)
+		};
+		struct MorphPose {
+			std::string name;
+			float weight = 0.f;
+		};
+		// All names are UTF-8
+		struct Pose {
+			std::string modelFileName;
+			std::vector<BonePose> bones;
+			std::vector<MorphPose> morphs;
+		};
+		std::shared_ptr<Pose> load(const std::string &path);
+		std::shared_ptr<Pose> load(ufile::IFile &f);
+		std::shared_ptr<Pose> load(std::string_view data);
+		// Loads a pose library in parallel (numThreads = 0 uses all hardware threads).
+		// The result has the same order as the paths, with nullptr for files that failed to load.
+		std::vector<std::shared_ptr<Pose>> load(const std::vector<std::string> &paths, uint32_t numThreads = 0);
+
+		// Bone and morph indices of the model for every pose entry, -1 if the model has no matching bone/morph
+		struct PoseBinding {
+			std::vector<int32_t> boneIndices;
+			std::vector<int32_t> morphIndices;
+		};
+		PoseBinding bind(const Pose &pose, const pmx::NameIndexMap &nameMap);
 	};
 };
 
@@ -0,0 +1,77 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_ARCHIVE_HPP__
+#define __UTIL_MMD_ARCHIVE_HPP__
+
+#include "util_mmd.hpp"
+#include <span>
+#include <string_view>
+#include <sharedutils/util_ifile.hpp>
+
+#ifndef UTIL_MMD_ENABLE_ZIP
+#error "util_mmd_archive.hpp requires the library to be built with UTIL_MMD_ENABLE_ZIP"
+#endif
+
+namespace mmd {
+	class MappedFile;
+	// Read-only ZIP archive, as models are usually distributed. The central directory is read once when the archive is opened.
+	// Entry names are UTF-8 if the entry has the UTF-8 flag or an Info-ZIP Unicode path field, otherwise they are decoded
+	// from Shift-JIS. Names always use '/' as separator.
+	// The archive is immutable and can be used from multiple threads, each opened entry has its own read state.
+	// Only available if the library is built with UTIL_MMD_ENABLE_ZIP.
+	class Archive {
+	  public:
+		enum class Method : uint16_t { Stored = 0, Deflated = 8 };
+		struct Entry {
+			std::string name; // UTF-8
+			uint64_t size = 0;
+			uint64_t compressedSize = 0;
+			uint64_t localHeaderOffset = 0;
+			uint32_t crc32 = 0;
+			uint16_t method = 0;
+			bool encrypted = false;
+			bool IsDirectory() const { return !name.empty() && name.back() == '/'; }
+		};
+
+		// Returns nullptr if the file does not exist or is not a valid ZIP archive. The archive is memory-mapped.
+		static std::shared_ptr<Archive> Open(const std::string &path);
+		// The data is not copied and has to outlive the returned object
+		static std::shared_ptr<Archive> Create(std::span<const uint8_t> data);
+		Archive(const Archive &) = delete;
+		Archive &operator=(const Archive &) = delete;
+		~Archive();
+
+		const std::vector<Entry> &GetEntries() const { return m_entries; }
+		// Case-insensitive (ASCII only), '\' is accepted as separator
+		const Entry *FindEntry(std::string_view name) const;
+		// Entries with the extension, e.g. "pmx", case-insensitive
+		std::vector<const Entry *> FindEntriesByExtension(std::string_view extension) const;
+		// Resolves a path relative to the directory of an entry, e.g. a texture path of a model. See FindEntry.
+		const Entry *ResolvePath(const Entry &relativeTo, std::string_view path) const;
+
+		// Stored entries are read directly from the archive's memory, deflated entries are inflated while reading.
+		// Returns nullptr for encrypted entries and other compression methods. The CRC-32 is not verified.
+		// The archive has to outlive the returned file.
+		std::unique_ptr<ufile::IFile> OpenEntry(const Entry &entry) const;
+	  private:
+		Archive() = default;
+		bool Parse(std::span<const uint8_t> data);
+		std::unique_ptr<MappedFile> m_file;
+		std::span<const uint8_t> m_data;
+		std::vector<Entry> m_entries;
+		// Normalized (lower-case) name to entry index
+		StringMap<uint32_t> m_nameToEntry;
+	};
+
+	namespace pmx {
+		// Texture paths of the model can be resolved with Archive::ResolvePath(entry, path)
+		std::shared_ptr<ModelData> load(const Archive &archive, const Archive::Entry &entry, LoadFlags flags = LoadFlags::Default, LoadStats *stats = nullptr, std::pmr::memory_resource *resource = nullptr);
+	};
+	namespace vmd {
+		std::shared_ptr<AnimationData> load(const Archive &archive, const Archive::Entry &entry, LoadStats *stats = nullptr, std::pmr::memory_resource *resource = nullptr);
+	};
+};
+
+#endif
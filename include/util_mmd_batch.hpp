@@ -0,0 +1,44 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_BATCH_HPP__
+#define __UTIL_MMD_BATCH_HPP__
+
+#include "util_mmd.hpp"
+#include <functional>
+#include <span>
+
+// Bulk loading of many assets at once. All files of a batch are read completely with as many reads in flight
+// as possible, and each file is handed to a parser thread as soon as its read has completed.
+namespace mmd {
+	enum class BatchBackend : uint8_t {
+		Auto = 0,   // io_uring if the platform supports it, otherwise ThreadPool
+		IoUring,    // Linux only, falls back to ThreadPool if io_uring is unavailable (e.g. blocked by seccomp)
+		ThreadPool, // Blocking whole-file reads (pread) on the worker threads
+	};
+	std::string_view to_string(BatchBackend backend);
+	bool is_io_uring_supported();
+
+	struct BatchSettings {
+		BatchBackend backend = BatchBackend::Auto;
+		uint32_t numThreads = 0;  // Parser threads (and reader threads for ThreadPool), 0 uses all hardware threads
+		uint32_t queueDepth = 64; // Maximum number of files read concurrently by io_uring
+	};
+
+	// Reads every file completely and calls onRead(index, data) on a worker thread once the data of paths[index] is available.
+	// data is empty if the file could not be read and is only valid for the duration of the call; onRead is called concurrently.
+	// If onRead throws, the remaining files are no longer handed to it and the first exception is rethrown once all threads
+	// have finished. Returns the backend that was used.
+	BatchBackend read_files(const std::vector<std::string> &paths, const std::function<void(size_t, std::span<const uint8_t>)> &onRead, const BatchSettings &settings = {});
+
+	namespace pmx {
+		// The result has the same order as the paths, with nullptr for files that failed to load
+		std::vector<std::shared_ptr<ModelData>> load(const std::vector<std::string> &paths, LoadFlags flags = LoadFlags::Default, const BatchSettings &settings = {});
+	};
+	namespace vmd {
+		std::vector<std::shared_ptr<AnimationData>> load(const std::vector<std::string> &paths, const BatchSettings &settings = {});
+	};
+};
+
+#endif
@@ -0,0 +1,69 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_CATALOG_HPP__
+#define __UTIL_MMD_CATALOG_HPP__
+
+#include "util_mmd_probe.hpp"
+#include <functional>
+#include <limits>
+#include <string_view>
+
+namespace mmd {
+	enum class AssetType : uint8_t { Model = 0, Motion };
+
+	struct CatalogEntry {
+		std::string path; // Absolute and normalized, with '/' as separator
+		uint64_t size = 0;
+		int64_t modificationTime = 0;
+		uint64_t contentHash = 0; // 64-bit FNV-1a of the file contents
+		AssetType type = AssetType::Model;
+		// Only the member matching the type is valid
+		pmx::ProbeInfo model;
+		vmd::ProbeInfo motion;
+	};
+
+	// Persistent index of the PMX, PMD and VMD files in one or more directory trees.
+	// The catalog is not thread-safe, but Update probes changed files in parallel.
+	class Catalog {
+	  public:
+		struct UpdateResult {
+			uint32_t added = 0;
+			uint32_t updated = 0;
+			uint32_t removed = 0;
+			uint32_t unchanged = 0;
+			uint32_t failed = 0;
+		};
+
+		// Returns nullptr if the file does not exist or is not a valid catalog. The file is memory-mapped while it is read,
+		// the entries are copied out of it.
+		static std::shared_ptr<Catalog> Load(const std::string &path);
+		Catalog() = default;
+		bool Save(const std::string &path) const;
+
+		// Scans the directory tree and re-probes files whose size or modification time have changed.
+		// Entries for files below rootPath that no longer exist are removed. rootPath may be relative to the working directory,
+		// entry paths are always stored absolute, so different spellings of the same directory refer to the same entries.
+		UpdateResult Update(const std::string &rootPath, uint32_t numThreads = 0);
+		void Clear();
+
+		const std::vector<CatalogEntry> &GetEntries() const { return m_entries; }
+		// The path is normalized like the entry paths
+		const CatalogEntry *Find(std::string_view path) const;
+		std::vector<const CatalogEntry *> FindModelsByBoneCount(uint32_t minBoneCount, uint32_t maxBoneCount = std::numeric_limits<uint32_t>::max()) const;
+		// modelName is UTF-8
+		std::vector<const CatalogEntry *> FindMotionsForModel(std::string_view modelName) const;
+		std::vector<const CatalogEntry *> Query(const std::function<bool(const CatalogEntry &)> &predicate) const;
+	  private:
+		void RebuildIndex();
+		std::vector<CatalogEntry> m_entries;
+
+		// In-memory indices, rebuilt whenever the entries change
+		StringMap<uint32_t> m_pathToEntry;
+		std::vector<uint32_t> m_modelsByBoneCount;
+		StringMap<std::vector<uint32_t>> m_motionsByModelName;
+	};
+};
+
+#endif
@@ -0,0 +1,45 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_ENCODING_HPP__
+#define __UTIL_MMD_ENCODING_HPP__
+
+#include <array>
+#include <cinttypes>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace mmd {
+	// Shift-JIS (code page 932) conversion. Invalid or unmappable characters are replaced with '?'.
+	std::string shift_jis_to_utf8(std::string_view str);
+	std::string utf8_to_shift_jis(std::string_view str);
+	// Returns true if the byte starts a double-byte Shift-JIS character
+	constexpr bool is_shift_jis_lead_byte(uint8_t c) { return (c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC); }
+
+	// Decodes a fixed-size, null-padded Shift-JIS name as found in VMD and PMD files
+	template<size_t N>
+	std::string decode_name(const std::array<char, N> &name)
+	{
+		return shift_jis_to_utf8(std::string_view {name.data(), strnlen(name.data(), name.size())});
+	}
+	// Encodes a name into a fixed-size, null-padded Shift-JIS field. Names that don't fit are truncated
+	// without splitting double-byte characters.
+	template<size_t N>
+	void encode_name(std::string_view name, std::array<char, N> &outName)
+	{
+		auto sjis = utf8_to_shift_jis(name);
+		size_t len = 0;
+		while(len < sjis.size()) {
+			auto charLen = is_shift_jis_lead_byte(static_cast<uint8_t>(sjis[len])) ? 2 : 1;
+			if(len + charLen > N)
+				break;
+			len += charLen;
+		}
+		outName.fill('\0');
+		memcpy(outName.data(), sjis.data(), len);
+	}
+};
+
+#endif
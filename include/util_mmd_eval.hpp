@@ -0,0 +1,96 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_EVAL_HPP__
+#define __UTIL_MMD_EVAL_HPP__
+
+#include "util_mmd.hpp"
+#include "util_mmd_mapped.hpp"
+#include <span>
+
+namespace mmd {
+	namespace eval {
+		struct Transform {
+			Vector3 translation {0.f, 0.f, 0.f};
+			Vector4 rotation {0.f, 0.f, 0.f, 1.f}; // Quaternion (x, y, z, w)
+		};
+
+		enum class EvalFlags : uint32_t {
+			None = 0,
+			Morphs = 1,
+			Ik = Morphs << 1,
+			Skinning = Ik << 1,
+
+			All = Morphs | Ik | Skinning
+		};
+		REGISTER_BASIC_BITWISE_OPERATORS(EvalFlags);
+
+		// Evaluates a motion on a model. All scratch and output buffers are sized when the workspace is created,
+		// so Evaluate does not allocate any heap memory. A workspace must only be used by one thread at a time.
+		//
+		// The stages are:
+		// - Bone keyframes (bezier interpolated) and morph keyframes are sampled into the local pose and morph weights
+		// - Group morphs are expanded, bone morphs are applied to the local pose and vertex morphs are accumulated
+		// - Inherited rotations/translations are added to the local pose, global transforms are computed and IK chains are solved with CCD
+		// - Vertices are skinned with linear blending (SDEF is treated as BDEF2)
+		class EvalWorkspace {
+		  public:
+			static std::unique_ptr<EvalWorkspace> Create(std::shared_ptr<const pmx::ModelData> mdlData, std::shared_ptr<const vmd::AnimationData> animData);
+			EvalWorkspace(const EvalWorkspace &) = delete;
+			EvalWorkspace &operator=(const EvalWorkspace &) = delete;
+
+			void Evaluate(float frame, EvalFlags flags = EvalFlags::All);
+			// Resets the playback cursors, only required for performance after seeking backwards
+			void Reset();
+
+			// Translations in the local pose are offsets from the rest position, the global pose is in model space
+			std::span<const Transform> GetLocalPose() const { return m_localPose; }
+			std::span<const Transform> GetGlobalPose() const { return m_globalPose; }
+			std::span<const float> GetMorphWeights() const { return m_morphWeights; }
+			std::span<const Vector3> GetSkinnedPositions() const { return m_skinnedPositions; }
+			std::span<const Vector3> GetSkinnedNormals() const { return m_skinnedNormals; }
+		  private:
+			EvalWorkspace() = default;
+			void SamplePose(float frame);
+			void SampleMorphs(float frame);
+			void ApplyMorphs();
+			// Resets the morph weights and vertex offsets of the previous evaluation
+			void ClearMorphs();
+			void ClearVertexOffsets();
+			void UpdateGlobalPose();
+			void UpdateGlobalTransform(uint32_t boneIdx);
+			void SolveIk();
+			void Skin();
+
+			std::shared_ptr<const pmx::ModelData> m_mdlData;
+			std::shared_ptr<const vmd::AnimationData> m_animData;
+			vmd::TrackIndex m_boneTracks;
+			vmd::TrackIndex m_morphTracks;
+			std::vector<int32_t> m_boneToTrack;  // -1 if the bone is not animated
+			std::vector<int32_t> m_morphToTrack; // -1 if the morph is not animated
+			std::vector<uint32_t> m_boneCursors;
+			std::vector<uint32_t> m_morphCursors;
+			std::vector<uint32_t> m_boneOrder; // Parents and inheritance sources before the bones depending on them
+
+			// Pose
+			std::vector<Transform> m_localPose;
+			std::vector<Transform> m_globalPose;
+			std::vector<Transform> m_inheritedPose; // Local pose including the inherited rotations/translations
+
+			// Morph accumulation
+			std::vector<float> m_morphWeights;
+			std::vector<float> m_effectiveMorphWeights; // After group morph expansion
+			std::vector<Vector3> m_vertexOffsets;
+			std::vector<uint32_t> m_touchedVertices;
+			std::vector<uint8_t> m_vertexTouched;
+
+			// Skinning
+			std::vector<Transform> m_skinningTransforms;
+			std::vector<Vector3> m_skinnedPositions;
+			std::vector<Vector3> m_skinnedNormals;
+		};
+	};
+};
+
+#endif
@@ -0,0 +1,73 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_FOOTPRINT_HPP__
+#define __UTIL_MMD_FOOTPRINT_HPP__
+
+#include "util_mmd.hpp"
+#include <string_view>
+
+namespace mmd {
+	enum class FootprintCategory : uint8_t {
+		Object = 0, // The ModelData/AnimationData object itself
+
+		// Models
+		Vertices,
+		Faces,
+		Textures,
+		Materials,
+		Bones,
+		Ik,
+		Morphs, // Morph objects and their payloads
+		DisplayFrames,
+		RigidBodies,
+		Joints,
+		SoftBodies,
+
+		// Motions
+		Keyframes,
+		MorphKeys,
+		Cameras,
+		Lights,
+		SelfShadows,
+		ShowIk,
+
+		// Heap storage of all strings, regardless of which category they belong to
+		Strings,
+
+		Count
+	};
+	std::string_view to_string(FootprintCategory category);
+
+	struct MemoryFootprint {
+		struct Category {
+			uint64_t usedBytes = 0;
+			uint64_t capacityBytes = 0; // Includes unused reserved capacity
+			uint64_t allocations = 0;
+		};
+		const Category &GetCategory(FootprintCategory category) const { return categories[static_cast<size_t>(category)]; }
+		uint64_t GetUsedBytes() const;
+		uint64_t GetCapacityBytes() const;
+		uint64_t GetAllocationCount() const;
+		// Bytes that shrink_to_fit can potentially release
+		uint64_t GetSlackBytes() const { return GetCapacityBytes() - GetUsedBytes(); }
+
+		std::array<Category, static_cast<size_t>(FootprintCategory::Count)> categories {};
+		// Strings that fit into the small string buffer don't allocate
+		uint32_t inlineStringCount = 0;
+		uint32_t heapStringCount = 0;
+	};
+
+	MemoryFootprint get_memory_footprint(const pmx::ModelData &mdlData);
+	MemoryFootprint get_memory_footprint(const vmd::AnimationData &animData);
+	// Total number of bytes held by the data, including unused capacity
+	uint64_t size_in_bytes(const pmx::ModelData &mdlData);
+	uint64_t size_in_bytes(const vmd::AnimationData &animData);
+
+	// Releases unused capacity of all containers and strings
+	void shrink_to_fit(pmx::ModelData &mdlData);
+	void shrink_to_fit(vmd::AnimationData &animData);
+};
+
+#endif
@@ -0,0 +1,85 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_IO_HPP__
+#define __UTIL_MMD_IO_HPP__
+
+#include <cinttypes>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sharedutils/util_ifile.hpp>
+
+namespace mmd {
+	// Read-only memory mapping of a file
+	class MappedFile {
+	  public:
+		enum class Advice : uint8_t {
+			Sequential = 0, // MADV_SEQUENTIAL
+			WillNeed,       // MADV_WILLNEED
+		};
+		static std::unique_ptr<MappedFile> Open(const std::string &path);
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+		~MappedFile();
+		std::span<const uint8_t> GetData() const { return {m_data, m_size}; }
+		// Access pattern hint for the whole mapping, no-op on Windows
+		void Advise(Advice advice) const;
+	  private:
+		MappedFile() = default;
+		const uint8_t *m_data = nullptr;
+		size_t m_size = 0;
+#ifdef _WIN32
+		void *m_fileHandle = nullptr;
+		void *m_mappingHandle = nullptr;
+#endif
+	};
+
+	// Read-only file interface for a block of memory. The memory is not copied and
+	// has to outlive the file.
+	class SpanFile : public ufile::IFile {
+	  public:
+		SpanFile(std::span<const uint8_t> data) : m_data {data} {}
+		virtual size_t Read(void *data, size_t size) override;
+		virtual size_t Write(const void *, size_t) override { return 0; }
+		virtual size_t Tell() override { return m_offset; }
+		virtual void Seek(size_t offset, ufile::Whence whence = ufile::Whence::Set) override;
+		virtual int32_t ReadChar() override;
+		std::span<const uint8_t> GetData() const { return m_data; }
+	  private:
+		std::span<const uint8_t> m_data;
+		size_t m_offset = 0;
+	};
+
+	// Reads the whole file with pread (or a regular read on Windows)
+	bool read_file(const std::string &path, std::vector<uint8_t> &outData);
+
+	// Strategies for reading a file by path
+	enum class IoBackendType : uint8_t {
+		Buffered = 0, // Incremental buffered reads through the file system library
+		Pread,        // The whole file is read into memory up front
+		Mmap,         // The file is memory-mapped with MADV_SEQUENTIAL and MADV_WILLNEED
+		ReadAhead,    // posix_fadvise(SEQUENTIAL, WILLNEED) for the whole file, followed by buffered reads. Same as Pread on Windows.
+
+		Count
+	};
+	std::string_view to_string(IoBackendType type);
+
+	class IoBackend {
+	  public:
+		virtual ~IoBackend() = default;
+		// Returns nullptr if the file could not be opened
+		virtual std::unique_ptr<ufile::IFile> Open(const std::string &path) = 0;
+	};
+	// The built-in backends are valid for the lifetime of the program
+	IoBackend &get_io_backend(IoBackendType type);
+	// Backend for path-based loads that don't specify one. The backend has to stay valid until it is replaced,
+	// nullptr restores IoBackendType::Buffered.
+	void set_default_io_backend(IoBackend *backend);
+	IoBackend &get_default_io_backend();
+};
+
+#endif
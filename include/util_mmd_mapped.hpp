@@ -0,0 +1,85 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_MAPPED_HPP__
+#define __UTIL_MMD_MAPPED_HPP__
+
+#include "util_mmd.hpp"
+#include <mutex>
+#include <span>
+
+namespace mmd {
+	class MappedFile;
+	namespace vmd {
+		// Groups the keys of a section by bone/morph name. The keys of track i are
+		// keys[offsets[i]] to keys[offsets[i +1] -1], ordered by frame index.
+		struct TrackIndex {
+			std::vector<std::string> names;
+			std::vector<uint32_t> offsets;
+			std::vector<uint32_t> keys;
+		};
+		TrackIndex build_track_index(std::span<const Keyframe> keyframes);
+		TrackIndex build_track_index(std::span<const Morph> morphs);
+
+		// Zero-copy view of a VMD file. Every section is exposed directly from the file's memory,
+		// in on-disk order. Sort orders and track indices are only built on demand.
+		class MappedAnimation {
+		  public:
+			enum class Section : uint8_t { Keyframes = 0, Morphs, Cameras, Lights, SelfShadows, Count };
+
+			static std::shared_ptr<MappedAnimation> Open(const std::string &path);
+			// The data is not copied and has to outlive the returned object
+			static std::shared_ptr<MappedAnimation> Create(std::span<const uint8_t> data);
+			MappedAnimation(const MappedAnimation &) = delete;
+			MappedAnimation &operator=(const MappedAnimation &) = delete;
+			~MappedAnimation();
+
+			// UTF-8
+			const std::string &GetModelName() const { return m_modelName; }
+			std::span<const Keyframe> GetKeyframes() const { return m_keyframes; }
+			std::span<const Morph> GetMorphs() const { return m_morphs; }
+			std::span<const Camera> GetCameras() const { return m_cameras; }
+			std::span<const Light> GetLights() const { return m_lights; }
+			std::span<const SelfShadow> GetSelfShadows() const { return m_selfShadows; }
+			// Show/IK keys have variable size and are only exposed as raw section data
+			uint32_t GetShowIkCount() const { return m_showIkCount; }
+			std::span<const uint8_t> GetShowIkData() const { return m_showIkData; }
+
+			// Returns the key indices of the section ordered by frame index, or an empty span
+			// if the keys are already sorted on disk. Thread-safe.
+			std::span<const uint32_t> GetSortedOrder(Section section) const;
+			// Thread-safe
+			const TrackIndex &GetBoneTrackIndex() const;
+			const TrackIndex &GetMorphTrackIndex() const;
+
+			// Copies the motion into regular (sorted) animation data
+			std::shared_ptr<AnimationData> ToAnimationData() const;
+		  private:
+			MappedAnimation() = default;
+			bool Parse(std::span<const uint8_t> data);
+			std::unique_ptr<MappedFile> m_file;
+			std::span<const uint8_t> m_data;
+			std::string m_modelName;
+			std::span<const Keyframe> m_keyframes;
+			std::span<const Morph> m_morphs;
+			std::span<const Camera> m_cameras;
+			std::span<const Light> m_lights;
+			std::span<const SelfShadow> m_selfShadows;
+			uint32_t m_showIkCount = 0;
+			std::span<const uint8_t> m_showIkData;
+
+			struct LazyOrder {
+				std::once_flag flag;
+				std::vector<uint32_t> order;
+			};
+			mutable std::array<LazyOrder, umath::to_integral(Section::Count)> m_sortedOrders;
+			mutable std::once_flag m_boneTrackFlag;
+			mutable std::once_flag m_morphTrackFlag;
+			mutable TrackIndex m_boneTracks;
+			mutable TrackIndex m_morphTracks;
+		};
+	};
+};
+
+#endif
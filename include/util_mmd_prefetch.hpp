@@ -0,0 +1,85 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_PREFETCH_HPP__
+#define __UTIL_MMD_PREFETCH_HPP__
+
+#include "util_mmd.hpp"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace mmd {
+	class TextureResolver;
+
+	struct PrefetchSettings {
+		uint32_t numThreads = 2;                // Background reader threads
+		uint64_t cacheSize = 64ull * 1024 * 1024; // Files that don't fit into the cache are only read ahead with posix_fadvise(WILLNEED)
+	};
+
+	struct PrefetchStats {
+		uint32_t requested = 0; // Unique files queued
+		uint32_t cached = 0;    // Read into the cache
+		uint32_t advised = 0;   // Read ahead into the page cache (no-op on Windows)
+		uint32_t failed = 0;
+		uint64_t bytesCached = 0;
+
+		uint32_t hits = 0;      // Accesses after the prefetch of the file had completed
+		uint32_t lateHits = 0;  // Accesses that had to wait for a read in progress
+		uint32_t misses = 0;    // Accesses to files that had not been prefetched yet, or not at all
+		double GetHitRate() const
+		{
+			auto n = hits + lateHits + misses;
+			return (n > 0) ? static_cast<double>(hits) / n : 0.0;
+		}
+	};
+
+	// Reads the files a renderer is about to request (e.g. the textures of a model that has just been loaded) on background
+	// threads, so that decoding starts from memory. Files are read completely into a bounded cache and handed over on access,
+	// files that don't fit are read ahead into the page cache instead.
+	// Thread-safe.
+	class TexturePrefetcher {
+	  public:
+		TexturePrefetcher(const PrefetchSettings &settings = {});
+		TexturePrefetcher(const TexturePrefetcher &) = delete;
+		TexturePrefetcher &operator=(const TexturePrefetcher &) = delete;
+		// Waits for the reads in progress, queued files are discarded
+		~TexturePrefetcher();
+
+		// Queues the file if it has not been queued before. Returns immediately.
+		void Prefetch(const std::string &path);
+		// Resolves the textures (including sphere and toon textures) of the model and queues them in order.
+		// Returns the indices from TextureResolver::Resolve. Shared toon textures are not part of the model and are not prefetched.
+		std::vector<int32_t> Prefetch(TextureResolver &resolver, const std::string &modelRoot, const pmx::ModelData &mdlData);
+
+		// Moves the cached contents of the file into outData and returns true, or returns false if the caller has to read the file itself.
+		// Waits if the file is currently being read. Every call is recorded in the statistics.
+		bool Take(const std::string &path, std::vector<uint8_t> &outData);
+		// Take, falling back to read_file
+		bool ReadFile(const std::string &path, std::vector<uint8_t> &outData);
+
+		PrefetchStats GetStats() const;
+	  private:
+		enum class State : uint8_t { Queued = 0, Reading, Cached, Advised, Failed };
+		struct Item {
+			State state = State::Queued;
+			std::vector<uint8_t> data;
+		};
+		void RunWorker();
+		PrefetchSettings m_settings;
+		mutable std::mutex m_mutex;
+		std::condition_variable m_queueCond;
+		std::condition_variable m_readCond;
+		std::deque<std::string> m_queue;
+		std::unordered_map<std::string, Item> m_items;
+		uint64_t m_cacheBytes = 0; // Including reads in progress
+		PrefetchStats m_stats;
+		bool m_closed = false;
+		std::vector<std::thread> m_threads;
+	};
+};
+
+#endif
@@ -0,0 +1,58 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_PROBE_HPP__
+#define __UTIL_MMD_PROBE_HPP__
+
+#include "util_mmd.hpp"
+#include <optional>
+#include <span>
+
+// Lightweight header probes for indexing large asset libraries. Probing maps the file and
+// only walks the sections required for the requested information, no model or animation data is decoded.
+namespace mmd {
+	namespace pmx {
+		struct ProbeInfo {
+			float version = 0.f;
+			Header header;
+			// UTF-8
+			std::string nameLocal;
+			std::string nameGlobal;
+			std::string commentLocal;
+			std::string commentGlobal;
+
+			uint32_t vertexCount = 0;
+			uint32_t faceCount = 0; // Number of vertex indices, i.e. three per triangle
+			uint32_t textureCount = 0;
+			uint32_t materialCount = 0;
+			uint32_t boneCount = 0;
+			uint32_t morphCount = 0;
+		};
+		std::optional<ProbeInfo> probe(const std::string &path);
+		std::optional<ProbeInfo> probe(std::span<const uint8_t> data);
+		// Probes the files in parallel (numThreads = 0 uses all hardware threads).
+		// The result has the same order as the paths, with std::nullopt for files that could not be probed.
+		std::vector<std::optional<ProbeInfo>> probe(const std::vector<std::string> &paths, uint32_t numThreads = 0);
+	};
+
+	namespace vmd {
+		struct ProbeInfo {
+			std::string modelName; // UTF-8
+			uint32_t keyframeCount = 0;
+			uint32_t morphCount = 0;
+			uint32_t cameraCount = 0;
+			uint32_t lightCount = 0;
+			uint32_t selfShadowCount = 0;
+			uint32_t showIkCount = 0;
+			// Range of frame indices across all sections, both 0 if the animation has no keys
+			uint32_t minFrame = 0;
+			uint32_t maxFrame = 0;
+		};
+		std::optional<ProbeInfo> probe(const std::string &path);
+		std::optional<ProbeInfo> probe(std::span<const uint8_t> data);
+		std::vector<std::optional<ProbeInfo>> probe(const std::vector<std::string> &paths, uint32_t numThreads = 0);
+	};
+};
+
+#endif
@@ -0,0 +1,117 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_SAMPLER_HPP__
+#define __UTIL_MMD_SAMPLER_HPP__
+
+#include "util_mmd.hpp"
+#include <span>
+#include <string_view>
+
+namespace mmd {
+	namespace vmd {
+		// Cubic bezier curve from (0,0) to (1,1) as used by the VMD interpolation tables.
+		// Control point coordinates are stored in the range [0,127] on disk.
+		struct BezierCurve {
+			static BezierCurve FromBytes(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2);
+			float Evaluate(float x) const;
+			float x1 = 0.f;
+			float y1 = 0.f;
+			float x2 = 1.f;
+			float y2 = 1.f;
+			bool linear = true;
+		};
+
+		// Camera state in MMD coordinates (left-handed, y-up)
+		struct CameraState {
+			Vector3 target;
+			Vector3 angles;
+			float distance = 0.f;
+			float fov = 0.f; // Vertical field of view in radians
+			bool perspective = true;
+			Vector3 position;
+			Mat4 viewMatrix;
+		};
+
+		class CameraSampler {
+		  public:
+			CameraSampler(const AnimationData &animData);
+			// Returns false if the motion has no camera keyframes.
+			// Frames are expected to increase monotonically between calls, but seeking backwards is supported.
+			bool Sample(float frame, CameraState &outState);
+			uint32_t GetKeyCount() const { return m_keys.size(); }
+			void Reset() { m_cursor = 0; }
+		  private:
+			enum class Curve : uint8_t { X = 0, Y, Z, Rotation, Distance, Fov, Count };
+			struct Key {
+				uint32_t frameIndex;
+				Vector3 target;
+				Vector3 angles;
+				float distance;
+				float fov;
+				bool perspective;
+				// Curves for the interpolation from the previous key to this one
+				std::array<BezierCurve, umath::to_integral(Curve::Count)> curves;
+			};
+			std::vector<Key> m_keys;
+			uint32_t m_cursor = 0;
+		};
+
+		struct LightingState {
+			Vector3 color;
+			Vector3 direction;
+			SelfShadowMode shadowMode = SelfShadowMode::Off;
+			// Raw self-shadow distance as stored in the motion; See get_self_shadow_range
+			float shadowDistance = 0.f;
+		};
+		// Converts a raw self-shadow distance to the shadow range shown in the MMD user interface
+		constexpr float get_self_shadow_range(float shadowDistance) { return (0.1f - shadowDistance) * 100'000.f; }
+
+		// Evaluates the light track (linear interpolation) and the self-shadow track (step).
+		// Sampling doesn't allocate any memory. The keyframes are referenced, not copied, so
+		// the animation data has to outlive the sampler.
+		class LightSampler {
+		  public:
+			LightSampler(const AnimationData &animData);
+			// Returns false if the motion has neither light nor self-shadow keyframes.
+			// Frames are expected to increase monotonically between calls, but seeking backwards is supported.
+			bool Sample(float frame, LightingState &outState);
+			void Reset();
+		  private:
+			std::span<const Light> m_lights;
+			std::span<const SelfShadow> m_selfShadows;
+			uint32_t m_lightCursor = 0;
+			uint32_t m_shadowCursor = 0;
+		};
+
+		// Evaluates the IK enable/disable state of the show/IK section.
+		// Every IK bone that appears in the motion is assigned a track; Sampling returns
+		// one byte per track, so an IK solver can skip disabled chains with a single lookup.
+		class IkStateSampler {
+		  public:
+			IkStateSampler(const AnimationData &animData);
+			// Bone names are compared as stored in the motion file (Shift-JIS)
+			int32_t FindTrack(std::string_view boneName) const;
+			uint32_t GetTrackCount() const { return m_trackNames.size(); }
+			const std::string &GetTrackName(uint32_t track) const { return m_trackNames[track]; }
+
+			// The returned states are owned by the sampler and contain 1 for enabled and 0 for disabled IK tracks.
+			// Frames are expected to increase monotonically between calls, but seeking backwards is supported.
+			std::span<const uint8_t> Sample(float frame);
+			bool IsEnabled(uint32_t track, float frame) { return Sample(frame)[track] != 0; }
+			bool IsVisible(float frame);
+			void Reset() { m_cursor = 0; }
+		  private:
+			// Returns the row of the key that is active at the specified frame, with row 0 being the default state
+			uint32_t FindRow(float frame);
+			std::vector<std::string> m_trackNames;
+			std::vector<uint32_t> m_keyFrames;
+			std::vector<uint8_t> m_visible;
+			std::vector<uint8_t> m_states;
+			uint32_t m_cursor = 0;
+		};
+	};
+};
+
+#endif
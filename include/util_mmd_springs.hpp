@@ -0,0 +1,96 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_SPRINGS_HPP__
+#define __UTIL_MMD_SPRINGS_HPP__
+
+#include "util_mmd.hpp"
+#include <span>
+
+// Lightweight position-based spring-bone solver for secondary motion (hair, skirts) without a physics engine.
+// Every rigid body of the model becomes a particle, joints become distance constraints and bone-following
+// sphere/capsule bodies become colliders.
+namespace mmd {
+	namespace springs {
+		// Maps a rest-pose point x to world space: rotation * x + translation
+		struct BoneTransform {
+			Vector3 translation {0.f, 0.f, 0.f};
+			Vector4 rotation {0.f, 0.f, 0.f, 1.f}; // Quaternion (x, y, z, w)
+		};
+
+		struct Settings {
+			static constexpr uint32_t MAX_ITERATIONS = 16;
+			uint32_t iterations = 4; // Clamped to MAX_ITERATIONS
+			float damping = 0.05f;
+			Vector3 gravity {0.f, -98.f, 0.f};
+		};
+
+		class Rig {
+		  public:
+			static std::shared_ptr<Rig> Create(const pmx::ModelData &mdlData);
+			uint32_t GetParticleCount() const { return m_boneIndices.size(); }
+			uint32_t GetConstraintCount() const { return m_constraintA.size(); }
+			uint32_t GetColliderCount() const { return m_colliderBodies.size(); }
+			uint32_t GetBoneCount() const { return m_boneCount; }
+		  private:
+			friend class Instance;
+			Rig() = default;
+			uint32_t m_boneCount = 0;
+
+			// Particles (one per rigid body)
+			std::vector<int32_t> m_boneIndices;
+			std::vector<float> m_invMasses;
+			std::vector<float> m_radii;
+			std::vector<uint16_t> m_groups;
+			std::vector<uint16_t> m_masks;
+			std::vector<Vector3> m_restPositions;
+			// For dynamic particles that drive a bone: The particle it hangs from, or -1
+			std::vector<int32_t> m_parents;
+
+			// Distance constraints
+			std::vector<uint32_t> m_constraintA;
+			std::vector<uint32_t> m_constraintB;
+			std::vector<float> m_restLengths;
+
+			// Colliders, capsules are aligned to the local y-axis (half height 0 for spheres)
+			std::vector<uint32_t> m_colliderBodies;
+			std::vector<Vector3> m_colliderAxes;
+			std::vector<float> m_colliderHalfHeights;
+			// Particle/collider pairs that are connected by a joint and must not collide, encoded as (particle << 32) | collider
+			std::vector<uint64_t> m_collisionExclusions;
+		};
+
+		// Simulation state of one model instance. The state is stored as a structure of arrays.
+		class Instance {
+		  public:
+			Instance(std::shared_ptr<const Rig> rig);
+			// boneTransforms must contain one transform per bone of the model. Positions of bone-following
+			// bodies are updated from the transforms, all other bodies are simulated.
+			void Step(std::span<const BoneTransform> boneTransforms, float dt, const Settings &settings);
+			// Resets the simulation to the pose of the specified bone transforms on the next step
+			void Reset() { m_initialized = false; }
+			Vector3 GetParticlePosition(uint32_t idx) const { return Vector3 {m_px[idx], m_py[idx], m_pz[idx]}; }
+			// Overwrites the transforms of the bones driven by simulated bodies
+			void ApplyToBones(std::span<BoneTransform> boneTransforms) const;
+			const Rig &GetRig() const { return *m_rig; }
+		  private:
+			void Initialize(std::span<const BoneTransform> boneTransforms);
+			std::shared_ptr<const Rig> m_rig;
+			std::vector<float> m_px, m_py, m_pz;
+			std::vector<float> m_prevX, m_prevY, m_prevZ;
+			std::vector<Vector3> m_colliderCenters;
+			std::vector<Vector3> m_colliderDirs;
+			bool m_initialized = false;
+		};
+
+		struct StepInput {
+			Instance *instance = nullptr;
+			std::span<const BoneTransform> boneTransforms;
+		};
+		// Steps many instances in parallel (numThreads = 0 uses all hardware threads)
+		void step(std::span<const StepInput> inputs, float dt, const Settings &settings, uint32_t numThreads = 0);
+	};
+};
+
+#endif
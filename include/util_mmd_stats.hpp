@@ -0,0 +1,62 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_STATS_HPP__
+#define __UTIL_MMD_STATS_HPP__
+
+#include <array>
+#include <cinttypes>
+#include <string_view>
+
+namespace mmd {
+	enum class LoadSection : uint8_t {
+		// PMX
+		Header = 0,
+		Text, // Model name and comment
+		Vertices,
+		Faces,
+		Textures,
+		Materials,
+		Bones,
+		Morphs,
+		DisplayFrames,
+		RigidBodies,
+		Joints,
+		SoftBodies,
+
+		// VMD
+		MotionHeader,
+		Keyframes,
+		MorphKeys,
+		Cameras,
+		Lights,
+		SelfShadows,
+		ShowIk,
+
+		Count
+	};
+	std::string_view to_string(LoadSection section);
+
+	// Optionally filled by pmx::load and vmd::load. Sections that were not part of the file
+	// (or were skipped) have zero time and size.
+	struct LoadStats {
+		struct Section {
+			uint64_t nanoseconds = 0;
+			uint64_t bytes = 0;
+		};
+		const Section &GetSection(LoadSection section) const { return sections[static_cast<size_t>(section)]; }
+
+		std::array<Section, static_cast<size_t>(LoadSection::Count)> sections {};
+		uint64_t totalNanoseconds = 0;
+		uint64_t readCalls = 0; // Number of IFile::Read calls
+		uint64_t bytesRead = 0;
+		uint64_t bytesTranscoded = 0; // Text bytes converted to UTF-8 (UTF-16 and Shift-JIS)
+		// Heap blocks and bytes owned by the loaded data (see get_memory_footprint). This is also the peak memory held
+		// by the result, since the loaders do not keep any other allocations alive.
+		uint64_t allocationCount = 0;
+		uint64_t memoryFootprint = 0;
+	};
+};
+
+#endif
@@ -0,0 +1,36 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_STRING_HPP__
+#define __UTIL_MMD_STRING_HPP__
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace mmd {
+	// Transparent hash, so that string-keyed maps can be searched with a std::string_view without constructing a key
+	struct StringHash {
+		using is_transparent = void;
+		size_t operator()(std::string_view str) const { return std::hash<std::string_view> {}(str); }
+	};
+	template<class T>
+	using StringMap = std::unordered_map<std::string, T, StringHash, std::equal_to<>>;
+
+	// Case conversions are limited to ASCII, other bytes (e.g. of UTF-8 sequences) are left unchanged
+	constexpr char to_lower_ascii(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; }
+	inline void to_lower_ascii(std::string_view str, std::string &outStr)
+	{
+		outStr.resize(str.size());
+		std::transform(str.begin(), str.end(), outStr.begin(), [](char c) { return to_lower_ascii(c); });
+	}
+	inline bool equals_ignore_case_ascii(std::string_view a, std::string_view b)
+	{
+		return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char ca, char cb) { return to_lower_ascii(ca) == to_lower_ascii(cb); });
+	}
+};
+
+#endif
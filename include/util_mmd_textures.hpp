@@ -0,0 +1,51 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_TEXTURES_HPP__
+#define __UTIL_MMD_TEXTURES_HPP__
+
+#include "util_mmd.hpp"
+#include <string_view>
+
+namespace mmd {
+	// Maps the texture paths of models, which are Windows-style paths relative to the model file with arbitrary case,
+	// to the files on disk. Every directory is listed once and cached, after which lookups don't touch the file system.
+	// Identical files are deduplicated across all models resolved with the same resolver.
+	// File names on disk that are not valid UTF-8 (e.g. extracted from an archive without decoding) are also matched by their
+	// Shift-JIS decoding. Case-insensitive comparisons are limited to ASCII.
+	// Not thread-safe.
+	class TextureResolver {
+	  public:
+		// modelRoot is the directory of the model file. Returns an index into GetPaths(), or -1 if the texture does not exist.
+		// Absolute texture paths fall back to the file name in modelRoot.
+		int32_t Resolve(const std::string &modelRoot, std::string_view texturePath);
+		// Returns one index per ModelData::textures entry
+		std::vector<int32_t> Resolve(const std::string &modelRoot, const pmx::ModelData &mdlData);
+
+		// Unique resolved files with their actual case
+		const std::vector<std::string> &GetPaths() const { return m_paths; }
+		uint32_t GetCachedDirectoryCount() const { return static_cast<uint32_t>(m_directories.size()); }
+		// Call if the directories have changed. Previously returned indices remain valid.
+		void ClearDirectoryCache();
+	  private:
+		struct DirectoryItem {
+			std::string name;
+			bool directory = false;
+		};
+		using Directory = StringMap<DirectoryItem>; // Lower-case name to item
+		// Absolute path with '/' as separator and without trailing separator
+		static std::string NormalizeRoot(const std::string &modelRoot);
+		int32_t ResolveFrom(const std::string &root, std::string_view texturePath);
+		const Directory &GetDirectory(const std::string &path);
+		const DirectoryItem *FindItem(const std::string &dirPath, std::string_view name);
+		int32_t AddPath(std::string &&path);
+
+		StringMap<Directory> m_directories;
+		std::vector<std::string> m_paths;
+		StringMap<uint32_t> m_pathToIndex;
+		std::string m_key;
+	};
+};
+
+#endif
@@ -0,0 +1,85 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_TRACE_HPP__
+#define __UTIL_MMD_TRACE_HPP__
+
+#include <chrono>
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace mmd {
+	namespace trace {
+		// Receives the begin/end events of the instrumented library scopes. Scopes are strictly nested per thread,
+		// and the callbacks may be invoked from multiple threads at the same time.
+		// Names are string literals and remain valid for the lifetime of the program.
+		class Tracer {
+		  public:
+			virtual ~Tracer() = default;
+			virtual void BeginScope(const char *name) = 0;
+			virtual void EndScope(const char *name) = 0;
+		};
+		// The tracer has to outlive all scopes that are active while it is set. nullptr (the default) disables tracing.
+		void set_tracer(Tracer *tracer);
+		Tracer *get_tracer();
+
+		class Scope {
+		  public:
+			Scope(const char *name) : m_name {name}, m_tracer {get_tracer()}
+			{
+				if(m_tracer)
+					m_tracer->BeginScope(name);
+			}
+			~Scope()
+			{
+				if(m_tracer)
+					m_tracer->EndScope(m_name);
+			}
+			Scope(const Scope &) = delete;
+			Scope &operator=(const Scope &) = delete;
+		  private:
+			const char *m_name;
+			Tracer *m_tracer;
+		};
+
+		// Collects the events in memory and writes them in the Chrome trace event format (as used by
+		// chrome://tracing and Perfetto) when Flush is called or the writer is destroyed.
+		class ChromeTraceWriter : public Tracer {
+		  public:
+			ChromeTraceWriter(const std::string &path);
+			virtual ~ChromeTraceWriter() override;
+			virtual void BeginScope(const char *name) override;
+			virtual void EndScope(const char *name) override;
+			bool Flush();
+		  private:
+			struct Event {
+				const char *name;
+				uint32_t threadId;
+				bool begin;
+				std::chrono::steady_clock::duration time;
+			};
+			void AddEvent(const char *name, bool begin);
+			std::string m_path;
+			std::chrono::steady_clock::time_point m_start;
+			std::mutex m_mutex;
+			std::vector<Event> m_events;
+			std::unordered_map<std::thread::id, uint32_t> m_threadIds;
+		};
+	};
+};
+
+#define UTIL_MMD_TRACE_CONCAT_IMPL(a, b) a##b
+#define UTIL_MMD_TRACE_CONCAT(a, b) UTIL_MMD_TRACE_CONCAT_IMPL(a, b)
+#ifdef UTIL_MMD_DISABLE_TRACING
+#define UTIL_MMD_TRACE_SCOPE(name)
+#else
+#define UTIL_MMD_TRACE_SCOPE(name) ::mmd::trace::Scope UTIL_MMD_TRACE_CONCAT(traceScope, __LINE__) {name}
+#endif
+
+#endif
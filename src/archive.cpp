@@ -0,0 +1,373 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_archive.hpp"
+#include "util_mmd_encoding.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_trace.hpp"
+#include "span_reader.hpp"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <zlib.h>
+
+namespace mmd {
+	namespace zip {
+		constexpr uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+		constexpr uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+		constexpr uint32_t END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+		constexpr uint32_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06064b50;
+		constexpr uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+		constexpr uint16_t ZIP64_EXTRA_FIELD = 0x0001;
+		constexpr uint16_t UNICODE_PATH_EXTRA_FIELD = 0x7075;
+		constexpr uint16_t FLAG_ENCRYPTED = 1;
+		constexpr uint16_t FLAG_UTF8 = 1 << 11;
+		constexpr size_t LOCAL_HEADER_SIZE = 30;
+		constexpr size_t END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+		constexpr size_t ZIP64_LOCATOR_SIZE = 20;
+		constexpr size_t MAX_COMMENT_SIZE = std::numeric_limits<uint16_t>::max();
+	};
+
+	// Lower-case with '/' as separator, without empty, "." and ".." components.
+	// Returns false if the path leaves the root.
+	static bool normalize_path(std::string_view path, std::string &outPath)
+	{
+		outPath.clear();
+		size_t offset = 0;
+		while(offset <= path.size()) {
+			auto end = path.find_first_of("/\\", offset);
+			if(end == std::string_view::npos)
+				end = path.size();
+			auto component = path.substr(offset, end - offset);
+			offset = end + 1;
+			if(component.empty() || component == ".")
+				continue;
+			if(component == "..") {
+				if(outPath.empty())
+					return false;
+				auto sep = outPath.rfind('/');
+				outPath.resize((sep != std::string::npos) ? sep : 0);
+				continue;
+			}
+			if(!outPath.empty())
+				outPath += '/';
+			for(auto c : component)
+				outPath += to_lower_ascii(c);
+		}
+		return true;
+	}
+
+	// Inflates a raw deflate stream while reading. Seeking backwards restarts the stream.
+	class InflateFile : public ufile::IFile {
+	  public:
+		InflateFile(std::span<const uint8_t> compressedData, size_t size) : m_compressedData {compressedData}, m_size {size} {}
+		virtual ~InflateFile() override
+		{
+			if(m_initialized)
+				inflateEnd(&m_stream);
+		}
+		bool Initialize()
+		{
+			m_stream = {};
+			m_initialized = (inflateInit2(&m_stream, -MAX_WBITS) == Z_OK);
+			m_inputOffset = 0;
+			return m_initialized;
+		}
+		virtual size_t Read(void *data, size_t size) override
+		{
+			size = std::min(size, m_size - m_offset);
+			m_stream.next_out = static_cast<Bytef *>(data);
+			size_t remaining = size;
+			while(remaining > 0 && !m_failed) {
+				if(m_stream.avail_in == 0) {
+					// avail_in is 32-bit, so the input is passed in chunks
+					auto chunkSize = std::min<size_t>(m_compressedData.size() - m_inputOffset, std::numeric_limits<uInt>::max());
+					m_stream.next_in = const_cast<Bytef *>(m_compressedData.data() + m_inputOffset);
+					m_stream.avail_in = static_cast<uInt>(chunkSize);
+					m_inputOffset += chunkSize;
+				}
+				auto outSize = static_cast<uInt>(std::min<size_t>(remaining, std::numeric_limits<uInt>::max()));
+				m_stream.avail_out = outSize;
+				auto result = inflate(&m_stream, Z_NO_FLUSH);
+				remaining -= outSize - m_stream.avail_out;
+				if(result == Z_STREAM_END)
+					break;
+				if(result != Z_OK && result != Z_BUF_ERROR)
+					m_failed = true;
+				else if(result == Z_BUF_ERROR && m_stream.avail_in == 0 && m_inputOffset == m_compressedData.size())
+					m_failed = true; // Truncated stream
+			}
+			auto n = size - remaining;
+			m_offset += n;
+			return n;
+		}
+		virtual size_t Write(const void *, size_t) override { return 0; }
+		virtual size_t Tell() override { return m_offset; }
+		virtual void Seek(size_t offset, ufile::Whence whence = ufile::Whence::Set) override
+		{
+			size_t target = 0;
+			switch(whence) {
+			case ufile::Whence::Set:
+				target = offset;
+				break;
+			case ufile::Whence::Cur:
+				target = m_offset + offset;
+				break;
+			case ufile::Whence::End:
+				target = m_size + offset;
+				break;
+			}
+			target = std::min(target, m_size);
+			if(target < m_offset) {
+				inflateReset(&m_stream);
+				m_stream.avail_in = 0;
+				m_inputOffset = 0;
+				m_offset = 0;
+				m_failed = false;
+			}
+			std::array<uint8_t, 16 * 1024> discard;
+			while(m_offset < target) {
+				if(Read(discard.data(), std::min(discard.size(), target - m_offset)) == 0)
+					break;
+			}
+		}
+		virtual int32_t ReadChar() override
+		{
+			uint8_t c;
+			return (Read(&c, 1) == 1) ? c : EOF;
+		}
+		virtual size_t GetSize() override { return m_size; }
+	  private:
+		z_stream m_stream {};
+		std::span<const uint8_t> m_compressedData;
+		size_t m_inputOffset = 0;
+		size_t m_size;
+		size_t m_offset = 0;
+		bool m_initialized = false;
+		bool m_failed = false;
+	};
+};
+
+std::shared_ptr<mmd::Archive> mmd::Archive::Open(const std::string &path)
+{
+	auto file = MappedFile::Open(path);
+	if(!file)
+		return nullptr;
+	std::shared_ptr<Archive> archive {new Archive {}};
+	if(!archive->Parse(file->GetData()))
+		return nullptr;
+	archive->m_file = std::move(file);
+	return archive;
+}
+
+std::shared_ptr<mmd::Archive> mmd::Archive::Create(std::span<const uint8_t> data)
+{
+	std::shared_ptr<Archive> archive {new Archive {}};
+	if(!archive->Parse(data))
+		return nullptr;
+	return archive;
+}
+
+mmd::Archive::~Archive() {}
+
+bool mmd::Archive::Parse(std::span<const uint8_t> data)
+{
+	UTIL_MMD_TRACE_SCOPE("Archive::Parse");
+	m_data = data;
+	if(data.size() < zip::END_OF_CENTRAL_DIRECTORY_SIZE)
+		return false;
+
+	// The end of central directory record is followed by a comment of up to 64 KiB
+	auto minOffset = (data.size() > zip::END_OF_CENTRAL_DIRECTORY_SIZE + zip::MAX_COMMENT_SIZE) ? (data.size() - zip::END_OF_CENTRAL_DIRECTORY_SIZE - zip::MAX_COMMENT_SIZE) : 0;
+	auto eocdOffset = data.size() - zip::END_OF_CENTRAL_DIRECTORY_SIZE;
+	for(;;) {
+		uint32_t signature;
+		memcpy(&signature, data.data() + eocdOffset, sizeof(signature));
+		if(signature == zip::END_OF_CENTRAL_DIRECTORY_SIGNATURE)
+			break;
+		if(eocdOffset == minOffset)
+			return false;
+		--eocdOffset;
+	}
+	SpanReader eocd {data.subspan(eocdOffset + sizeof(uint32_t))};
+	eocd.Skip(sizeof(uint16_t) * 3); // Disk numbers and entry count of this disk
+	uint64_t entryCount = eocd.Read<uint16_t>();
+	uint64_t directorySize = eocd.Read<uint32_t>();
+	uint64_t directoryOffset = eocd.Read<uint32_t>();
+	if(eocd.Failed())
+		return false;
+	if((entryCount == 0xFFFF || directorySize == 0xFFFFFFFF || directoryOffset == 0xFFFFFFFF) && eocdOffset >= zip::ZIP64_LOCATOR_SIZE) {
+		SpanReader locator {data.subspan(eocdOffset - zip::ZIP64_LOCATOR_SIZE)};
+		if(locator.Read<uint32_t>() == zip::ZIP64_LOCATOR_SIGNATURE) {
+			locator.Skip(sizeof(uint32_t));
+			auto recordOffset = locator.Read<uint64_t>();
+			if(locator.Failed() || recordOffset >= data.size())
+				return false;
+			SpanReader record {data.subspan(recordOffset)};
+			if(record.Read<uint32_t>() != zip::ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE)
+				return false;
+			record.Skip(28); // Record size, versions, disk numbers and entry count of this disk
+			entryCount = record.Read<uint64_t>();
+			directorySize = record.Read<uint64_t>();
+			directoryOffset = record.Read<uint64_t>();
+			if(record.Failed())
+				return false;
+		}
+	}
+	if(directoryOffset > data.size() || directorySize > data.size() - directoryOffset)
+		return false;
+
+	SpanReader reader {data.subspan(directoryOffset, directorySize)};
+	// Every central directory header is at least 46 bytes
+	m_entries.reserve(std::min<uint64_t>(entryCount, directorySize / 46));
+	m_nameToEntry.reserve(m_entries.capacity());
+	std::string key;
+	for(uint64_t i = 0; i < entryCount; ++i) {
+		if(reader.Read<uint32_t>() != zip::CENTRAL_HEADER_SIGNATURE)
+			return false;
+		reader.Skip(sizeof(uint16_t) * 2); // Versions
+		auto flags = reader.Read<uint16_t>();
+		auto method = reader.Read<uint16_t>();
+		reader.Skip(sizeof(uint16_t) * 2); // Modification time and date
+		auto crc = reader.Read<uint32_t>();
+		uint64_t compressedSize = reader.Read<uint32_t>();
+		uint64_t size = reader.Read<uint32_t>();
+		auto nameLength = reader.Read<uint16_t>();
+		auto extraLength = reader.Read<uint16_t>();
+		auto commentLength = reader.Read<uint16_t>();
+		reader.Skip(sizeof(uint16_t) * 2 + sizeof(uint32_t)); // Disk number and attributes
+		uint64_t localHeaderOffset = reader.Read<uint32_t>();
+		auto rawName = reader.ReadBytes(nameLength);
+		auto extra = reader.ReadBytes(extraLength);
+		reader.Skip(commentLength);
+		if(reader.Failed())
+			return false;
+
+		std::string_view name {reinterpret_cast<const char *>(rawName.data()), rawName.size()};
+		std::string_view unicodeName;
+		SpanReader extraReader {extra};
+		while(extraReader.Remaining() >= sizeof(uint16_t) * 2) {
+			auto id = extraReader.Read<uint16_t>();
+			auto fieldSize = extraReader.Read<uint16_t>();
+			SpanReader field {extraReader.ReadBytes(fieldSize)};
+			if(id == zip::ZIP64_EXTRA_FIELD) {
+				// Only the values that overflowed in the header are present, in this order
+				if(size == 0xFFFFFFFF)
+					size = field.Read<uint64_t>();
+				if(compressedSize == 0xFFFFFFFF)
+					compressedSize = field.Read<uint64_t>();
+				if(localHeaderOffset == 0xFFFFFFFF)
+					localHeaderOffset = field.Read<uint64_t>();
+			}
+			else if(id == zip::UNICODE_PATH_EXTRA_FIELD && fieldSize > 5) {
+				// Only valid if it was written for the current name
+				field.Skip(1); // Version
+				auto nameCrc = field.Read<uint32_t>();
+				if(nameCrc == ::crc32(0, rawName.data(), static_cast<uInt>(rawName.size()))) {
+					auto utf8Name = field.ReadBytes(field.Remaining());
+					unicodeName = {reinterpret_cast<const char *>(utf8Name.data()), utf8Name.size()};
+				}
+			}
+		}
+
+		auto &entry = m_entries.emplace_back();
+		if(flags & zip::FLAG_UTF8)
+			entry.name = name;
+		else if(!unicodeName.empty())
+			entry.name = unicodeName;
+		else
+			entry.name = shift_jis_to_utf8(name);
+		// Separators have to be replaced after decoding, since 0x5C ('\') is a valid Shift-JIS trail byte
+		std::replace(entry.name.begin(), entry.name.end(), '\\', '/');
+		entry.size = size;
+		entry.compressedSize = compressedSize;
+		entry.localHeaderOffset = localHeaderOffset;
+		entry.crc32 = crc;
+		entry.method = method;
+		entry.encrypted = (flags & zip::FLAG_ENCRYPTED) != 0;
+		// The first entry wins if names only differ in case
+		if(normalize_path(entry.name, key) && !key.empty())
+			m_nameToEntry.emplace(key, static_cast<uint32_t>(m_entries.size() - 1));
+	}
+	return true;
+}
+
+const mmd::Archive::Entry *mmd::Archive::FindEntry(std::string_view name) const
+{
+	std::string key;
+	if(!normalize_path(name, key))
+		return nullptr;
+	auto it = m_nameToEntry.find(key);
+	return (it != m_nameToEntry.end()) ? &m_entries[it->second] : nullptr;
+}
+
+std::vector<const mmd::Archive::Entry *> mmd::Archive::FindEntriesByExtension(std::string_view extension) const
+{
+	std::vector<const Entry *> entries;
+	for(auto &entry : m_entries) {
+		if(entry.IsDirectory() || entry.name.size() <= extension.size() || entry.name[entry.name.size() - extension.size() - 1] != '.')
+			continue;
+		auto ext = std::string_view {entry.name}.substr(entry.name.size() - extension.size());
+		if(equals_ignore_case_ascii(ext, extension))
+			entries.push_back(&entry);
+	}
+	return entries;
+}
+
+const mmd::Archive::Entry *mmd::Archive::ResolvePath(const Entry &relativeTo, std::string_view path) const
+{
+	auto sep = relativeTo.name.rfind('/');
+	if(sep == std::string::npos)
+		return FindEntry(path);
+	std::string fullPath;
+	fullPath.reserve(sep + 1 + path.size());
+	fullPath.append(relativeTo.name, 0, sep + 1);
+	fullPath += path;
+	return FindEntry(fullPath);
+}
+
+std::unique_ptr<ufile::IFile> mmd::Archive::OpenEntry(const Entry &entry) const
+{
+	if(entry.encrypted || entry.localHeaderOffset > m_data.size())
+		return nullptr;
+	// The local header repeats the name, but its extra field may differ from the central directory
+	SpanReader reader {m_data.subspan(entry.localHeaderOffset)};
+	if(reader.Read<uint32_t>() != zip::LOCAL_HEADER_SIGNATURE)
+		return nullptr;
+	reader.Skip(zip::LOCAL_HEADER_SIZE - sizeof(uint32_t) - sizeof(uint16_t) * 2);
+	auto nameLength = reader.Read<uint16_t>();
+	auto extraLength = reader.Read<uint16_t>();
+	reader.Skip(nameLength + extraLength);
+	auto data = reader.ReadBytes(entry.compressedSize);
+	if(reader.Failed())
+		return nullptr;
+	switch(static_cast<Method>(entry.method)) {
+	case Method::Stored:
+		return std::make_unique<SpanFile>(data.first(std::min<uint64_t>(data.size(), entry.size)));
+	case Method::Deflated:
+		{
+			auto f = std::make_unique<InflateFile>(data, entry.size);
+			if(!f->Initialize())
+				return nullptr;
+			return f;
+		}
+	}
+	return nullptr;
+}
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(const Archive &archive, const Archive::Entry &entry, LoadFlags flags, LoadStats *stats, std::pmr::memory_resource *resource)
+{
+	auto f = archive.OpenEntry(entry);
+	if(!f)
+		return nullptr;
+	return load(*f, flags, stats, resource);
+}
+
+std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::load(const Archive &archive, const Archive::Entry &entry, LoadStats *stats, std::pmr::memory_resource *resource)
+{
+	auto f = archive.OpenEntry(entry);
+	if(!f)
+		return nullptr;
+	return load(*f, stats, resource);
+}
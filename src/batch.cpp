@@ -0,0 +1,465 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_batch.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_trace.hpp"
+#include "parallel.hpp"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define UTIL_MMD_HAS_IO_URING
+#include <atomic>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace mmd {
+	// Indices of the files whose reads have completed, consumed by the parser threads
+	class CompletionQueue {
+	  public:
+		void Push(size_t index)
+		{
+			{
+				std::scoped_lock lock {m_mutex};
+				m_indices.push_back(index);
+			}
+			m_cond.notify_one();
+		}
+		// Returns false once the queue has been closed and is empty
+		bool Pop(size_t &outIndex)
+		{
+			std::unique_lock lock {m_mutex};
+			m_cond.wait(lock, [this]() { return !m_indices.empty() || m_closed; });
+			if(m_indices.empty())
+				return false;
+			outIndex = m_indices.front();
+			m_indices.pop_front();
+			return true;
+		}
+		void Close()
+		{
+			{
+				std::scoped_lock lock {m_mutex};
+				m_closed = true;
+			}
+			m_cond.notify_all();
+		}
+	  private:
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::deque<size_t> m_indices;
+		bool m_closed = false;
+	};
+	// Closes the queue and joins the consumer threads at the latest when leaving the scope, including by an exception
+	class ConsumerThreads {
+	  public:
+		ConsumerThreads(CompletionQueue &queue) : m_queue {queue} {}
+		ConsumerThreads(const ConsumerThreads &) = delete;
+		ConsumerThreads &operator=(const ConsumerThreads &) = delete;
+		~ConsumerThreads() { Join(); }
+		template<class TFunc>
+		void Start(uint32_t count, const TFunc &func)
+		{
+			m_threads.reserve(count);
+			for(uint32_t i = 0; i < count; ++i)
+				m_threads.emplace_back(func);
+		}
+		void Join()
+		{
+			m_queue.Close();
+			for(auto &t : m_threads)
+				t.join();
+			m_threads.clear();
+		}
+	  private:
+		CompletionQueue &m_queue;
+		std::vector<std::thread> m_threads;
+	};
+
+#ifdef UTIL_MMD_HAS_IO_URING
+	// Minimal io_uring wrapper on top of the raw system calls, so that liburing is not required
+	class IoUring {
+	  public:
+		static std::unique_ptr<IoUring> Create(uint32_t entries);
+		IoUring(const IoUring &) = delete;
+		IoUring &operator=(const IoUring &) = delete;
+		~IoUring();
+		void QueueRead(int fd, iovec *iov, uint64_t offset, uint64_t userData);
+		// Submits all queued requests and waits until at least minComplete requests have completed
+		bool Submit(uint32_t minComplete);
+		template<class TFunc>
+		void ForEachCompletion(const TFunc &func);
+	  private:
+		IoUring() = default;
+		int m_fd = -1;
+		void *m_sqRing = MAP_FAILED;
+		void *m_cqRing = MAP_FAILED;
+		size_t m_sqRingSize = 0;
+		size_t m_cqRingSize = 0;
+		io_uring_sqe *m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+		size_t m_sqesSize = 0;
+		uint32_t *m_sqTail = nullptr;
+		uint32_t *m_sqMask = nullptr;
+		uint32_t *m_sqArray = nullptr;
+		uint32_t *m_cqHead = nullptr;
+		uint32_t *m_cqTail = nullptr;
+		uint32_t *m_cqMask = nullptr;
+		io_uring_cqe *m_cqes = nullptr;
+		uint32_t m_numQueued = 0;
+	};
+
+	struct PendingRead {
+		int fd = -1;
+		std::vector<uint8_t> data;
+		size_t offset = 0;
+		iovec iov {};
+	};
+	static bool read_files_io_uring(const std::vector<std::string> &paths, const std::function<void(size_t, std::span<const uint8_t>)> &onRead, const BatchSettings &settings);
+#endif
+};
+
+#ifdef UTIL_MMD_HAS_IO_URING
+template<class T>
+static T *get_ring_field(void *ring, uint32_t offset)
+{
+	return reinterpret_cast<T *>(static_cast<uint8_t *>(ring) + offset);
+}
+std::unique_ptr<mmd::IoUring> mmd::IoUring::Create(uint32_t entries)
+{
+	std::unique_ptr<IoUring> ring {new IoUring {}};
+	io_uring_params params {};
+	ring->m_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->m_fd < 0)
+		return nullptr;
+	ring->m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	auto singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(singleMmap)
+		ring->m_sqRingSize = ring->m_cqRingSize = std::max(ring->m_sqRingSize, ring->m_cqRingSize);
+	ring->m_sqRing = mmap(nullptr, ring->m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->m_fd, IORING_OFF_SQ_RING);
+	if(ring->m_sqRing == MAP_FAILED)
+		return nullptr;
+	if(singleMmap)
+		ring->m_cqRing = ring->m_sqRing;
+	else {
+		ring->m_cqRing = mmap(nullptr, ring->m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->m_fd, IORING_OFF_CQ_RING);
+		if(ring->m_cqRing == MAP_FAILED)
+			return nullptr;
+	}
+	ring->m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	ring->m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, ring->m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->m_fd, IORING_OFF_SQES));
+	if(ring->m_sqes == MAP_FAILED)
+		return nullptr;
+	ring->m_sqTail = get_ring_field<uint32_t>(ring->m_sqRing, params.sq_off.tail);
+	ring->m_sqMask = get_ring_field<uint32_t>(ring->m_sqRing, params.sq_off.ring_mask);
+	ring->m_sqArray = get_ring_field<uint32_t>(ring->m_sqRing, params.sq_off.array);
+	ring->m_cqHead = get_ring_field<uint32_t>(ring->m_cqRing, params.cq_off.head);
+	ring->m_cqTail = get_ring_field<uint32_t>(ring->m_cqRing, params.cq_off.tail);
+	ring->m_cqMask = get_ring_field<uint32_t>(ring->m_cqRing, params.cq_off.ring_mask);
+	ring->m_cqes = get_ring_field<io_uring_cqe>(ring->m_cqRing, params.cq_off.cqes);
+	return ring;
+}
+
+mmd::IoUring::~IoUring()
+{
+	if(m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+	if(m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	if(m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingSize);
+	if(m_fd >= 0)
+		close(m_fd);
+}
+
+void mmd::IoUring::QueueRead(int fd, iovec *iov, uint64_t offset, uint64_t userData)
+{
+	// The kernel only reads the tail, which is published with release semantics
+	auto tail = *m_sqTail;
+	auto index = tail & *m_sqMask;
+	auto &sqe = m_sqes[index];
+	sqe = {};
+	// IORING_OP_READV instead of IORING_OP_READ, since the latter requires Linux 5.6
+	sqe.opcode = IORING_OP_READV;
+	sqe.fd = fd;
+	sqe.addr = reinterpret_cast<uint64_t>(iov);
+	sqe.len = 1;
+	sqe.off = offset;
+	sqe.user_data = userData;
+	m_sqArray[index] = index;
+	std::atomic_ref<uint32_t> {*m_sqTail}.store(tail + 1, std::memory_order_release);
+	++m_numQueued;
+}
+
+bool mmd::IoUring::Submit(uint32_t minComplete)
+{
+	for(;;) {
+		auto res = syscall(__NR_io_uring_enter, m_fd, m_numQueued, minComplete, (minComplete > 0) ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if(res >= 0) {
+			m_numQueued -= std::min<uint32_t>(res, m_numQueued);
+			return true;
+		}
+		if(errno != EINTR)
+			return false;
+	}
+}
+
+template<class TFunc>
+void mmd::IoUring::ForEachCompletion(const TFunc &func)
+{
+	auto head = *m_cqHead;
+	auto tail = std::atomic_ref<uint32_t> {*m_cqTail}.load(std::memory_order_acquire);
+	for(; head != tail; ++head) {
+		auto &cqe = m_cqes[head & *m_cqMask];
+		func(cqe.user_data, cqe.res);
+	}
+	std::atomic_ref<uint32_t> {*m_cqHead}.store(head, std::memory_order_release);
+}
+
+bool mmd::read_files_io_uring(const std::vector<std::string> &paths, const std::function<void(size_t, std::span<const uint8_t>)> &onRead, const BatchSettings &settings)
+{
+	auto ring = IoUring::Create(std::max(settings.queueDepth, 1u));
+	if(!ring)
+		return false;
+	std::vector<PendingRead> reads {paths.size()};
+	CompletionQueue queue;
+	// The first exception thrown by onRead is rethrown after all threads have been joined, the remaining files are
+	// still read but no longer handed to onRead
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	std::atomic<bool> hasError {false};
+	auto parse = [&queue, &reads, &onRead, &error, &errorMutex, &hasError]() {
+		size_t index;
+		while(queue.Pop(index)) {
+			auto &read = reads[index];
+			if(!hasError) {
+				try {
+					onRead(index, read.data);
+				}
+				catch(...) {
+					std::scoped_lock lock {errorMutex};
+					if(!error)
+						error = std::current_exception();
+					hasError = true;
+				}
+			}
+			read.data = {};
+		}
+	};
+	ConsumerThreads threads {queue};
+	threads.Start(get_thread_count(settings.numThreads, paths.size()), parse);
+
+	auto finish = [&queue, &reads](size_t index, bool success) {
+		auto &read = reads[index];
+		if(read.fd != -1)
+			close(read.fd);
+		read.fd = -1;
+		if(success)
+			read.data.resize(read.offset);
+		else
+			read.data = {};
+		queue.Push(index);
+	};
+	// A single read can return less than requested (e.g. for very large files), in which case the rest is requested again
+	auto queueRead = [&ring, &reads](size_t index) {
+		auto &read = reads[index];
+		read.iov.iov_base = read.data.data() + read.offset;
+		read.iov.iov_len = read.data.size() - read.offset;
+		ring->QueueRead(read.fd, &read.iov, read.offset, index);
+	};
+	size_t next = 0;
+	uint32_t numInFlight = 0;
+	auto queueDepth = std::max(settings.queueDepth, 1u);
+	auto failed = false;
+	// Exceptions on this thread (e.g. a failed allocation of a read buffer) must not unwind while the kernel may still
+	// write to the buffers of the reads in flight
+	std::exception_ptr submitError;
+	try {
+		while(!failed && (next < paths.size() || numInFlight > 0)) {
+			for(; next < paths.size() && numInFlight < queueDepth; ++next) {
+				auto &read = reads[next];
+				read.fd = open(paths[next].c_str(), O_RDONLY | O_CLOEXEC);
+				struct stat st;
+				if(read.fd == -1 || fstat(read.fd, &st) != 0) {
+					finish(next, false);
+					continue;
+				}
+				read.data.resize(st.st_size);
+				if(read.data.empty()) {
+					finish(next, true);
+					continue;
+				}
+				queueRead(next);
+				++numInFlight;
+			}
+			if(numInFlight == 0)
+				continue;
+			if(!ring->Submit(1)) {
+				failed = true;
+				break;
+			}
+			ring->ForEachCompletion([&reads, &finish, &queueRead, &numInFlight](uint64_t index, int32_t res) {
+				auto &read = reads[index];
+				if(res == -EINTR || res == -EAGAIN) {
+					queueRead(index);
+					return;
+				}
+				if(res > 0) {
+					read.offset += res;
+					if(read.offset < read.data.size()) {
+						queueRead(index);
+						return;
+					}
+				}
+				// res == 0 means the file was truncated after fstat
+				--numInFlight;
+				finish(index, res >= 0);
+			});
+		}
+	}
+	catch(...) {
+		submitError = std::current_exception();
+		failed = true;
+	}
+	if(failed) {
+		// Only happens if io_uring_enter itself fails or an exception was thrown. Closing the ring doesn't cancel the reads
+		// in flight synchronously, so their completions are awaited first. If that fails as well, their buffers are leaked
+		// instead of being reused while the kernel may still write to them. The files that haven't been handed to the parsers
+		// are then read with blocking reads, unless the exception is rethrown.
+		auto drained = true;
+		while(numInFlight > 0 && drained) {
+			drained = ring->Submit(1);
+			ring->ForEachCompletion([&numInFlight](uint64_t, int32_t) { --numInFlight; });
+		}
+		if(!drained) {
+			for(size_t i = 0; i < next; ++i) {
+				auto &read = reads[i];
+				if(read.fd != -1)
+					new std::vector<uint8_t> {std::move(read.data)}; // Intentionally leaked
+			}
+		}
+		ring = nullptr;
+		if(submitError) {
+			for(auto &read : reads) {
+				if(read.fd != -1)
+					close(read.fd);
+			}
+			std::rethrow_exception(submitError);
+		}
+		for(size_t i = 0; i < paths.size(); ++i) {
+			auto &read = reads[i];
+			if(read.fd == -1 && i < next)
+				continue;
+			if(read.fd != -1)
+				close(read.fd);
+			read.fd = -1;
+			read.offset = 0;
+			if(!read_file(paths[i], read.data))
+				read.data = {};
+			queue.Push(i);
+		}
+	}
+	threads.Join();
+	if(error)
+		std::rethrow_exception(error);
+	return true;
+}
+#endif
+
+std::string_view mmd::to_string(BatchBackend backend)
+{
+	switch(backend) {
+	case BatchBackend::Auto:
+		return "auto";
+	case BatchBackend::IoUring:
+		return "io_uring";
+	case BatchBackend::ThreadPool:
+		return "thread_pool";
+	}
+	return "";
+}
+
+bool mmd::is_io_uring_supported()
+{
+#ifdef UTIL_MMD_HAS_IO_URING
+	static auto supported = (IoUring::Create(1) != nullptr);
+	return supported;
+#else
+	return false;
+#endif
+}
+
+mmd::BatchBackend mmd::read_files(const std::vector<std::string> &paths, const std::function<void(size_t, std::span<const uint8_t>)> &onRead, const BatchSettings &settings)
+{
+	UTIL_MMD_TRACE_SCOPE("read_files");
+#ifdef UTIL_MMD_HAS_IO_URING
+	if(settings.backend != BatchBackend::ThreadPool && read_files_io_uring(paths, onRead, settings))
+		return BatchBackend::IoUring;
+#endif
+	parallel_for(paths.size(), settings.numThreads, [&paths, &onRead](size_t i) {
+		std::vector<uint8_t> data;
+		if(!read_file(paths[i], data))
+			data.clear();
+		onRead(i, data);
+	});
+	return BatchBackend::ThreadPool;
+}
+
+std::vector<std::shared_ptr<mmd::pmx::ModelData>> mmd::pmx::load(const std::vector<std::string> &paths, LoadFlags flags, const BatchSettings &settings)
+{
+	UTIL_MMD_TRACE_SCOPE("pmx::load_batch");
+	std::vector<std::shared_ptr<ModelData>> models;
+	models.resize(paths.size());
+	read_files(
+	  paths,
+	  [&models, flags](size_t i, std::span<const uint8_t> data) {
+		  if(data.empty())
+			  return;
+		  // Malformed files only fail their own entry
+		  try {
+			  SpanFile f {data};
+			  models[i] = load(f, flags);
+		  }
+		  catch(const std::exception &) {
+			  models[i] = nullptr;
+		  }
+	  },
+	  settings);
+	return models;
+}
+
+std::vector<std::shared_ptr<mmd::vmd::AnimationData>> mmd::vmd::load(const std::vector<std::string> &paths, const BatchSettings &settings)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::load_batch");
+	std::vector<std::shared_ptr<AnimationData>> motions;
+	motions.resize(paths.size());
+	read_files(
+	  paths,
+	  [&motions](size_t i, std::span<const uint8_t> data) {
+		  if(data.empty())
+			  return;
+		  try {
+			  SpanFile f {data};
+			  motions[i] = load(f);
+		  }
+		  catch(const std::exception &) {
+			  motions[i] = nullptr;
+		  }
+	  },
+	  settings);
+	return motions;
+}
@@ -0,0 +1,360 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_catalog.hpp"
+#include "util_mmd_trace.hpp"
+#include "util_mmd_io.hpp"
+#include "span_reader.hpp"
+#include "parallel.hpp"
+#include <fsys/filesystem.h>
+#include <fsys/ifile.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+
+// Catalog file layout:
+// CatalogHeader
+// EntryRecord[entryCount]
+// char[stringDataSize] (all strings referenced by the entries, without terminators)
+namespace mmd {
+	namespace catalog {
+		static constexpr std::array<char, 8> SIGNATURE {'M', 'M', 'D', 'C', 'A', 'T', '\0', '\0'};
+		static constexpr uint32_t FORMAT_VERSION = 2; // 2: Paths are absolute and normalized
+#pragma pack(push, 1)
+		struct CatalogHeader {
+			std::array<char, 8> signature;
+			uint32_t version;
+			uint32_t entryCount;
+			uint64_t stringDataSize;
+		};
+		struct StringRef {
+			uint64_t offset;
+			uint32_t length;
+		};
+		struct EntryRecord {
+			StringRef path;
+			uint64_t size;
+			int64_t modificationTime;
+			uint64_t contentHash;
+			AssetType type;
+			// Models: Version, header, local/global name, local/global comment and the counts from pmx::ProbeInfo
+			// Motions: Model name, the section counts and the frame range from vmd::ProbeInfo
+			float version;
+			std::array<uint8_t, 8> header;
+			std::array<StringRef, 4> strings;
+			uint32_t counts[8]; // Not std::array, the member is misaligned
+		};
+#pragma pack(pop)
+		static_assert(sizeof(EntryRecord) == 129);
+
+		static uint64_t compute_hash(std::span<const uint8_t> data)
+		{
+			uint64_t hash = 14695981039346656037ull;
+			for(auto b : data) {
+				hash ^= b;
+				hash *= 1099511628211ull;
+			}
+			return hash;
+		}
+		// Absolute, lexically normalized path with '/' as separator and without trailing separator
+		static std::filesystem::path normalize_path(std::string_view path)
+		{
+			std::error_code ec;
+			auto normalized = std::filesystem::absolute(std::filesystem::path {path}, ec);
+			if(ec)
+				normalized = std::filesystem::path {path};
+			normalized = normalized.lexically_normal();
+			if(!normalized.has_filename() && normalized.has_relative_path())
+				normalized = normalized.parent_path();
+			return normalized;
+		}
+		static std::optional<AssetType> get_asset_type(const std::filesystem::path &path)
+		{
+			std::string ext;
+			to_lower_ascii(path.extension().string(), ext);
+			if(ext == ".pmx" || ext == ".pmd")
+				return AssetType::Model;
+			if(ext == ".vmd")
+				return AssetType::Motion;
+			return {};
+		}
+		// PMD models can't be probed, so they are fully loaded instead
+		static std::optional<pmx::ProbeInfo> probe_pmd(std::span<const uint8_t> data)
+		{
+			auto mdl = pmd::load(data);
+			if(!mdl)
+				return {};
+			pmx::ProbeInfo info {};
+			info.version = mdl->version;
+			info.nameGlobal = mdl->characterName;
+			info.commentGlobal = mdl->comment;
+			info.vertexCount = mdl->vertices.size();
+			info.faceCount = mdl->faces.size();
+			info.textureCount = mdl->textures.size();
+			info.materialCount = mdl->materials.size();
+			info.boneCount = mdl->bones.size();
+			info.morphCount = mdl->morphs.size();
+			return info;
+		}
+		static bool probe_file(CatalogEntry &entry)
+		{
+			auto file = MappedFile::Open(entry.path);
+			if(!file)
+				return false;
+			auto data = file->GetData();
+			if(entry.type == AssetType::Motion) {
+				auto info = vmd::probe(data);
+				if(!info)
+					return false;
+				entry.motion = std::move(*info);
+			}
+			else {
+				auto isPmd = (data.size() >= 3 && memcmp(data.data(), "Pmd", 3) == 0);
+				auto info = isPmd ? probe_pmd(data) : pmx::probe(data);
+				if(!info)
+					return false;
+				entry.model = std::move(*info);
+			}
+			entry.size = data.size();
+			entry.contentHash = compute_hash(data);
+			return true;
+		}
+	};
+};
+
+std::shared_ptr<mmd::Catalog> mmd::Catalog::Load(const std::string &path)
+{
+	UTIL_MMD_TRACE_SCOPE("Catalog::Load");
+	using namespace catalog;
+	auto file = MappedFile::Open(path);
+	if(!file)
+		return nullptr;
+	SpanReader reader {file->GetData()};
+	auto header = reader.Read<CatalogHeader>();
+	if(reader.Failed() || header.signature != SIGNATURE || header.version != FORMAT_VERSION)
+		return nullptr;
+	auto records = reader.ReadSpan<EntryRecord>(header.entryCount);
+	auto stringData = reader.ReadBytes(header.stringDataSize);
+	if(reader.Failed())
+		return nullptr;
+	auto getString = [&stringData](const StringRef &ref, std::string &outStr) {
+		if(ref.offset > stringData.size() || ref.length > stringData.size() - ref.offset)
+			return false;
+		outStr.assign(reinterpret_cast<const char *>(stringData.data() + ref.offset), ref.length);
+		return true;
+	};
+
+	auto catalog = std::make_shared<Catalog>();
+	catalog->m_entries.reserve(records.size());
+	for(auto &record : records) {
+		auto &entry = catalog->m_entries.emplace_back();
+		entry.size = record.size;
+		entry.modificationTime = record.modificationTime;
+		entry.contentHash = record.contentHash;
+		entry.type = record.type;
+		auto valid = getString(record.path, entry.path);
+		if(entry.type == AssetType::Model) {
+			auto &info = entry.model;
+			info.version = record.version;
+			memcpy(&info.header, record.header.data(), sizeof(info.header));
+			valid = valid && getString(record.strings[0], info.nameLocal) && getString(record.strings[1], info.nameGlobal) && getString(record.strings[2], info.commentLocal) && getString(record.strings[3], info.commentGlobal);
+			std::array<uint32_t *, 6> counts {&info.vertexCount, &info.faceCount, &info.textureCount, &info.materialCount, &info.boneCount, &info.morphCount};
+			for(size_t i = 0; i < counts.size(); ++i)
+				*counts[i] = record.counts[i];
+		}
+		else {
+			auto &info = entry.motion;
+			valid = valid && getString(record.strings[0], info.modelName);
+			std::array<uint32_t *, 8> counts {&info.keyframeCount, &info.morphCount, &info.cameraCount, &info.lightCount, &info.selfShadowCount, &info.showIkCount, &info.minFrame, &info.maxFrame};
+			for(size_t i = 0; i < counts.size(); ++i)
+				*counts[i] = record.counts[i];
+		}
+		if(!valid)
+			return nullptr;
+	}
+	catalog->RebuildIndex();
+	return catalog;
+}
+
+bool mmd::Catalog::Save(const std::string &path) const
+{
+	UTIL_MMD_TRACE_SCOPE("Catalog::Save");
+	using namespace catalog;
+	static_assert(sizeof(pmx::Header) == sizeof(EntryRecord::header));
+	std::vector<EntryRecord> records;
+	records.reserve(m_entries.size());
+	std::string stringData;
+	auto addString = [&stringData](const std::string &str) -> StringRef {
+		StringRef ref {stringData.size(), static_cast<uint32_t>(str.size())};
+		stringData += str;
+		return ref;
+	};
+	for(auto &entry : m_entries) {
+		auto &record = records.emplace_back();
+		memset(&record, 0, sizeof(record));
+		record.path = addString(entry.path);
+		record.size = entry.size;
+		record.modificationTime = entry.modificationTime;
+		record.contentHash = entry.contentHash;
+		record.type = entry.type;
+		if(entry.type == AssetType::Model) {
+			auto &info = entry.model;
+			record.version = info.version;
+			memcpy(record.header.data(), &info.header, sizeof(info.header));
+			record.strings = {addString(info.nameLocal), addString(info.nameGlobal), addString(info.commentLocal), addString(info.commentGlobal)};
+			std::array<uint32_t, 8> counts {info.vertexCount, info.faceCount, info.textureCount, info.materialCount, info.boneCount, info.morphCount, 0, 0};
+			memcpy(record.counts, counts.data(), sizeof(record.counts));
+		}
+		else {
+			auto &info = entry.motion;
+			record.strings[0] = addString(info.modelName);
+			std::array<uint32_t, 8> counts {info.keyframeCount, info.morphCount, info.cameraCount, info.lightCount, info.selfShadowCount, info.showIkCount, info.minFrame, info.maxFrame};
+			memcpy(record.counts, counts.data(), sizeof(record.counts));
+		}
+	}
+
+	VFilePtr f = FileManager::OpenSystemFile(path.c_str(), "wb");
+	if(f == nullptr)
+		return false;
+	fsys::File fp {f};
+	CatalogHeader header {SIGNATURE, FORMAT_VERSION, static_cast<uint32_t>(records.size()), stringData.size()};
+	auto recordSize = records.size() * sizeof(EntryRecord);
+	return fp.Write(&header, sizeof(header)) == sizeof(header) && fp.Write(records.data(), recordSize) == recordSize && fp.Write(stringData.data(), stringData.size()) == stringData.size();
+}
+
+mmd::Catalog::UpdateResult mmd::Catalog::Update(const std::string &rootPath, uint32_t numThreads)
+{
+	UTIL_MMD_TRACE_SCOPE("Catalog::Update");
+	using namespace catalog;
+	UpdateResult result {};
+	std::vector<CatalogEntry> candidates;
+	std::unordered_set<std::string> existingPaths;
+	// Paths of the walk are derived from the normalized root, so the same file always has the same path
+	auto normalizedRoot = normalize_path(rootPath);
+	std::error_code ec;
+	for(auto it = std::filesystem::recursive_directory_iterator {normalizedRoot, std::filesystem::directory_options::skip_permission_denied, ec}; !ec && it != std::filesystem::recursive_directory_iterator {}; it.increment(ec)) {
+		// Errors for individual files must not end the directory walk
+		std::error_code fileEc;
+		if(!it->is_regular_file(fileEc))
+			continue;
+		auto type = get_asset_type(it->path());
+		if(!type)
+			continue;
+		auto path = it->path().generic_string();
+		auto size = it->file_size(fileEc);
+		auto modificationTime = static_cast<int64_t>(it->last_write_time(fileEc).time_since_epoch().count());
+		if(fileEc)
+			continue;
+		existingPaths.insert(path);
+		auto existing = m_pathToEntry.find(path);
+		if(existing != m_pathToEntry.end() && m_entries[existing->second].size == size && m_entries[existing->second].modificationTime == modificationTime) {
+			++result.unchanged;
+			continue;
+		}
+		auto &entry = candidates.emplace_back();
+		entry.path = std::move(path);
+		entry.type = *type;
+		entry.modificationTime = modificationTime;
+	}
+
+	std::vector<uint8_t> probed(candidates.size(), false);
+	parallel_for(candidates.size(), numThreads, [&candidates, &probed](size_t i) { probed[i] = probe_file(candidates[i]); });
+
+	// Remove entries for files that were deleted or could no longer be probed. If the directory walk
+	// ended with an error, files that weren't visited can't be told apart from deleted ones.
+	auto scanComplete = !ec;
+	auto root = normalizedRoot.generic_string();
+	if(root.empty() || root.back() != '/')
+		root += '/';
+	auto isBelowRoot = [&root](const std::string &path) { return path.size() > root.size() && path.compare(0, root.size(), root) == 0; };
+	std::unordered_set<std::string> failedPaths;
+	for(size_t i = 0; i < candidates.size(); ++i) {
+		if(!probed[i])
+			failedPaths.insert(candidates[i].path);
+	}
+	auto numEntries = m_entries.size();
+	std::erase_if(m_entries, [&](const CatalogEntry &entry) { return failedPaths.contains(entry.path) || (scanComplete && isBelowRoot(entry.path) && !existingPaths.contains(entry.path)); });
+	result.removed = numEntries - m_entries.size();
+	RebuildIndex();
+
+	for(size_t i = 0; i < candidates.size(); ++i) {
+		if(!probed[i]) {
+			++result.failed;
+			continue;
+		}
+		auto it = m_pathToEntry.find(candidates[i].path);
+		if(it != m_pathToEntry.end()) {
+			m_entries[it->second] = std::move(candidates[i]);
+			++result.updated;
+			continue;
+		}
+		m_entries.push_back(std::move(candidates[i]));
+		++result.added;
+	}
+	RebuildIndex();
+	return result;
+}
+
+void mmd::Catalog::Clear()
+{
+	m_entries.clear();
+	RebuildIndex();
+}
+
+void mmd::Catalog::RebuildIndex()
+{
+	m_pathToEntry.clear();
+	m_modelsByBoneCount.clear();
+	m_motionsByModelName.clear();
+	m_pathToEntry.reserve(m_entries.size());
+	for(uint32_t i = 0; i < m_entries.size(); ++i) {
+		auto &entry = m_entries[i];
+		m_pathToEntry[entry.path] = i;
+		if(entry.type == AssetType::Model)
+			m_modelsByBoneCount.push_back(i);
+		else
+			m_motionsByModelName[entry.motion.modelName].push_back(i);
+	}
+	std::stable_sort(m_modelsByBoneCount.begin(), m_modelsByBoneCount.end(), [this](uint32_t a, uint32_t b) { return m_entries[a].model.boneCount < m_entries[b].model.boneCount; });
+}
+
+const mmd::CatalogEntry *mmd::Catalog::Find(std::string_view path) const
+{
+	auto it = m_pathToEntry.find(catalog::normalize_path(path).generic_string());
+	return (it != m_pathToEntry.end()) ? &m_entries[it->second] : nullptr;
+}
+
+std::vector<const mmd::CatalogEntry *> mmd::Catalog::FindModelsByBoneCount(uint32_t minBoneCount, uint32_t maxBoneCount) const
+{
+	auto getBoneCount = [this](uint32_t idx) { return m_entries[idx].model.boneCount; };
+	auto begin = std::ranges::lower_bound(m_modelsByBoneCount, minBoneCount, {}, getBoneCount);
+	auto end = std::ranges::upper_bound(begin, m_modelsByBoneCount.end(), maxBoneCount, {}, getBoneCount);
+	std::vector<const CatalogEntry *> results;
+	results.reserve(end - begin);
+	for(auto it = begin; it != end; ++it)
+		results.push_back(&m_entries[*it]);
+	return results;
+}
+
+std::vector<const mmd::CatalogEntry *> mmd::Catalog::FindMotionsForModel(std::string_view modelName) const
+{
+	std::vector<const CatalogEntry *> results;
+	auto it = m_motionsByModelName.find(modelName);
+	if(it == m_motionsByModelName.end())
+		return results;
+	results.reserve(it->second.size());
+	for(auto idx : it->second)
+		results.push_back(&m_entries[idx]);
+	return results;
+}
+
+std::vector<const mmd::CatalogEntry *> mmd::Catalog::Query(const std::function<bool(const CatalogEntry &)> &predicate) const
+{
+	std::vector<const CatalogEntry *> results;
+	for(auto &entry : m_entries) {
+		if(predicate(entry))
+			results.push_back(&entry);
+	}
+	return results;
+}
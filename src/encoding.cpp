@@ -0,0 +1,139 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_encoding.hpp"
+#include <algorithm>
+#include <cinttypes>
+#include <vector>
+
+#include "shift_jis_table.inl"
+
+namespace mmd {
+	static int32_t get_lead_row(uint8_t lead)
+	{
+		if(lead >= 0x81 && lead <= 0x9F)
+			return lead - 0x81;
+		if(lead >= 0xE0 && lead <= 0xFC)
+			return lead - 0xE0 + (0xA0 - 0x81);
+		return -1;
+	}
+	static void append_utf8(uint32_t cp, std::string &out)
+	{
+		if(cp < 0x80)
+			out += static_cast<char>(cp);
+		else if(cp < 0x800) {
+			out += static_cast<char>(0xC0 | (cp >> 6));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		else {
+			out += static_cast<char>(0xE0 | (cp >> 12));
+			out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+	}
+	// Decodes the next code point, returns 0xFFFFFFFF for invalid sequences
+	static uint32_t next_utf8(std::string_view str, size_t &offset)
+	{
+		auto c = static_cast<uint8_t>(str[offset++]);
+		if(c < 0x80)
+			return c;
+		uint32_t numCont;
+		uint32_t cp;
+		if((c & 0xE0) == 0xC0) {
+			numCont = 1;
+			cp = c & 0x1F;
+		}
+		else if((c & 0xF0) == 0xE0) {
+			numCont = 2;
+			cp = c & 0x0F;
+		}
+		else if((c & 0xF8) == 0xF0) {
+			numCont = 3;
+			cp = c & 0x07;
+		}
+		else
+			return 0xFFFFFFFF;
+		for(uint32_t i = 0; i < numCont; ++i) {
+			if(offset >= str.size() || (static_cast<uint8_t>(str[offset]) & 0xC0) != 0x80)
+				return 0xFFFFFFFF;
+			cp = (cp << 6) | (static_cast<uint8_t>(str[offset++]) & 0x3F);
+		}
+		return cp;
+	}
+
+	struct EncodeEntry {
+		uint16_t codePoint;
+		uint16_t sjis;
+	};
+	static const std::vector<EncodeEntry> &get_encode_table()
+	{
+		static auto table = []() {
+			std::vector<EncodeEntry> table;
+			table.reserve(8'000);
+			for(uint32_t row = 0; row < std::size(g_shiftJisTable); ++row) {
+				uint32_t lead = (row < (0xA0 - 0x81)) ? (0x81 + row) : (0xE0 + row - (0xA0 - 0x81));
+				for(uint32_t i = 0; i < std::size(g_shiftJisTable[row]); ++i) {
+					auto cp = g_shiftJisTable[row][i];
+					if(cp != 0)
+						table.push_back({cp, static_cast<uint16_t>((lead << 8) | (0x40 + i))});
+				}
+			}
+			// Some characters have several codes (NEC/IBM extensions), the first one is preferred
+			std::stable_sort(table.begin(), table.end(), [](const EncodeEntry &a, const EncodeEntry &b) { return a.codePoint < b.codePoint; });
+			table.erase(std::unique(table.begin(), table.end(), [](const EncodeEntry &a, const EncodeEntry &b) { return a.codePoint == b.codePoint; }), table.end());
+			return table;
+		}();
+		return table;
+	}
+};
+
+std::string mmd::shift_jis_to_utf8(std::string_view str)
+{
+	std::string result;
+	result.reserve(str.size() * 3 / 2);
+	for(size_t i = 0; i < str.size(); ++i) {
+		auto c = static_cast<uint8_t>(str[i]);
+		if(c < 0x80)
+			result += static_cast<char>(c);
+		else if(c >= 0xA1 && c <= 0xDF)
+			append_utf8(0xFF61 + (c - 0xA1), result); // Half-width katakana
+		else if(is_shift_jis_lead_byte(c) && i + 1 < str.size()) {
+			auto trail = static_cast<uint8_t>(str[++i]);
+			uint16_t cp = 0;
+			if(trail >= 0x40 && trail <= 0xFC)
+				cp = g_shiftJisTable[get_lead_row(c)][trail - 0x40];
+			append_utf8((cp != 0) ? cp : '?', result);
+		}
+		else
+			result += '?';
+	}
+	return result;
+}
+
+std::string mmd::utf8_to_shift_jis(std::string_view str)
+{
+	auto &table = get_encode_table();
+	std::string result;
+	result.reserve(str.size());
+	size_t offset = 0;
+	while(offset < str.size()) {
+		auto cp = next_utf8(str, offset);
+		if(cp < 0x80) {
+			result += static_cast<char>(cp);
+			continue;
+		}
+		if(cp >= 0xFF61 && cp <= 0xFF9F) {
+			result += static_cast<char>(0xA1 + (cp - 0xFF61));
+			continue;
+		}
+		auto it = std::lower_bound(table.begin(), table.end(), cp, [](const EncodeEntry &entry, uint32_t cp) { return entry.codePoint < cp; });
+		if(cp > 0xFFFF || it == table.end() || it->codePoint != cp) {
+			result += '?';
+			continue;
+		}
+		result += static_cast<char>(it->sjis >> 8);
+		result += static_cast<char>(it->sjis & 0xFF);
+	}
+	return result;
+}
@@ -0,0 +1,387 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_eval.hpp"
+#include "util_mmd_encoding.hpp"
+#include "util_mmd_sampler.hpp"
+#include "util_mmd_trace.hpp"
+#include "key_cursor.hpp"
+#include "math_util.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace mmd {
+	namespace eval {
+		static Vector3 to_vector(const std::array<float, 3> &v) { return Vector3 {v[0], v[1], v[2]}; }
+		static Vector4 to_quat(const std::array<float, 4> &v) { return Vector4 {v[0], v[1], v[2], v[3]}; }
+		static bool has_inheritance(const pmx::Bone &bone) { return (bone.flags & (pmx::BoneFlag::InheritRotation | pmx::BoneFlag::InheritTranslation)) != pmx::BoneFlag::None; }
+		// Interpolation table of a bone key: Curve c uses bytes c, 4 +c, 8 +c and 12 +c for x1, y1, x2, y2
+		static float evaluate_curve(const std::array<uint8_t, 64> &interpolation, uint32_t curve, float t)
+		{
+			return vmd::BezierCurve::FromBytes(interpolation[curve], interpolation[4 + curve], interpolation[8 + curve], interpolation[12 + curve]).Evaluate(t);
+		}
+		template<typename TFind>
+		static std::vector<int32_t> map_tracks(const vmd::TrackIndex &tracks, size_t count, const TFind &find)
+		{
+			std::vector<int32_t> map(count, -1);
+			for(uint32_t i = 0; i < tracks.names.size(); ++i) {
+				auto idx = find(shift_jis_to_utf8(tracks.names[i]));
+				if(idx >= 0 && static_cast<size_t>(idx) < count)
+					map[idx] = i;
+			}
+			return map;
+		}
+	};
+};
+
+std::unique_ptr<mmd::eval::EvalWorkspace> mmd::eval::EvalWorkspace::Create(std::shared_ptr<const pmx::ModelData> mdlData, std::shared_ptr<const vmd::AnimationData> animData)
+{
+	UTIL_MMD_TRACE_SCOPE("eval::EvalWorkspace::Create");
+	if(!mdlData || !animData)
+		return nullptr;
+	std::unique_ptr<EvalWorkspace> ws {new EvalWorkspace {}};
+	auto numBones = mdlData->bones.size();
+	auto numMorphs = mdlData->morphs.size();
+	auto numVertices = mdlData->vertices.size();
+	ws->m_boneTracks = vmd::build_track_index(animData->keyframes);
+	ws->m_morphTracks = vmd::build_track_index(animData->morphs);
+	pmx::NameIndexMap nameMap {*mdlData};
+	ws->m_boneToTrack = map_tracks(ws->m_boneTracks, numBones, [&nameMap](std::string_view name) { return nameMap.FindBone(name); });
+	ws->m_morphToTrack = map_tracks(ws->m_morphTracks, numMorphs, [&nameMap](std::string_view name) { return nameMap.FindMorph(name); });
+	ws->m_boneCursors.resize(ws->m_boneTracks.names.size(), 0);
+	ws->m_morphCursors.resize(ws->m_morphTracks.names.size(), 0);
+
+	// Depth-first post-order over the dependencies, so that every bone is updated after its parent and the bone it
+	// inherits from. Dependencies that would form a cycle are ignored for the order.
+	enum class VisitState : uint8_t { Unvisited = 0, Visiting, Done };
+	std::vector<VisitState> states(numBones, VisitState::Unvisited);
+	std::vector<uint32_t> stack;
+	ws->m_boneOrder.reserve(numBones);
+	for(uint32_t root = 0; root < numBones; ++root) {
+		stack.push_back(root);
+		while(!stack.empty()) {
+			auto idx = stack.back();
+			auto &state = states[idx];
+			if(state == VisitState::Unvisited) {
+				state = VisitState::Visiting;
+				auto &bone = mdlData->bones[idx];
+				for(auto dep : {bone.parentBoneIdx, has_inheritance(bone) ? bone.inheritBoneIdx : -1}) {
+					if(dep >= 0 && static_cast<size_t>(dep) < numBones && states[dep] == VisitState::Unvisited)
+						stack.push_back(dep);
+				}
+				continue;
+			}
+			stack.pop_back();
+			if(state == VisitState::Visiting) {
+				state = VisitState::Done;
+				ws->m_boneOrder.push_back(idx);
+			}
+		}
+	}
+
+	ws->m_localPose.resize(numBones);
+	ws->m_globalPose.resize(numBones);
+	ws->m_inheritedPose.resize(numBones);
+	ws->m_morphWeights.resize(numMorphs, 0.f);
+	ws->m_effectiveMorphWeights.resize(numMorphs, 0.f);
+	ws->m_vertexOffsets.resize(numVertices, Vector3 {0.f, 0.f, 0.f});
+	ws->m_vertexTouched.resize(numVertices, 0);
+	size_t maxTouched = 0;
+	for(auto &morph : mdlData->morphs) {
+		if(morph->type == pmx::MorphType::Vertex)
+			maxTouched += morph->count;
+	}
+	ws->m_touchedVertices.reserve(std::min(maxTouched, numVertices));
+	ws->m_skinningTransforms.resize(numBones);
+	ws->m_skinnedPositions.resize(numVertices, Vector3 {0.f, 0.f, 0.f});
+	ws->m_skinnedNormals.resize(numVertices, Vector3 {0.f, 0.f, 0.f});
+	ws->m_mdlData = std::move(mdlData);
+	ws->m_animData = std::move(animData);
+	return ws;
+}
+
+void mmd::eval::EvalWorkspace::Reset()
+{
+	std::fill(m_boneCursors.begin(), m_boneCursors.end(), 0);
+	std::fill(m_morphCursors.begin(), m_morphCursors.end(), 0);
+}
+
+void mmd::eval::EvalWorkspace::Evaluate(float frame, EvalFlags flags)
+{
+	UTIL_MMD_TRACE_SCOPE("eval::EvalWorkspace::Evaluate");
+	SamplePose(frame);
+	if((flags & EvalFlags::Morphs) != EvalFlags::None) {
+		SampleMorphs(frame);
+		ApplyMorphs();
+	}
+	else
+		ClearMorphs();
+	UpdateGlobalPose();
+	if((flags & EvalFlags::Ik) != EvalFlags::None)
+		SolveIk();
+	if((flags & EvalFlags::Skinning) != EvalFlags::None)
+		Skin();
+}
+
+void mmd::eval::EvalWorkspace::ClearMorphs()
+{
+	std::fill(m_morphWeights.begin(), m_morphWeights.end(), 0.f);
+	std::fill(m_effectiveMorphWeights.begin(), m_effectiveMorphWeights.end(), 0.f);
+	ClearVertexOffsets();
+}
+
+void mmd::eval::EvalWorkspace::ClearVertexOffsets()
+{
+	for(auto idx : m_touchedVertices) {
+		m_vertexOffsets[idx] = Vector3 {0.f, 0.f, 0.f};
+		m_vertexTouched[idx] = 0;
+	}
+	m_touchedVertices.clear();
+}
+
+void mmd::eval::EvalWorkspace::SamplePose(float frame)
+{
+	UTIL_MMD_TRACE_SCOPE("eval::SamplePose");
+	auto &keyframes = m_animData->keyframes;
+	for(size_t boneIdx = 0; boneIdx < m_localPose.size(); ++boneIdx) {
+		auto &pose = m_localPose[boneIdx];
+		pose = {};
+		auto track = m_boneToTrack[boneIdx];
+		if(track < 0)
+			continue;
+		auto offset = m_boneTracks.offsets[track];
+		auto numKeys = m_boneTracks.offsets[track + 1] - offset;
+		auto *keys = m_boneTracks.keys.data() + offset;
+		auto &cursor = m_boneCursors[track];
+		cursor = vmd::advance_cursor(cursor, numKeys, frame, [&keyframes, keys](uint32_t i) { return keyframes[keys[i]].frameIndex; });
+		auto &key0 = keyframes[keys[cursor]];
+		if(cursor + 1 >= numKeys || frame <= static_cast<float>(key0.frameIndex)) {
+			pose.translation = to_vector(key0.position);
+			pose.rotation = to_quat(key0.rotation);
+			continue;
+		}
+		// The interpolation curves of a segment are stored in its end key
+		auto &key1 = keyframes[keys[cursor + 1]];
+		auto t = (frame - key0.frameIndex) / static_cast<float>(key1.frameIndex - key0.frameIndex);
+		auto &ip = key1.interpolation;
+		pose.translation = Vector3 {key0.position[0] + (key1.position[0] - key0.position[0]) * evaluate_curve(ip, 0, t), key0.position[1] + (key1.position[1] - key0.position[1]) * evaluate_curve(ip, 1, t),
+		  key0.position[2] + (key1.position[2] - key0.position[2]) * evaluate_curve(ip, 2, t)};
+		pose.rotation = math::quat_slerp(to_quat(key0.rotation), to_quat(key1.rotation), evaluate_curve(ip, 3, t));
+	}
+}
+
+void mmd::eval::EvalWorkspace::SampleMorphs(float frame)
+{
+	UTIL_MMD_TRACE_SCOPE("eval::SampleMorphs");
+	auto &morphKeys = m_animData->morphs;
+	for(size_t morphIdx = 0; morphIdx < m_morphWeights.size(); ++morphIdx) {
+		auto &weight = m_morphWeights[morphIdx];
+		weight = 0.f;
+		auto track = m_morphToTrack[morphIdx];
+		if(track < 0)
+			continue;
+		auto offset = m_morphTracks.offsets[track];
+		auto numKeys = m_morphTracks.offsets[track + 1] - offset;
+		auto *keys = m_morphTracks.keys.data() + offset;
+		auto &cursor = m_morphCursors[track];
+		cursor = vmd::advance_cursor(cursor, numKeys, frame, [&morphKeys, keys](uint32_t i) { return morphKeys[keys[i]].frameIndex; });
+		auto &key0 = morphKeys[keys[cursor]];
+		weight = key0.weight;
+		if(cursor + 1 >= numKeys || frame <= static_cast<float>(key0.frameIndex))
+			continue;
+		auto &key1 = morphKeys[keys[cursor + 1]];
+		auto t = (frame - key0.frameIndex) / static_cast<float>(key1.frameIndex - key0.frameIndex);
+		weight = key0.weight + (key1.weight - key0.weight) * t;
+	}
+}
+
+void mmd::eval::EvalWorkspace::ApplyMorphs()
+{
+	UTIL_MMD_TRACE_SCOPE("eval::ApplyMorphs");
+	auto &morphs = m_mdlData->morphs;
+	std::copy(m_morphWeights.begin(), m_morphWeights.end(), m_effectiveMorphWeights.begin());
+	for(size_t i = 0; i < morphs.size(); ++i) {
+		auto &morph = *morphs[i];
+		auto weight = m_morphWeights[i];
+		if(morph.type != pmx::MorphType::Group || weight == 0.f)
+			continue;
+		auto *groupMorphs = static_cast<const pmx::GroupMorph *>(morph.morphs);
+		for(int32_t j = 0; j < morph.count; ++j) {
+			auto &child = groupMorphs[j];
+			if(child.index >= 0 && static_cast<size_t>(child.index) < m_effectiveMorphWeights.size())
+				m_effectiveMorphWeights[child.index] += weight * child.ratio;
+		}
+	}
+
+	ClearVertexOffsets();
+	for(size_t i = 0; i < morphs.size(); ++i) {
+		auto &morph = *morphs[i];
+		auto weight = m_effectiveMorphWeights[i];
+		if(weight == 0.f)
+			continue;
+		switch(morph.type) {
+		case pmx::MorphType::Vertex:
+			{
+				auto *vertexMorphs = static_cast<const pmx::VertexMorph *>(morph.morphs);
+				for(int32_t j = 0; j < morph.count; ++j) {
+					auto &vm = vertexMorphs[j];
+					if(static_cast<size_t>(vm.index) >= m_vertexOffsets.size())
+						continue;
+					if(!m_vertexTouched[vm.index]) {
+						m_vertexTouched[vm.index] = 1;
+						m_touchedVertices.push_back(vm.index);
+					}
+					m_vertexOffsets[vm.index] = m_vertexOffsets[vm.index] + vm.offset * weight;
+				}
+				break;
+			}
+		case pmx::MorphType::Bone:
+			{
+				auto *boneMorphs = static_cast<const pmx::BoneMorph *>(morph.morphs);
+				for(int32_t j = 0; j < morph.count; ++j) {
+					auto &bm = boneMorphs[j];
+					if(bm.index < 0 || static_cast<size_t>(bm.index) >= m_localPose.size())
+						continue;
+					auto &pose = m_localPose[bm.index];
+					pose.translation = pose.translation + bm.translation * weight;
+					pose.rotation = math::quat_mul(pose.rotation, math::quat_slerp(math::quat_identity(), bm.rotation, weight));
+				}
+				break;
+			}
+		default:
+			break;
+		}
+	}
+}
+
+void mmd::eval::EvalWorkspace::UpdateGlobalTransform(uint32_t boneIdx)
+{
+	auto &bones = m_mdlData->bones;
+	auto &bone = bones[boneIdx];
+	// The inherited part is taken from the local pose of the source bone, including its own inheritance
+	auto &local = m_inheritedPose[boneIdx];
+	local = m_localPose[boneIdx];
+	auto source = bone.inheritBoneIdx;
+	if(has_inheritance(bone) && source >= 0 && static_cast<size_t>(source) < bones.size() && static_cast<uint32_t>(source) != boneIdx) {
+		auto &sourceLocal = m_inheritedPose[source];
+		if((bone.flags & pmx::BoneFlag::InheritRotation) != pmx::BoneFlag::None)
+			local.rotation = math::quat_mul(local.rotation, math::quat_slerp(math::quat_identity(), sourceLocal.rotation, bone.inheritInfluence));
+		if((bone.flags & pmx::BoneFlag::InheritTranslation) != pmx::BoneFlag::None)
+			local.translation = local.translation + sourceLocal.translation * bone.inheritInfluence;
+	}
+
+	auto &global = m_globalPose[boneIdx];
+	auto parent = bone.parentBoneIdx;
+	if(parent < 0 || static_cast<size_t>(parent) >= bones.size() || static_cast<uint32_t>(parent) == boneIdx) {
+		global.translation = bone.position + local.translation;
+		global.rotation = local.rotation;
+		return;
+	}
+	auto &parentGlobal = m_globalPose[parent];
+	auto offset = bone.position - bones[parent].position + local.translation;
+	global.translation = parentGlobal.translation + math::quat_rotate(parentGlobal.rotation, offset);
+	global.rotation = math::quat_mul(parentGlobal.rotation, local.rotation);
+}
+
+void mmd::eval::EvalWorkspace::UpdateGlobalPose()
+{
+	for(auto boneIdx : m_boneOrder)
+		UpdateGlobalTransform(boneIdx);
+}
+
+void mmd::eval::EvalWorkspace::SolveIk()
+{
+	UTIL_MMD_TRACE_SCOPE("eval::SolveIk");
+	auto &bones = m_mdlData->bones;
+	auto &links = m_mdlData->ikLinks;
+	auto isValidBone = [&bones](int32_t idx) { return idx >= 0 && static_cast<size_t>(idx) < bones.size(); };
+	for(auto &chain : m_mdlData->ikChains) {
+		if(!isValidBone(chain.boneIndex) || !isValidBone(chain.targetBoneIndex) || chain.linkOffset + chain.linkCount > links.size())
+			continue;
+		auto goal = m_globalPose[chain.boneIndex].translation;
+		for(int32_t iteration = 0; iteration < chain.loopCount; ++iteration) {
+			for(uint32_t i = 0; i < chain.linkCount; ++i) {
+				auto &link = links[chain.linkOffset + i];
+				if(!isValidBone(link.boneIndex))
+					continue;
+				auto &linkGlobal = m_globalPose[link.boneIndex];
+				auto toEffector = m_globalPose[chain.targetBoneIndex].translation - linkGlobal.translation;
+				auto toGoal = goal - linkGlobal.translation;
+				auto lenEffector = uvec::length(toEffector);
+				auto lenGoal = uvec::length(toGoal);
+				if(lenEffector < 1e-6f || lenGoal < 1e-6f)
+					continue;
+				toEffector = toEffector * (1.f / lenEffector);
+				toGoal = toGoal * (1.f / lenGoal);
+				auto cosAngle = std::clamp(uvec::dot(toEffector, toGoal), -1.f, 1.f);
+				if(cosAngle > 1.f - 1e-6f)
+					continue;
+				auto angle = std::min(std::acos(cosAngle), chain.limitAngle);
+				auto axis = uvec::cross(toEffector, toGoal);
+				auto axisLen = uvec::length(axis);
+				if(axisLen < 1e-6f)
+					continue;
+				// Rotation axis in the local space of the link
+				auto localAxis = math::quat_rotate(math::quat_conjugate(linkGlobal.rotation), axis * (1.f / axisLen));
+				auto &local = m_localPose[link.boneIndex];
+				local.rotation = math::quat_normalize(math::quat_mul(local.rotation, math::quat_from_axis_angle(localAxis, angle)));
+				if(link.hasLimits) {
+					auto angles = math::quat_to_euler_yxz(local.rotation);
+					angles = Vector3 {std::clamp(angles.x, link.minAngle[0], link.maxAngle[0]), std::clamp(angles.y, link.minAngle[1], link.maxAngle[1]), std::clamp(angles.z, link.minAngle[2], link.maxAngle[2])};
+					local.rotation = math::quat_from_euler_yxz(angles);
+				}
+				// Links are ordered from the effector towards the chain root, so only the links below
+				// this one and the effector itself have to be updated
+				for(auto j = static_cast<int64_t>(i); j >= 0; --j) {
+					auto linkBone = links[chain.linkOffset + j].boneIndex;
+					if(isValidBone(linkBone))
+						UpdateGlobalTransform(linkBone);
+				}
+				UpdateGlobalTransform(chain.targetBoneIndex);
+			}
+		}
+		// Bones outside of the chain may depend on the solved links
+		UpdateGlobalPose();
+	}
+}
+
+void mmd::eval::EvalWorkspace::Skin()
+{
+	UTIL_MMD_TRACE_SCOPE("eval::Skin");
+	auto &bones = m_mdlData->bones;
+	for(size_t i = 0; i < bones.size(); ++i) {
+		auto &global = m_globalPose[i];
+		auto &skin = m_skinningTransforms[i];
+		skin.rotation = global.rotation;
+		skin.translation = global.translation - math::quat_rotate(global.rotation, bones[i].position);
+	}
+	auto &vertices = m_mdlData->vertices;
+	auto numBones = static_cast<int32_t>(bones.size());
+	for(size_t i = 0; i < vertices.size(); ++i) {
+		auto &v = vertices[i];
+		auto pos = Vector3 {v.position[0], v.position[1], v.position[2]} + m_vertexOffsets[i];
+		Vector3 normal {v.normal[0], v.normal[1], v.normal[2]};
+		Vector3 outPos {0.f, 0.f, 0.f};
+		Vector3 outNormal {0.f, 0.f, 0.f};
+		auto totalWeight = 0.f;
+		for(size_t j = 0; j < v.boneIds.size(); ++j) {
+			auto boneIdx = v.boneIds[j];
+			auto weight = v.boneWeights[j];
+			if(weight == 0.f || boneIdx < 0 || boneIdx >= numBones)
+				continue;
+			auto &skin = m_skinningTransforms[boneIdx];
+			outPos = outPos + (math::quat_rotate(skin.rotation, pos) + skin.translation) * weight;
+			outNormal = outNormal + math::quat_rotate(skin.rotation, normal) * weight;
+			totalWeight += weight;
+		}
+		if(totalWeight == 0.f) {
+			m_skinnedPositions[i] = pos;
+			m_skinnedNormals[i] = normal;
+			continue;
+		}
+		m_skinnedPositions[i] = outPos * (1.f / totalWeight);
+		auto len = uvec::length(outNormal);
+		m_skinnedNormals[i] = (len > 1e-6f) ? outNormal * (1.f / len) : normal;
+	}
+}
@@ -0,0 +1,371 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_footprint.hpp"
+
+namespace mmd {
+	class FootprintBuilder {
+	  public:
+		FootprintBuilder(MemoryFootprint &footprint) : m_footprint {footprint} {}
+		void SetCategory(FootprintCategory category) { m_category = category; }
+		void Add(uint64_t usedBytes, uint64_t capacityBytes, uint64_t allocations)
+		{
+			auto &category = m_footprint.categories[static_cast<size_t>(m_category)];
+			category.usedBytes += usedBytes;
+			category.capacityBytes += capacityBytes;
+			category.allocations += allocations;
+		}
+		void Add(const std::pmr::string &str)
+		{
+			// Short strings are stored inside the string object itself
+			auto *data = reinterpret_cast<const uint8_t *>(str.data());
+			auto *obj = reinterpret_cast<const uint8_t *>(&str);
+			if(data >= obj && data < obj + sizeof(str)) {
+				++m_footprint.inlineStringCount;
+				return;
+			}
+			++m_footprint.heapStringCount;
+			auto &category = m_footprint.categories[static_cast<size_t>(FootprintCategory::Strings)];
+			category.usedBytes += str.size() + 1;
+			category.capacityBytes += str.capacity() + 1;
+			++category.allocations;
+		}
+		template<class T>
+		void Add(const std::pmr::vector<T> &v)
+		{
+			if(v.capacity() > 0)
+				Add(v.size() * sizeof(T), v.capacity() * sizeof(T), 1);
+			if constexpr(std::is_same_v<T, std::pmr::string>) {
+				for(auto &str : v)
+					Add(str);
+			}
+		}
+	  private:
+		MemoryFootprint &m_footprint;
+		FootprintCategory m_category = FootprintCategory::Object;
+	};
+
+	template<class T>
+	static void shrink(std::pmr::vector<T> &v)
+	{
+		v.shrink_to_fit();
+		if constexpr(std::is_same_v<T, std::pmr::string>) {
+			for(auto &str : v)
+				str.shrink_to_fit();
+		}
+	}
+};
+
+static size_t get_morph_element_size(mmd::pmx::MorphType type)
+{
+	using namespace mmd::pmx;
+	switch(type) {
+	case MorphType::Group:
+	case MorphType::Flip:
+		return sizeof(GroupMorph);
+	case MorphType::Vertex:
+		return sizeof(VertexMorph);
+	case MorphType::Bone:
+		return sizeof(BoneMorph);
+	case MorphType::Uv:
+	case MorphType::Uva1:
+	case MorphType::Uva2:
+	case MorphType::Uva3:
+	case MorphType::Uva4:
+		return sizeof(UvMorph);
+	case MorphType::Material:
+		return sizeof(MaterialMorph);
+	case MorphType::Impulse:
+		return sizeof(ImpulseMorph);
+	}
+	return 0;
+}
+
+std::string_view mmd::to_string(FootprintCategory category)
+{
+	switch(category) {
+	case FootprintCategory::Object:
+		return "object";
+	case FootprintCategory::Vertices:
+		return "vertices";
+	case FootprintCategory::Faces:
+		return "faces";
+	case FootprintCategory::Textures:
+		return "textures";
+	case FootprintCategory::Materials:
+		return "materials";
+	case FootprintCategory::Bones:
+		return "bones";
+	case FootprintCategory::Ik:
+		return "ik";
+	case FootprintCategory::Morphs:
+		return "morphs";
+	case FootprintCategory::DisplayFrames:
+		return "display_frames";
+	case FootprintCategory::RigidBodies:
+		return "rigid_bodies";
+	case FootprintCategory::Joints:
+		return "joints";
+	case FootprintCategory::SoftBodies:
+		return "soft_bodies";
+	case FootprintCategory::Keyframes:
+		return "keyframes";
+	case FootprintCategory::MorphKeys:
+		return "morph_keys";
+	case FootprintCategory::Cameras:
+		return "cameras";
+	case FootprintCategory::Lights:
+		return "lights";
+	case FootprintCategory::SelfShadows:
+		return "self_shadows";
+	case FootprintCategory::ShowIk:
+		return "show_ik";
+	case FootprintCategory::Strings:
+		return "strings";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+uint64_t mmd::MemoryFootprint::GetUsedBytes() const
+{
+	uint64_t total = 0;
+	for(auto &category : categories)
+		total += category.usedBytes;
+	return total;
+}
+uint64_t mmd::MemoryFootprint::GetCapacityBytes() const
+{
+	uint64_t total = 0;
+	for(auto &category : categories)
+		total += category.capacityBytes;
+	return total;
+}
+uint64_t mmd::MemoryFootprint::GetAllocationCount() const
+{
+	uint64_t total = 0;
+	for(auto &category : categories)
+		total += category.allocations;
+	return total;
+}
+
+mmd::MemoryFootprint mmd::get_memory_footprint(const pmx::ModelData &mdlData)
+{
+	MemoryFootprint footprint {};
+	FootprintBuilder builder {footprint};
+	builder.Add(sizeof(mdlData), sizeof(mdlData), 0);
+	builder.Add(mdlData.characterName);
+	builder.Add(mdlData.comment);
+
+	builder.SetCategory(FootprintCategory::Vertices);
+	builder.Add(mdlData.vertices);
+
+	builder.SetCategory(FootprintCategory::Faces);
+	builder.Add(mdlData.faces);
+
+	builder.SetCategory(FootprintCategory::Textures);
+	builder.Add(mdlData.textures);
+
+	builder.SetCategory(FootprintCategory::Materials);
+	builder.Add(mdlData.materials);
+	for(auto &mat : mdlData.materials) {
+		builder.Add(mat.name);
+		builder.Add(mat.memo);
+	}
+
+	builder.SetCategory(FootprintCategory::Bones);
+	builder.Add(mdlData.bones);
+	for(auto &bone : mdlData.bones) {
+		builder.Add(bone.nameJp);
+		builder.Add(bone.name);
+	}
+
+	builder.SetCategory(FootprintCategory::Ik);
+	builder.Add(mdlData.ikChains);
+	builder.Add(mdlData.ikLinks);
+
+	builder.SetCategory(FootprintCategory::Morphs);
+	builder.Add(mdlData.morphs);
+	for(auto &morph : mdlData.morphs) {
+		builder.Add(sizeof(*morph), sizeof(*morph), 1);
+		builder.Add(morph->nameLocal);
+		builder.Add(morph->nameGlobal);
+		if(morph->morphs) {
+			auto size = static_cast<uint64_t>(morph->count) * get_morph_element_size(morph->type);
+			builder.Add(size, size, 1);
+		}
+	}
+
+	builder.SetCategory(FootprintCategory::DisplayFrames);
+	builder.Add(mdlData.displayFrames);
+	for(auto &frame : mdlData.displayFrames) {
+		builder.Add(frame.nameLocal);
+		builder.Add(frame.nameGlobal);
+	}
+	builder.Add(mdlData.displayFrameEntries);
+
+	builder.SetCategory(FootprintCategory::RigidBodies);
+	auto &rigidBodies = mdlData.rigidBodies;
+	builder.Add(rigidBodies.namesLocal);
+	builder.Add(rigidBodies.namesGlobal);
+	builder.Add(rigidBodies.boneIndices);
+	builder.Add(rigidBodies.groups);
+	builder.Add(rigidBodies.noCollisionMasks);
+	builder.Add(rigidBodies.shapes);
+	builder.Add(rigidBodies.sizes);
+	builder.Add(rigidBodies.positions);
+	builder.Add(rigidBodies.rotations);
+	builder.Add(rigidBodies.masses);
+	builder.Add(rigidBodies.linearDampings);
+	builder.Add(rigidBodies.angularDampings);
+	builder.Add(rigidBodies.restitutions);
+	builder.Add(rigidBodies.frictions);
+	builder.Add(rigidBodies.physicsModes);
+	builder.Add(rigidBodies.orientations);
+	builder.Add(rigidBodies.boneOffsets);
+	builder.Add(rigidBodies.aabbMin);
+	builder.Add(rigidBodies.aabbMax);
+
+	builder.SetCategory(FootprintCategory::Joints);
+	auto &joints = mdlData.joints;
+	builder.Add(joints.namesLocal);
+	builder.Add(joints.namesGlobal);
+	builder.Add(joints.types);
+	builder.Add(joints.rigidBodyA);
+	builder.Add(joints.rigidBodyB);
+	builder.Add(joints.positions);
+	builder.Add(joints.rotations);
+	builder.Add(joints.positionMin);
+	builder.Add(joints.positionMax);
+	builder.Add(joints.rotationMin);
+	builder.Add(joints.rotationMax);
+	builder.Add(joints.springPositions);
+	builder.Add(joints.springRotations);
+	builder.Add(joints.orientations);
+
+	builder.SetCategory(FootprintCategory::SoftBodies);
+	builder.Add(mdlData.softBodies);
+	for(auto &softBody : mdlData.softBodies) {
+		builder.Add(softBody.nameLocal);
+		builder.Add(softBody.nameGlobal);
+	}
+	builder.Add(mdlData.softBodyAnchors);
+	builder.Add(mdlData.softBodyPinnedVertices);
+	return footprint;
+}
+
+mmd::MemoryFootprint mmd::get_memory_footprint(const vmd::AnimationData &animData)
+{
+	MemoryFootprint footprint {};
+	FootprintBuilder builder {footprint};
+	builder.Add(sizeof(animData), sizeof(animData), 0);
+	builder.Add(animData.modelName);
+	builder.SetCategory(FootprintCategory::Keyframes);
+	builder.Add(animData.keyframes);
+	builder.SetCategory(FootprintCategory::MorphKeys);
+	builder.Add(animData.morphs);
+	builder.SetCategory(FootprintCategory::Cameras);
+	builder.Add(animData.cameras);
+	builder.SetCategory(FootprintCategory::Lights);
+	builder.Add(animData.lights);
+	builder.SetCategory(FootprintCategory::SelfShadows);
+	builder.Add(animData.selfShadows);
+	builder.SetCategory(FootprintCategory::ShowIk);
+	builder.Add(animData.showIks);
+	builder.Add(animData.ikStates);
+	return footprint;
+}
+
+uint64_t mmd::size_in_bytes(const pmx::ModelData &mdlData) { return get_memory_footprint(mdlData).GetCapacityBytes(); }
+uint64_t mmd::size_in_bytes(const vmd::AnimationData &animData) { return get_memory_footprint(animData).GetCapacityBytes(); }
+
+void mmd::shrink_to_fit(pmx::ModelData &mdlData)
+{
+	mdlData.characterName.shrink_to_fit();
+	mdlData.comment.shrink_to_fit();
+	shrink(mdlData.vertices);
+	shrink(mdlData.faces);
+	shrink(mdlData.textures);
+	shrink(mdlData.materials);
+	for(auto &mat : mdlData.materials) {
+		mat.name.shrink_to_fit();
+		mat.memo.shrink_to_fit();
+	}
+	shrink(mdlData.bones);
+	for(auto &bone : mdlData.bones) {
+		bone.nameJp.shrink_to_fit();
+		bone.name.shrink_to_fit();
+	}
+	shrink(mdlData.ikChains);
+	shrink(mdlData.ikLinks);
+	shrink(mdlData.morphs);
+	for(auto &morph : mdlData.morphs) {
+		morph->nameLocal.shrink_to_fit();
+		morph->nameGlobal.shrink_to_fit();
+	}
+	shrink(mdlData.displayFrames);
+	for(auto &frame : mdlData.displayFrames) {
+		frame.nameLocal.shrink_to_fit();
+		frame.nameGlobal.shrink_to_fit();
+	}
+	shrink(mdlData.displayFrameEntries);
+
+	auto &rigidBodies = mdlData.rigidBodies;
+	shrink(rigidBodies.namesLocal);
+	shrink(rigidBodies.namesGlobal);
+	shrink(rigidBodies.boneIndices);
+	shrink(rigidBodies.groups);
+	shrink(rigidBodies.noCollisionMasks);
+	shrink(rigidBodies.shapes);
+	shrink(rigidBodies.sizes);
+	shrink(rigidBodies.positions);
+	shrink(rigidBodies.rotations);
+	shrink(rigidBodies.masses);
+	shrink(rigidBodies.linearDampings);
+	shrink(rigidBodies.angularDampings);
+	shrink(rigidBodies.restitutions);
+	shrink(rigidBodies.frictions);
+	shrink(rigidBodies.physicsModes);
+	shrink(rigidBodies.orientations);
+	shrink(rigidBodies.boneOffsets);
+	shrink(rigidBodies.aabbMin);
+	shrink(rigidBodies.aabbMax);
+
+	auto &joints = mdlData.joints;
+	shrink(joints.namesLocal);
+	shrink(joints.namesGlobal);
+	shrink(joints.types);
+	shrink(joints.rigidBodyA);
+	shrink(joints.rigidBodyB);
+	shrink(joints.positions);
+	shrink(joints.rotations);
+	shrink(joints.positionMin);
+	shrink(joints.positionMax);
+	shrink(joints.rotationMin);
+	shrink(joints.rotationMax);
+	shrink(joints.springPositions);
+	shrink(joints.springRotations);
+	shrink(joints.orientations);
+
+	shrink(mdlData.softBodies);
+	for(auto &softBody : mdlData.softBodies) {
+		softBody.nameLocal.shrink_to_fit();
+		softBody.nameGlobal.shrink_to_fit();
+	}
+	shrink(mdlData.softBodyAnchors);
+	shrink(mdlData.softBodyPinnedVertices);
+}
+
+void mmd::shrink_to_fit(vmd::AnimationData &animData)
+{
+	animData.modelName.shrink_to_fit();
+	shrink(animData.keyframes);
+	shrink(animData.morphs);
+	shrink(animData.cameras);
+	shrink(animData.lights);
+	shrink(animData.selfShadows);
+	shrink(animData.showIks);
+	shrink(animData.ikStates);
+}
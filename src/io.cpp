@@ -0,0 +1,373 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_io.hpp"
+#include "util_mmd_trace.hpp"
+#include <fsys/filesystem.h>
+#include <fsys/ifile.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#ifdef _WIN32
+#include <filesystem>
+#include <fstream>
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::unique_ptr<mmd::MappedFile> mmd::MappedFile::Open(const std::string &path)
+{
+	std::unique_ptr<MappedFile> mappedFile {new MappedFile {}};
+#ifdef _WIN32
+	auto hFile = CreateFileW(std::filesystem::path {path}.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if(hFile == INVALID_HANDLE_VALUE)
+		return nullptr;
+	mappedFile->m_fileHandle = hFile;
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(hFile, &size))
+		return nullptr;
+	if(size.QuadPart == 0)
+		return mappedFile;
+	auto hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(hMapping == nullptr)
+		return nullptr;
+	mappedFile->m_mappingHandle = hMapping;
+	auto *data = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	if(data == nullptr)
+		return nullptr;
+	mappedFile->m_data = static_cast<const uint8_t *>(data);
+	mappedFile->m_size = static_cast<size_t>(size.QuadPart);
+#else
+	auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return nullptr;
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return nullptr;
+	}
+	if(st.st_size == 0) {
+		close(fd);
+		return mappedFile;
+	}
+	auto *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after the descriptor has been closed
+	close(fd);
+	if(data == MAP_FAILED)
+		return nullptr;
+	mappedFile->m_data = static_cast<const uint8_t *>(data);
+	mappedFile->m_size = st.st_size;
+#endif
+	return mappedFile;
+}
+
+void mmd::MappedFile::Advise(Advice advice) const
+{
+#ifndef _WIN32
+	if(!m_data)
+		return;
+	madvise(const_cast<uint8_t *>(m_data), m_size, (advice == Advice::Sequential) ? MADV_SEQUENTIAL : MADV_WILLNEED);
+#endif
+}
+
+mmd::MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if(m_data)
+		UnmapViewOfFile(m_data);
+	if(m_mappingHandle)
+		CloseHandle(m_mappingHandle);
+	if(m_fileHandle)
+		CloseHandle(m_fileHandle);
+#else
+	if(m_data)
+		munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+}
+
+size_t mmd::SpanFile::Read(void *data, size_t size)
+{
+	size = std::min(size, m_data.size() - m_offset);
+	if(size == 0)
+		return 0;
+	memcpy(data, m_data.data() + m_offset, size);
+	m_offset += size;
+	return size;
+}
+
+void mmd::SpanFile::Seek(size_t offset, ufile::Whence whence)
+{
+	switch(whence) {
+	case ufile::Whence::Set:
+		m_offset = offset;
+		break;
+	case ufile::Whence::Cur:
+		m_offset += offset;
+		break;
+	case ufile::Whence::End:
+		m_offset = m_data.size() + offset;
+		break;
+	}
+	m_offset = std::min(m_offset, m_data.size());
+}
+
+int32_t mmd::SpanFile::ReadChar()
+{
+	if(m_offset >= m_data.size())
+		return EOF;
+	return m_data[m_offset++];
+}
+
+bool mmd::read_file(const std::string &path, std::vector<uint8_t> &outData)
+{
+#ifdef _WIN32
+	std::ifstream f {std::filesystem::path {path}, std::ios::binary | std::ios::ate};
+	if(!f)
+		return false;
+	outData.resize(static_cast<size_t>(f.tellg()));
+	f.seekg(0);
+	return static_cast<bool>(f.read(reinterpret_cast<char *>(outData.data()), outData.size()));
+#else
+	auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	outData.resize(st.st_size);
+	size_t offset = 0;
+	while(offset < outData.size()) {
+		auto n = pread(fd, outData.data() + offset, outData.size() - offset, offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0) {
+			close(fd);
+			outData.clear();
+			return false;
+		}
+		// The file was truncated after fstat
+		if(n == 0)
+			break;
+		offset += n;
+	}
+	close(fd);
+	outData.resize(offset);
+	return true;
+#endif
+}
+
+namespace mmd {
+	// Owns the data of a file that has been read completely
+	class BufferFile : public SpanFile {
+	  public:
+		// Moving a vector keeps its buffer, so the span stays valid
+		BufferFile(std::vector<uint8_t> &&data) : SpanFile {data}, m_data {std::move(data)} {}
+	  private:
+		std::vector<uint8_t> m_data;
+	};
+
+	class MappedSpanFile : public SpanFile {
+	  public:
+		MappedSpanFile(std::unique_ptr<MappedFile> file) : SpanFile {file->GetData()}, m_file {std::move(file)} {}
+	  private:
+		std::unique_ptr<MappedFile> m_file;
+	};
+
+#ifndef _WIN32
+	// Buffered reads on a file descriptor
+	class DescriptorFile : public ufile::IFile {
+	  public:
+		DescriptorFile(int fd, size_t size) : m_fd {fd}, m_size {size} {}
+		virtual ~DescriptorFile() override { close(m_fd); }
+		virtual size_t Read(void *data, size_t size) override;
+		virtual size_t Write(const void *, size_t) override { return 0; }
+		virtual size_t Tell() override { return m_offset; }
+		virtual void Seek(size_t offset, ufile::Whence whence = ufile::Whence::Set) override;
+		virtual int32_t ReadChar() override;
+		virtual size_t GetSize() override { return m_size; }
+	  private:
+		bool Fill();
+		int m_fd;
+		size_t m_size;
+		size_t m_offset = 0;
+		// File range [m_bufferOffset, m_bufferOffset +m_bufferSize) is buffered
+		std::array<uint8_t, 64 * 1024> m_buffer;
+		size_t m_bufferOffset = 0;
+		size_t m_bufferSize = 0;
+	};
+#endif
+
+	class BufferedBackend : public IoBackend {
+	  public:
+		virtual std::unique_ptr<ufile::IFile> Open(const std::string &path) override
+		{
+			VFilePtr f = FileManager::OpenSystemFile(path.c_str(), "rb");
+			if(f == nullptr)
+				return nullptr;
+			return std::make_unique<fsys::File>(f);
+		}
+	};
+	class PreadBackend : public IoBackend {
+	  public:
+		virtual std::unique_ptr<ufile::IFile> Open(const std::string &path) override
+		{
+			UTIL_MMD_TRACE_SCOPE("io::read_file");
+			std::vector<uint8_t> data;
+			if(!read_file(path, data))
+				return nullptr;
+			return std::make_unique<BufferFile>(std::move(data));
+		}
+	};
+	class MmapBackend : public IoBackend {
+	  public:
+		virtual std::unique_ptr<ufile::IFile> Open(const std::string &path) override
+		{
+			auto file = MappedFile::Open(path);
+			if(!file)
+				return nullptr;
+			file->Advise(MappedFile::Advice::Sequential);
+			file->Advise(MappedFile::Advice::WillNeed);
+			return std::make_unique<MappedSpanFile>(std::move(file));
+		}
+	};
+	class ReadAheadBackend : public IoBackend {
+	  public:
+		virtual std::unique_ptr<ufile::IFile> Open(const std::string &path) override
+		{
+#ifdef _WIN32
+			return PreadBackend {}.Open(path);
+#else
+			auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if(fd == -1)
+				return nullptr;
+			struct stat st;
+			if(fstat(fd, &st) != 0) {
+				close(fd);
+				return nullptr;
+			}
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			return std::make_unique<DescriptorFile>(fd, st.st_size);
+#endif
+		}
+	};
+};
+
+#ifndef _WIN32
+bool mmd::DescriptorFile::Fill()
+{
+	m_bufferOffset = m_offset;
+	m_bufferSize = 0;
+	for(;;) {
+		auto n = pread(m_fd, m_buffer.data(), m_buffer.size(), m_offset);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		m_bufferSize = n;
+		return true;
+	}
+}
+
+size_t mmd::DescriptorFile::Read(void *data, size_t size)
+{
+	auto *dst = static_cast<uint8_t *>(data);
+	size_t numRead = 0;
+	while(numRead < size) {
+		if(m_offset < m_bufferOffset || m_offset >= m_bufferOffset + m_bufferSize) {
+			// Large reads bypass the buffer
+			if(size - numRead >= m_buffer.size()) {
+				auto n = pread(m_fd, dst + numRead, size - numRead, m_offset);
+				if(n < 0 && errno == EINTR)
+					continue;
+				if(n <= 0)
+					break;
+				numRead += n;
+				m_offset += n;
+				continue;
+			}
+			if(!Fill())
+				break;
+		}
+		auto available = m_bufferOffset + m_bufferSize - m_offset;
+		auto n = std::min(available, size - numRead);
+		memcpy(dst + numRead, m_buffer.data() + (m_offset - m_bufferOffset), n);
+		numRead += n;
+		m_offset += n;
+	}
+	return numRead;
+}
+
+void mmd::DescriptorFile::Seek(size_t offset, ufile::Whence whence)
+{
+	switch(whence) {
+	case ufile::Whence::Set:
+		m_offset = offset;
+		break;
+	case ufile::Whence::Cur:
+		m_offset += offset;
+		break;
+	case ufile::Whence::End:
+		m_offset = m_size + offset;
+		break;
+	}
+	m_offset = std::min(m_offset, m_size);
+}
+
+int32_t mmd::DescriptorFile::ReadChar()
+{
+	uint8_t c;
+	return (Read(&c, 1) == 1) ? c : EOF;
+}
+#endif
+
+std::string_view mmd::to_string(IoBackendType type)
+{
+	switch(type) {
+	case IoBackendType::Buffered:
+		return "buffered";
+	case IoBackendType::Pread:
+		return "pread";
+	case IoBackendType::Mmap:
+		return "mmap";
+	case IoBackendType::ReadAhead:
+		return "read_ahead";
+	default:
+		return "";
+	}
+}
+
+mmd::IoBackend &mmd::get_io_backend(IoBackendType type)
+{
+	static BufferedBackend bufferedBackend;
+	static PreadBackend preadBackend;
+	static MmapBackend mmapBackend;
+	static ReadAheadBackend readAheadBackend;
+	switch(type) {
+	case IoBackendType::Pread:
+		return preadBackend;
+	case IoBackendType::Mmap:
+		return mmapBackend;
+	case IoBackendType::ReadAhead:
+		return readAheadBackend;
+	default:
+		return bufferedBackend;
+	}
+}
+
+static std::atomic<mmd::IoBackend *> g_defaultIoBackend = nullptr;
+void mmd::set_default_io_backend(IoBackend *backend) { g_defaultIoBackend = backend; }
+mmd::IoBackend &mmd::get_default_io_backend()
+{
+	auto *backend = g_defaultIoBackend.load(std::memory_order_relaxed);
+	return backend ? *backend : get_io_backend(IoBackendType::Buffered);
+}
@@ -0,0 +1,39 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_KEY_CURSOR_HPP__
+#define __UTIL_MMD_KEY_CURSOR_HPP__
+
+#include <cinttypes>
+
+namespace mmd {
+	namespace vmd {
+		// Returns the index of the last key with a frame index <= frame, starting the search at the cursor.
+		// If frame lies before the first key, 0 is returned.
+		template<class TGetFrame>
+		inline uint32_t advance_cursor(uint32_t cursor, uint32_t numKeys, float frame, const TGetFrame &getFrame)
+		{
+			if(numKeys == 0)
+				return 0;
+			if(cursor >= numKeys || frame < static_cast<float>(getFrame(cursor))) {
+				// Seeking backwards
+				uint32_t first = 0;
+				uint32_t last = numKeys;
+				while(first < last) {
+					auto mid = first + (last - first) / 2;
+					if(static_cast<float>(getFrame(mid)) <= frame)
+						first = mid + 1;
+					else
+						last = mid;
+				}
+				return (first > 0) ? (first - 1) : 0;
+			}
+			while(cursor + 1 < numKeys && static_cast<float>(getFrame(cursor + 1)) <= frame)
+				++cursor;
+			return cursor;
+		}
+	};
+};
+
+#endif
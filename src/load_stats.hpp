@@ -0,0 +1,102 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_LOAD_STATS_INTERNAL_HPP__
+#define __UTIL_MMD_LOAD_STATS_INTERNAL_HPP__
+
+#include "util_mmd_stats.hpp"
+#include "util_mmd_trace.hpp"
+#include <sharedutils/util_ifile.hpp>
+#include <chrono>
+
+namespace mmd {
+	// Forwards all calls to another file and counts the reads
+	class CountingFile : public ufile::IFile {
+	  public:
+		CountingFile(ufile::IFile &f) : m_file {f} {}
+		virtual size_t Read(void *data, size_t size) override
+		{
+			++m_readCalls;
+			auto n = m_file.Read(data, size);
+			m_bytesRead += n;
+			return n;
+		}
+		virtual size_t Write(const void *data, size_t size) override { return m_file.Write(data, size); }
+		virtual size_t Tell() override { return m_file.Tell(); }
+		virtual void Seek(size_t offset, ufile::Whence whence = ufile::Whence::Set) override { m_file.Seek(offset, whence); }
+		virtual int32_t ReadChar() override
+		{
+			++m_readCalls;
+			++m_bytesRead;
+			return m_file.ReadChar();
+		}
+		virtual size_t GetSize() override { return m_file.GetSize(); }
+		uint64_t GetReadCalls() const { return m_readCalls; }
+		uint64_t GetBytesRead() const { return m_bytesRead; }
+	  private:
+		ufile::IFile &m_file;
+		uint64_t m_readCalls = 0;
+		uint64_t m_bytesRead = 0;
+	};
+
+	// Measures the time and file range of consecutive sections and reports them to the active tracer (if any).
+	// The total time is recorded on destruction. Does nothing if stats is nullptr and tracing is disabled.
+	class SectionTimer {
+	  public:
+		using Clock = std::chrono::steady_clock;
+		SectionTimer(ufile::IFile &f, LoadStats *stats) : m_file {f}, m_stats {stats}
+		{
+#ifndef UTIL_MMD_DISABLE_TRACING
+			m_tracer = trace::get_tracer();
+#endif
+			if(stats)
+				m_loadStart = Clock::now();
+		}
+		~SectionTimer() { Finish(); }
+		void Begin(LoadSection section)
+		{
+			if(!m_stats && !m_tracer)
+				return;
+			End();
+			m_section = section;
+			if(m_tracer)
+				m_tracer->BeginScope(to_string(section).data());
+			if(m_stats) {
+				m_sectionStart = Clock::now();
+				m_sectionOffset = m_file.Tell();
+			}
+		}
+		void End()
+		{
+			if(m_section == LoadSection::Count)
+				return;
+			if(m_tracer)
+				m_tracer->EndScope(to_string(m_section).data());
+			if(m_stats) {
+				auto &stats = m_stats->sections[static_cast<size_t>(m_section)];
+				stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - m_sectionStart).count();
+				auto offset = m_file.Tell();
+				stats.bytes += (offset > m_sectionOffset) ? (offset - m_sectionOffset) : 0;
+			}
+			m_section = LoadSection::Count;
+		}
+	  private:
+		// Ends the current section and records the total time
+		void Finish()
+		{
+			End();
+			if(m_stats)
+				m_stats->totalNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - m_loadStart).count();
+		}
+		ufile::IFile &m_file;
+		LoadStats *m_stats = nullptr;
+		trace::Tracer *m_tracer = nullptr;
+		LoadSection m_section = LoadSection::Count;
+		Clock::time_point m_loadStart;
+		Clock::time_point m_sectionStart;
+		size_t m_sectionOffset = 0;
+	};
+};
+
+#endif
@@ -3,6 +3,12 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "util_mmd.hpp"
+#include "util_mmd_encoding.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_stats.hpp"
+#include "util_mmd_trace.hpp"
+#include "load_stats.hpp"
+#include "util_mmd_footprint.hpp"
 #include <fsys/filesystem.h>
 #include <sharedutils/util_string.h>
 #include <sharedutils/util_ifile.hpp>
@@ -13,83 +19,175 @@
 #pragma comment(lib, "vfilesystem.lib")
 #pragma comment(lib, "mathutil.lib")
 
-#ifdef MMD_TEST
-#include <iostream>
-#pragma optimize("", off)
+// MMD_PARSE_CHECKED enables validation of all element counts, string lengths and indices against the file
+// size and the loaded data, and throws std::runtime_error for malformed files. Without it the parser trusts the file.
+#ifdef MMD_PARSE_CHECKED
+static constexpr bool PARSE_CHECKED = true;
+#else
+static constexpr bool PARSE_CHECKED = false;
 #endif
-#pragma optimize("", off)
 
 namespace mmd {
 	namespace pmx {
-		enum class TextEncoding : char { UTF16 = 0, UTF8 };
-
 		enum class WeightType : char { BDEF1 = 0, BDEF2 = 1, BDEF4 = 2, SDEF = 3, QDEF = 4 };
 
-		enum class IndexType : char { Byte = 1, Short = 2, Int = 4 };
-
-		enum class SoftBodyFlag : char { None = 0, BLink = 1, ClusterCreation = BLink << 1, LinkCrossing = ClusterCreation << 1 };
-		REGISTER_BASIC_BITWISE_OPERATORS(SoftBodyFlag);
-
-		static std::string read_text(ufile::IFile &f, TextEncoding encoding);
+		static void read_text(ufile::IFile &f, TextEncoding encoding, std::pmr::string &outText);
 		template<typename T0, typename T1, typename T2>
 		int32_t read_index(ufile::IFile &f, IndexType type);
 		static int32_t read_index(ufile::IFile &f, IndexType type);
 		static int32_t read_vertex_index(ufile::IFile &f, IndexType type);
+		static int32_t read_count(ufile::IFile &f, size_t minElementSize);
+		static void validate_model(const ModelData &mdlData);
+		static void skip_text(ufile::IFile &f);
+		static void skip_display_frames(ufile::IFile &f, IndexType boneIndexSize, IndexType morphIndexSize);
+		static void read_display_frames(ufile::IFile &f, const Header &header, ModelData &mdlData);
+		static void skip_rigid_bodies(ufile::IFile &f, IndexType boneIndexSize);
+		static void skip_joints(ufile::IFile &f, IndexType rigidBodyIndexSize);
+		static void read_rigid_bodies(ufile::IFile &f, TextEncoding encoding, IndexType boneIndexSize, RigidBodies &rigidBodies);
+		static void read_joints(ufile::IFile &f, TextEncoding encoding, IndexType rigidBodyIndexSize, Joints &joints);
+		static std::shared_ptr<ModelData> load_model(ufile::IFile &f, LoadFlags flags, LoadStats *stats, std::pmr::memory_resource *resource);
+
+#pragma pack(push, 1)
+		// Fields are misaligned, so they must only be read by value (plain arrays instead of std::array, whose operator[] returns a reference)
+		struct RigidBodyRecord {
+			uint8_t group;
+			uint16_t noCollisionMask;
+			RigidBodyShape shape;
+			float size[3];
+			float position[3];
+			float rotation[3];
+			float mass;
+			float linearDamping;
+			float angularDamping;
+			float restitution;
+			float friction;
+			PhysicsMode physicsMode;
+		};
+#pragma pack(pop)
+		static_assert(sizeof(RigidBodyRecord) == 61);
 	};
 };
 
+mmd::pmx::MorphPtr mmd::pmx::Morph::Create(const allocator_type &alloc) { return MorphPtr {allocator_type {alloc}.new_object<Morph>()}; }
+
+void mmd::pmx::MorphDeleter::operator()(Morph *morph) const
+{
+	// The allocator is copied, since the morph is destroyed before its memory is freed
+	Morph::allocator_type alloc {morph->nameLocal.get_allocator()};
+	alloc.delete_object(morph);
+}
+
 mmd::pmx::Morph::~Morph()
 {
 	if(!morphs)
 		return;
+	allocator_type alloc {nameLocal.get_allocator()};
+	auto free = [this, &alloc]<class T>() {
+		auto *elements = static_cast<T *>(morphs);
+		std::destroy_n(elements, count);
+		alloc.deallocate_object(elements, count);
+	};
 	switch(type) {
 	case MorphType::Group:
 	case MorphType::Flip:
-		delete[] static_cast<GroupMorph *>(morphs);
+		free.template operator()<GroupMorph>();
 		break;
 	case MorphType::Vertex:
-		delete[] static_cast<VertexMorph *>(morphs);
+		free.template operator()<VertexMorph>();
 		break;
 	case MorphType::Bone:
-		delete[] static_cast<BoneMorph *>(morphs);
+		free.template operator()<BoneMorph>();
 		break;
 	case MorphType::Uv:
 	case MorphType::Uva1:
 	case MorphType::Uva2:
 	case MorphType::Uva3:
 	case MorphType::Uva4:
-		delete[] static_cast<UvMorph *>(morphs);
+		free.template operator()<UvMorph>();
 		break;
 	case MorphType::Material:
-		delete[] static_cast<MaterialMorph *>(morphs);
+		free.template operator()<MaterialMorph>();
 		break;
 	case MorphType::Impulse:
-		delete[] static_cast<ImpulseMorph *>(morphs);
+		free.template operator()<ImpulseMorph>();
 		break;
 	}
 }
 
-std::string mmd::pmx::read_text(ufile::IFile &f, TextEncoding encoding)
+mmd::pmx::RigidBodies::RigidBodies(const allocator_type &alloc)
+	: namesLocal {alloc}, namesGlobal {alloc}, boneIndices {alloc}, groups {alloc}, noCollisionMasks {alloc}, shapes {alloc}, sizes {alloc}, positions {alloc}, rotations {alloc}, masses {alloc}, linearDampings {alloc},
+	  angularDampings {alloc}, restitutions {alloc}, frictions {alloc}, physicsModes {alloc}, orientations {alloc}, boneOffsets {alloc}, aabbMin {alloc}, aabbMax {alloc}
+{
+}
+mmd::pmx::Joints::Joints(const allocator_type &alloc)
+	: namesLocal {alloc}, namesGlobal {alloc}, types {alloc}, rigidBodyA {alloc}, rigidBodyB {alloc}, positions {alloc}, rotations {alloc}, positionMin {alloc}, positionMax {alloc}, rotationMin {alloc}, rotationMax {alloc},
+	  springPositions {alloc}, springRotations {alloc}, orientations {alloc}
+{
+}
+mmd::pmx::ModelData::ModelData(const allocator_type &alloc)
+	: characterName {alloc}, comment {alloc}, vertices {alloc}, faces {alloc}, textures {alloc}, materials {alloc}, bones {alloc}, ikChains {alloc}, ikLinks {alloc}, morphs {alloc}, displayFrames {alloc},
+	  displayFrameEntries {alloc}, rigidBodies {alloc}, joints {alloc}, softBodies {alloc}, softBodyAnchors {alloc}, softBodyPinnedVertices {alloc}
+{
+}
+mmd::vmd::AnimationData::AnimationData(const allocator_type &alloc)
+	: modelName {alloc}, keyframes {alloc}, morphs {alloc}, cameras {alloc}, lights {alloc}, selfShadows {alloc}, showIks {alloc}, ikStates {alloc}
 {
-	auto len = f.Read<int32_t>();
+}
+
+// Counter for the number of transcoded text bytes of the load on this thread, only set while load statistics are collected
+static thread_local uint64_t *g_transcodedBytes = nullptr;
+namespace mmd {
+	struct TranscodeCounterScope {
+		TranscodeCounterScope(LoadStats *stats) : m_prevCounter {g_transcodedBytes} { g_transcodedBytes = stats ? &stats->bytesTranscoded : nullptr; }
+		~TranscodeCounterScope() { g_transcodedBytes = m_prevCounter; }
+	  private:
+		uint64_t *m_prevCounter;
+	};
+};
+
+static size_t get_remaining_size(ufile::IFile &f)
+{
+	auto size = f.GetSize();
+	auto pos = f.Tell();
+	return (pos < size) ? (size - pos) : 0;
+}
+int32_t mmd::pmx::read_count(ufile::IFile &f, size_t minElementSize)
+{
+	auto count = f.Read<int32_t>();
+	if constexpr(PARSE_CHECKED) {
+		if(count < 0 || static_cast<uint64_t>(count) * minElementSize > get_remaining_size(f))
+			throw std::runtime_error("Invalid element count " + std::to_string(count) + " at offset " + std::to_string(f.Tell()));
+	}
+	return count;
+}
+
+void mmd::pmx::read_text(ufile::IFile &f, TextEncoding encoding, std::pmr::string &outText)
+{
+	auto len = read_count(f, 1);
 	switch(encoding) {
 	case TextEncoding::UTF8:
 		{
-			std::vector<int8_t> data(len);
-			f.Read(data.data(), len);
-			return std::string(data.begin(), data.end());
+			outText.resize(len);
+			f.Read(outText.data(), len);
+			return;
 		}
 	case TextEncoding::UTF16:
 		{
-			std::vector<uint16_t> data(len / 2 + ((len % 2) == 0 ? 0 : 1));
+			// Conversion buffers are reused, so that only the result is allocated from the model's resource
+			static thread_local std::vector<uint16_t> data;
+			static thread_local std::string utf8Data;
+			data.resize(len / 2 + ((len % 2) == 0 ? 0 : 1));
 			f.Read(data.data(), len);
+			if(g_transcodedBytes)
+				*g_transcodedBytes += len;
 
-			std::vector<int8_t> utf8Data;
+			utf8Data.clear();
 			utf8::utf16to8(data.begin(), data.end(), std::back_inserter(utf8Data));
-			return std::string(utf8Data.begin(), utf8Data.end());
+			outText.assign(utf8Data);
+			return;
 		}
 	}
-	return "";
+	outText.clear();
 }
 template<typename T0, typename T1, typename T2>
 int32_t mmd::pmx::read_index(ufile::IFile &f, IndexType type)
@@ -106,15 +204,242 @@ int32_t mmd::pmx::read_index(ufile::IFile &f, IndexType type)
 }
 int32_t mmd::pmx::read_index(ufile::IFile &f, IndexType type) { return read_index<int8_t, int16_t, int32_t>(f, type); }
 int32_t mmd::pmx::read_vertex_index(ufile::IFile &f, IndexType type) { return read_index<uint8_t, uint16_t, int32_t>(f, type); }
-std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
+void mmd::pmx::skip_text(ufile::IFile &f)
+{
+	auto len = read_count(f, 1);
+	f.Seek(f.Tell() + len);
+}
+void mmd::pmx::skip_display_frames(ufile::IFile &f, IndexType boneIndexSize, IndexType morphIndexSize)
+{
+	auto numDisplayFrames = read_count(f, 13);
+	for(auto i = decltype(numDisplayFrames) {0}; i < numDisplayFrames; ++i) {
+		skip_text(f);
+		skip_text(f);
+		f.Seek(f.Tell() + sizeof(int8_t)); // Special flag
+		auto numFrames = read_count(f, 2);
+		for(auto j = decltype(numFrames) {0}; j < numFrames; ++j) {
+			auto type = f.Read<DisplayFrameTargetType>();
+			f.Seek(f.Tell() + umath::to_integral((type == DisplayFrameTargetType::Bone) ? boneIndexSize : morphIndexSize));
+		}
+	}
+}
+void mmd::pmx::read_display_frames(ufile::IFile &f, const Header &header, ModelData &mdlData)
+{
+	auto numDisplayFrames = read_count(f, 13);
+	mdlData.displayFrames.reserve(numDisplayFrames);
+	for(auto i = decltype(numDisplayFrames) {0}; i < numDisplayFrames; ++i) {
+		auto &frame = mdlData.displayFrames.emplace_back();
+		read_text(f, header.textEncoding, frame.nameLocal);
+		read_text(f, header.textEncoding, frame.nameGlobal);
+		frame.special = (f.Read<int8_t>() != 0);
+		auto numFrames = read_count(f, 2);
+		frame.entryOffset = mdlData.displayFrameEntries.size();
+		frame.entryCount = numFrames;
+		for(auto j = decltype(numFrames) {0}; j < numFrames; ++j) {
+			auto &entry = mdlData.displayFrameEntries.emplace_back();
+			entry.type = f.Read<DisplayFrameTargetType>();
+			entry.index = read_index(f, (entry.type == DisplayFrameTargetType::Bone) ? header.boneIndexSize : header.morphIndexSize);
+		}
+	}
+}
+bool mmd::pmx::load_display_frames(ufile::IFile &f, ModelData &mdlData)
+{
+	UTIL_MMD_TRACE_SCOPE("pmx::load_display_frames");
+	if(mdlData.displayFrameSectionOffset == 0)
+		return false;
+	mdlData.displayFrames.clear();
+	mdlData.displayFrameEntries.clear();
+	f.Seek(mdlData.displayFrameSectionOffset);
+	read_display_frames(f, mdlData.header, mdlData);
+	return true;
+}
+void mmd::pmx::skip_rigid_bodies(ufile::IFile &f, IndexType boneIndexSize)
+{
+	auto numRigidBodies = read_count(f, 70);
+	for(auto i = decltype(numRigidBodies) {0}; i < numRigidBodies; ++i) {
+		skip_text(f);
+		skip_text(f);
+		f.Seek(f.Tell() + umath::to_integral(boneIndexSize) + sizeof(RigidBodyRecord));
+	}
+}
+void mmd::pmx::skip_joints(ufile::IFile &f, IndexType rigidBodyIndexSize)
+{
+	// Type, position, rotation, position limits, rotation limits, spring constants
+	constexpr auto recordSize = sizeof(JointType) + sizeof(float) * 3 * 8;
+	auto numJoints = read_count(f, 107);
+	for(auto i = decltype(numJoints) {0}; i < numJoints; ++i) {
+		skip_text(f);
+		skip_text(f);
+		f.Seek(f.Tell() + umath::to_integral(rigidBodyIndexSize) * 2 + recordSize);
+	}
+}
+void mmd::pmx::read_rigid_bodies(ufile::IFile &f, TextEncoding encoding, IndexType boneIndexSize, RigidBodies &rigidBodies)
+{
+	auto numRigidBodies = read_count(f, 70);
+	auto reserve = [numRigidBodies](auto &v) { v.reserve(numRigidBodies); };
+	reserve(rigidBodies.namesLocal);
+	reserve(rigidBodies.namesGlobal);
+	reserve(rigidBodies.boneIndices);
+	reserve(rigidBodies.groups);
+	reserve(rigidBodies.noCollisionMasks);
+	reserve(rigidBodies.shapes);
+	reserve(rigidBodies.sizes);
+	reserve(rigidBodies.positions);
+	reserve(rigidBodies.rotations);
+	reserve(rigidBodies.masses);
+	reserve(rigidBodies.linearDampings);
+	reserve(rigidBodies.angularDampings);
+	reserve(rigidBodies.restitutions);
+	reserve(rigidBodies.frictions);
+	reserve(rigidBodies.physicsModes);
+	for(auto i = decltype(numRigidBodies) {0}; i < numRigidBodies; ++i) {
+		read_text(f, encoding, rigidBodies.namesLocal.emplace_back());
+		read_text(f, encoding, rigidBodies.namesGlobal.emplace_back());
+		rigidBodies.boneIndices.push_back(read_index(f, boneIndexSize));
+		auto record = f.Read<RigidBodyRecord>();
+		rigidBodies.groups.push_back(uint8_t {record.group});
+		rigidBodies.noCollisionMasks.push_back(uint16_t {record.noCollisionMask});
+		rigidBodies.shapes.push_back(RigidBodyShape {record.shape});
+		rigidBodies.sizes.push_back(Vector3 {record.size[0], record.size[1], record.size[2]});
+		rigidBodies.positions.push_back(Vector3 {record.position[0], record.position[1], record.position[2]});
+		rigidBodies.rotations.push_back(Vector3 {record.rotation[0], record.rotation[1], record.rotation[2]});
+		rigidBodies.masses.push_back(float {record.mass});
+		rigidBodies.linearDampings.push_back(float {record.linearDamping});
+		rigidBodies.angularDampings.push_back(float {record.angularDamping});
+		rigidBodies.restitutions.push_back(float {record.restitution});
+		rigidBodies.frictions.push_back(float {record.friction});
+		rigidBodies.physicsModes.push_back(PhysicsMode {record.physicsMode});
+	}
+}
+void mmd::pmx::read_joints(ufile::IFile &f, TextEncoding encoding, IndexType rigidBodyIndexSize, Joints &joints)
+{
+	auto numJoints = read_count(f, 107);
+	auto reserve = [numJoints](auto &v) { v.reserve(numJoints); };
+	reserve(joints.namesLocal);
+	reserve(joints.namesGlobal);
+	reserve(joints.types);
+	reserve(joints.rigidBodyA);
+	reserve(joints.rigidBodyB);
+	reserve(joints.positions);
+	reserve(joints.rotations);
+	reserve(joints.positionMin);
+	reserve(joints.positionMax);
+	reserve(joints.rotationMin);
+	reserve(joints.rotationMax);
+	reserve(joints.springPositions);
+	reserve(joints.springRotations);
+	for(auto i = decltype(numJoints) {0}; i < numJoints; ++i) {
+		read_text(f, encoding, joints.namesLocal.emplace_back());
+		read_text(f, encoding, joints.namesGlobal.emplace_back());
+		joints.types.push_back(f.Read<JointType>());
+		joints.rigidBodyA.push_back(read_index(f, rigidBodyIndexSize));
+		joints.rigidBodyB.push_back(read_index(f, rigidBodyIndexSize));
+		auto values = f.Read<std::array<Vector3, 8>>();
+		joints.positions.push_back(values[0]);
+		joints.rotations.push_back(values[1]);
+		joints.positionMin.push_back(values[2]);
+		joints.positionMax.push_back(values[3]);
+		joints.rotationMin.push_back(values[4]);
+		joints.rotationMax.push_back(values[5]);
+		joints.springPositions.push_back(values[6]);
+		joints.springRotations.push_back(values[7]);
+	}
+}
+void mmd::pmx::validate_model(const ModelData &mdlData)
+{
+	auto checkIndex = [](int64_t index, size_t count, bool optional, const char *what) {
+		if((optional && index == -1) || (index >= 0 && static_cast<uint64_t>(index) < count))
+			return;
+		throw std::runtime_error(std::string {"Invalid "} + what + " index " + std::to_string(index));
+	};
+	auto numVertices = mdlData.vertices.size();
+	auto numBones = mdlData.bones.size();
+	for(auto &v : mdlData.vertices) {
+		for(size_t i = 0; i < v.boneIds.size(); ++i) {
+			if(v.boneWeights[i] != 0.f)
+				checkIndex(v.boneIds[i], numBones, true, "vertex bone");
+		}
+	}
+	for(auto idx : mdlData.faces)
+		checkIndex(idx, numVertices, false, "face vertex");
+	if(mdlData.faces.size() % 3 != 0)
+		throw std::runtime_error("Face index count is not a multiple of 3");
+
+	uint64_t materialFaceCount = 0;
+	for(auto &mat : mdlData.materials) {
+		checkIndex(mat.textureIndex, mdlData.textures.size(), true, "material texture");
+		checkIndex(mat.sphereIndex, mdlData.textures.size(), true, "material sphere texture");
+		if(mat.faceCount < 0)
+			throw std::runtime_error("Invalid material face count " + std::to_string(mat.faceCount));
+		materialFaceCount += mat.faceCount;
+	}
+	if(materialFaceCount > mdlData.faces.size())
+		throw std::runtime_error("Material face counts exceed the number of faces");
+
+	for(auto &bone : mdlData.bones) {
+		checkIndex(bone.parentBoneIdx, numBones, true, "parent bone");
+		checkIndex(bone.inheritBoneIdx, numBones, true, "inherit parent bone");
+	}
+	for(auto &chain : mdlData.ikChains)
+		checkIndex(chain.targetBoneIndex, numBones, false, "IK target bone");
+	for(auto &link : mdlData.ikLinks)
+		checkIndex(link.boneIndex, numBones, false, "IK link bone");
+	for(auto &morph : mdlData.morphs) {
+		if(morph->type != MorphType::Vertex)
+			continue;
+		auto *vertexMorphs = static_cast<const VertexMorph *>(morph->morphs);
+		for(int32_t i = 0; i < morph->count; ++i)
+			checkIndex(vertexMorphs[i].index, numVertices, false, "vertex morph");
+	}
+	for(auto idx : mdlData.rigidBodies.boneIndices)
+		checkIndex(idx, numBones, true, "rigid body bone");
+	auto numRigidBodies = mdlData.rigidBodies.size();
+	for(size_t i = 0; i < mdlData.joints.size(); ++i) {
+		checkIndex(mdlData.joints.rigidBodyA[i], numRigidBodies, true, "joint rigid body");
+		checkIndex(mdlData.joints.rigidBodyB[i], numRigidBodies, true, "joint rigid body");
+	}
+}
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f, LoadFlags flags, LoadStats *stats, std::pmr::memory_resource *resource)
+{
+	UTIL_MMD_TRACE_SCOPE("pmx::load");
+	if(!stats) {
+		auto mdlData = load_model(f, flags, nullptr, resource);
+		if constexpr(PARSE_CHECKED) {
+			if(mdlData)
+				validate_model(*mdlData);
+		}
+		return mdlData;
+	}
+	*stats = {};
+	CountingFile countingFile {f};
+	TranscodeCounterScope transcodeCounter {stats};
+	auto mdlData = load_model(countingFile, flags, stats, resource);
+	if constexpr(PARSE_CHECKED) {
+		if(mdlData)
+			validate_model(*mdlData);
+	}
+	stats->readCalls = countingFile.GetReadCalls();
+	stats->bytesRead = countingFile.GetBytesRead();
+	if(mdlData) {
+		auto footprint = get_memory_footprint(*mdlData);
+		stats->allocationCount = footprint.GetAllocationCount();
+		stats->memoryFootprint = footprint.GetCapacityBytes();
+	}
+	return mdlData;
+}
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load_model(ufile::IFile &f, LoadFlags flags, LoadStats *stats, std::pmr::memory_resource *resource)
 {
+	SectionTimer timer {f, stats};
+	timer.Begin(LoadSection::Header);
 	auto signature = f.Read<std::array<char, 4>>();
 	// Note: The fourth character in the header for the model https://bowlroll.net/file/306256 is '@' instead of a space,
 	// but the format seems to be exactly the same other than that.
 	if(signature.at(0) != 'P' || signature.at(1) != 'M' || signature.at(2) != 'X' || (signature.at(3) != ' ' && signature.at(3) != '@'))
 		return nullptr;
 	auto version = f.Read<float>();
-	if(version != 2.f)
+	if(version != 2.f && version != 2.1f)
 		return nullptr;
 	auto len = f.Read<char>();
 	auto textEncoding = f.Read<TextEncoding>();
@@ -126,23 +451,26 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 	auto morphIndexSize = f.Read<IndexType>();
 	auto rigidBodyIndexSize = f.Read<IndexType>();
 
-	auto mdlData = std::make_shared<ModelData>();
+	// The control block of the shared pointer is allocated from the resource as well
+	auto mdlData = std::allocate_shared<ModelData>(std::pmr::polymorphic_allocator<ModelData> {resource ? resource : std::pmr::get_default_resource()});
 	mdlData->version = version;
-	auto characterName = read_text(f, textEncoding);
-	mdlData->characterName = read_text(f, textEncoding);
-	auto comment = read_text(f, textEncoding);
-	mdlData->comment = read_text(f, textEncoding);
-
-	auto vertexCount = f.Read<int32_t>();
+	mdlData->header = {textEncoding, static_cast<uint8_t>(appendixDataCount), vertexIndexSize, textureIndexSize, materialIndexSize, boneIndexSize, morphIndexSize, rigidBodyIndexSize};
+	timer.Begin(LoadSection::Text);
+	skip_text(f);
+	read_text(f, textEncoding, mdlData->characterName);
+	skip_text(f);
+	read_text(f, textEncoding, mdlData->comment);
+
+	timer.Begin(LoadSection::Vertices);
+	auto vertexCount = read_count(f, 38);
 	mdlData->vertices.reserve(vertexCount);
 	for(auto i = decltype(vertexCount) {0}; i < vertexCount; ++i) {
-		mdlData->vertices.push_back({});
-		auto &v = mdlData->vertices.back();
+		auto &v = mdlData->vertices.emplace_back();
 		v.position = f.Read<std::array<float, 3>>();
 		v.normal = f.Read<std::array<float, 3>>();
 		v.uv = f.Read<std::array<float, 2>>();
-		std::vector<Vector4> appendixData(appendixDataCount);
-		f.Read(appendixData.data(), appendixData.size() * sizeof(appendixData.front()));
+		// Additional UVs are not kept
+		f.Seek(f.Tell() + appendixDataCount * sizeof(Vector4));
 		auto weightType = f.Read<WeightType>();
 		switch(weightType) {
 		case WeightType::BDEF1:
@@ -187,27 +515,28 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 		auto edgeScale = f.Read<float>();
 	}
 
-	auto numFaces = f.Read<int32_t>();
+	timer.Begin(LoadSection::Faces);
+	auto numFaces = read_count(f, umath::to_integral(vertexIndexSize));
 	mdlData->faces.reserve(numFaces);
 	for(auto i = decltype(numFaces) {0}; i < numFaces; ++i) {
 		auto vertIdx = read_vertex_index(f, vertexIndexSize);
 		mdlData->faces.push_back(vertIdx);
 	}
 
-	auto numTextures = f.Read<int32_t>();
+	timer.Begin(LoadSection::Textures);
+	auto numTextures = read_count(f, 4);
 	mdlData->textures.reserve(numTextures);
 	for(auto i = decltype(numTextures) {0}; i < numTextures; ++i) {
-		auto fileName = read_text(f, textEncoding);
-		mdlData->textures.push_back(fileName);
+		read_text(f, textEncoding, mdlData->textures.emplace_back());
 	}
 
-	auto numMaterials = f.Read<int32_t>();
+	timer.Begin(LoadSection::Materials);
+	auto numMaterials = read_count(f, 86);
 	mdlData->materials.reserve(numMaterials);
 	for(auto i = decltype(numMaterials) {0}; i < numMaterials; ++i) {
-		mdlData->materials.push_back({});
-		auto &mat = mdlData->materials.back();
-		auto name = read_text(f, textEncoding);
-		mat.name = read_text(f, textEncoding);
+		auto &mat = mdlData->materials.emplace_back();
+		skip_text(f);
+		read_text(f, textEncoding, mat.name);
 		mat.diffuseColor = f.Read<std::array<float, 4>>();
 		mat.specularColor = f.Read<std::array<float, 3>>();
 		mat.specularity = f.Read<float>();
@@ -220,17 +549,17 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 		mat.sphereMode = f.Read<char>();
 		mat.toonFlag = f.Read<char>();
 		mat.toonIndex = (mat.toonFlag == 0) ? read_index(f, textureIndexSize) : f.Read<int8_t>();
-		mat.memo = read_text(f, textEncoding);
+		read_text(f, textEncoding, mat.memo);
 		mat.faceCount = f.Read<int32_t>();
 	}
 
-	auto numBones = f.Read<int32_t>();
+	timer.Begin(LoadSection::Bones);
+	auto numBones = read_count(f, 28);
 	mdlData->bones.reserve(numBones);
 	for(auto i = decltype(numBones) {0}; i < numBones; ++i) {
-		mdlData->bones.push_back({});
-		auto &bone = mdlData->bones.back();
-		bone.nameJp = read_text(f, textEncoding);
-		bone.name = read_text(f, textEncoding);
+		auto &bone = mdlData->bones.emplace_back();
+		read_text(f, textEncoding, bone.nameJp);
+		read_text(f, textEncoding, bone.name);
 		bone.position = f.Read<Vector3>();
 		bone.parentBoneIdx = read_index(f, boneIndexSize);
 		bone.layer = f.Read<int32_t>();
@@ -242,8 +571,8 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 			auto tailPos = f.Read<std::array<float, 3>>();
 		}
 		if((bone.flags & (BoneFlag::InheritRotation | BoneFlag::InheritTranslation)) != BoneFlag::None) {
-			auto parentIndex = read_index(f, boneIndexSize);
-			auto parentInfluence = f.Read<float>();
+			bone.inheritBoneIdx = read_index(f, boneIndexSize);
+			bone.inheritInfluence = f.Read<float>();
 		}
 		if((bone.flags & BoneFlag::FixedAxis) != BoneFlag::None) {
 			auto axisDirection = f.Read<std::array<float, 3>>();
@@ -264,35 +593,43 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 			auto parentIndex = read_index(f, boneIndexSize);
 		}
 		if((bone.flags & BoneFlag::IK) != BoneFlag::None) {
-			auto targetIndex = read_index(f, boneIndexSize);
-			auto loopCount = f.Read<int32_t>();
-			auto limitRadian = f.Read<float>();
-			auto linkCount = f.Read<int32_t>();
+			bone.ikChainIndex = mdlData->ikChains.size();
+			auto &chain = mdlData->ikChains.emplace_back();
+			chain.boneIndex = i;
+			chain.targetBoneIndex = read_index(f, boneIndexSize);
+			chain.loopCount = f.Read<int32_t>();
+			chain.limitAngle = f.Read<float>();
+			auto linkCount = read_count(f, 2);
+			chain.linkOffset = mdlData->ikLinks.size();
+			chain.linkCount = linkCount;
 			for(auto i = decltype(linkCount) {0}; i < linkCount; ++i) {
-				auto boneIndex = read_index(f, boneIndexSize);
-				auto hasLimits = f.Read<int8_t>();
-				if(hasLimits == 1) {
-					auto min = f.Read<std::array<float, 3>>();
-					auto max = f.Read<std::array<float, 3>>();
+				auto &link = mdlData->ikLinks.emplace_back();
+				link.boneIndex = read_index(f, boneIndexSize);
+				link.hasLimits = (f.Read<int8_t>() == 1);
+				if(link.hasLimits) {
+					link.minAngle = f.Read<std::array<float, 3>>();
+					link.maxAngle = f.Read<std::array<float, 3>>();
 				}
 			}
 		}
 	}
 
-	auto numMorphs = f.Read<int32_t>();
+	timer.Begin(LoadSection::Morphs);
+	auto numMorphs = read_count(f, 14);
+	mdlData->morphs.reserve(numMorphs);
 	for(auto i = decltype(numMorphs) {0}; i < numMorphs; ++i) {
-		auto morph = std::make_unique<Morph>();
-		morph->nameLocal = read_text(f, textEncoding);
-		morph->nameGlobal = read_text(f, textEncoding);
+		auto morph = Morph::Create(mdlData->morphs.get_allocator());
+		read_text(f, textEncoding, morph->nameLocal);
+		read_text(f, textEncoding, morph->nameGlobal);
 		morph->panelType = f.Read<int8_t>();
 		morph->type = f.Read<MorphType>();
-		morph->count = f.Read<int32_t>();
-		morph->morphs = nullptr;
-		auto initMorphs = [&morph, &f]<class T>(IndexType indexType) {
-			morph->morphs = new T[morph->count];
-			for(auto i = decltype(morph->count) {0u}; i < morph->count; ++i) {
-				auto &m = static_cast<T *>(morph->morphs)[i];
-				m.index = read_vertex_index(f, indexType);
+		auto count = read_count(f, 5);
+		// Vertex indices are unsigned, all other indices are signed (e.g. -1 targets all materials in material morphs)
+		auto initMorphs = [&morph, &f, count]<class T>(IndexType indexType, bool isVertexIndex = false) {
+			auto *elements = morph->template AllocateMorphs<T>(count);
+			for(auto i = decltype(count) {0u}; i < count; ++i) {
+				auto &m = elements[i];
+				m.index = isVertexIndex ? read_vertex_index(f, indexType) : read_index(f, indexType);
 				auto *ptr = reinterpret_cast<uint8_t *>(&m.index) + sizeof(m.index);
 				f.Read(ptr, sizeof(T) - sizeof(m.index));
 			}
@@ -306,7 +643,7 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 			}
 		case MorphType::Vertex:
 			{
-				initMorphs.template operator()<VertexMorph>(vertexIndexSize);
+				initMorphs.template operator()<VertexMorph>(vertexIndexSize, true);
 				break;
 			}
 		case MorphType::Bone:
@@ -320,7 +657,7 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 		case MorphType::Uva3:
 		case MorphType::Uva4:
 			{
-				initMorphs.template operator()<UvMorph>(vertexIndexSize);
+				initMorphs.template operator()<UvMorph>(vertexIndexSize, true);
 				break;
 			}
 		case MorphType::Material:
@@ -333,143 +670,172 @@ std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(ufile::IFile &f)
 				initMorphs.template operator()<ImpulseMorph>(rigidBodyIndexSize);
 				break;
 			}
+		default:
+			throw std::runtime_error("Invalid morph type: " + std::to_string(umath::to_integral(morph->type)));
 		}
 		mdlData->morphs.push_back(std::move(morph));
 	}
-	/*
-	auto numDisplayFrames = f.Read<int32_t>();
-	for(auto i=decltype(numDisplayFrames){0};i<numDisplayFrames;++i)
-	{
-		auto nameLocal = read_text(f,textEncoding);
-		auto nameGlobal = read_text(f,textEncoding);
-		auto specialFlag = f.Read<int8_t>();
-		auto numFrames = f.Read<int32_t>();
-		for(auto i=decltype(numFrames){0};i<numFrames;++i)
-			;
-	}
-
-	auto numRigidBodies = f.Read<int32_t>();
-	for(auto i=decltype(numRigidBodies){0};i<numRigidBodies;++i)
-	{
-		auto nameLocal = read_text(f,textEncoding);
-		auto nameGlobal = read_text(f,textEncoding);
-		auto relatedBoneIndex = read_index(f,boneIndexSize);
-		auto groupId = f.Read<int8_t>();
-		auto nonCollisionGroup = f.Read<int16_t>();
-		auto shapeType = f.Read<int8_t>();
-		auto shapeSize = f.Read<std::array<float,3>>();
-		auto shapePos = f.Read<std::array<float,3>>();
-		auto shapeRot = f.Read<std::array<float,3>>();
-		auto mass = f.Read<float>();
-		auto moveAttenuation = f.Read<float>();
-		auto rotDamping = f.Read<float>();
-		auto repulsion = f.Read<float>();
-		auto frictionForce = f.Read<float>();
-		auto physicsMode = f.Read<int8_t>();
-
-	}
-
-	auto numJoints = f.Read<int32_t>();
-	for(auto i=decltype(numJoints){0};i<numJoints;++i)
-	{
-		auto nameLocal = read_text(f,textEncoding);
-		auto nameGlobal = read_text(f,textEncoding);
-		auto jointType = f.Read<int8_t>();
-		auto rigidBodyIndexA = read_index(f,rigidBodyIndexSize);
-		auto rigidBodyIndexB = read_index(f,rigidBodyIndexSize);
-		auto pos = f.Read<std::array<float,3>>();
-		auto rot = f.Read<std::array<float,3>>();
-		auto minPos = f.Read<std::array<float,3>>();
-		auto maxPos = f.Read<std::array<float,3>>();
-		auto rotMin = f.Read<std::array<float,3>>();
-		auto rotMax = f.Read<std::array<float,3>>();
-		auto posSpring = f.Read<std::array<float,3>>();
-		auto rotSpring = f.Read<std::array<float,3>>();
-
-	}
-
-	if(version >= 2.1f)
-	{
-		auto numSoftBodies = f.Read<int32_t>();
-		for(auto i=decltype(numSoftBodies){0};i<numSoftBodies;++i)
-		{
-			auto nameLocal = read_text(f,textEncoding);
-			auto nameGlobal = read_text(f,textEncoding);
-			auto shapeType = f.Read<int8_t>();
-			auto matIdx = read_index(f,materialIndexSize);
-			auto groupId = f.Read<int32_t>();
-			auto noCollisionMask = f.Read<int16_t>();
-			auto flags = f.Read<SoftBodyFlag>();
-			auto bLinkCreateDistance = f.Read<int32_t>();
-			auto numberOfClusters = f.Read<int32_t>();
-			auto totalMass = f.Read<float>();
-			auto collisionMargin = f.Read<float>();
-			auto aerodynamicsModel = f.Read<int32_t>();
-			auto configVCF = f.Read<float>();
-			auto configDP = f.Read<float>();
-			auto configDG = f.Read<float>();
-			auto configLF = f.Read<float>();
-			auto configPR = f.Read<float>();
-			auto configVC = f.Read<float>();
-			auto configDF = f.Read<float>();
-			auto configMT = f.Read<float>();
-			auto configCHR = f.Read<float>();
-			auto configKHR = f.Read<float>();
-			auto configSHR = f.Read<float>();
-			auto configAHR = f.Read<float>();
-			auto srhrCl = f.Read<float>();
-			auto skhrCl = f.Read<float>();
-			auto sshrCl = f.Read<float>();
-			auto srSpltCl = f.Read<float>();
-			auto skSpltCl = f.Read<float>();
-			auto ssSpltCl = f.Read<float>();
-			auto vIt = f.Read<int32_t>();
-			auto pIt = f.Read<int32_t>();
-			auto dIt = f.Read<int32_t>();
-			auto cIt = f.Read<int32_t>();
-			auto lst = f.Read<int32_t>();
-			auto ast = f.Read<int32_t>();
-			auto vst = f.Read<int32_t>();
-			auto anchorRigidBodyCount = f.Read<int32_t>();
-			// TODO
-			auto vertexPinCount = f.Read<int32_t>();
-			// TODO
+
+	// Display frames are only needed by editors. If they're not requested, only their offset is recorded
+	// so that they can be loaded later with load_display_frames.
+	mdlData->displayFrameSectionOffset = f.Tell();
+	timer.Begin(LoadSection::DisplayFrames);
+	auto needsPhysics = (flags & (LoadFlags::Physics | LoadFlags::SoftBodies)) != LoadFlags::None;
+	if((flags & LoadFlags::DisplayFrames) != LoadFlags::None)
+		read_display_frames(f, mdlData->header, *mdlData);
+	else if(needsPhysics)
+		skip_display_frames(f, boneIndexSize, morphIndexSize);
+	else
+		return mdlData;
+
+	if((flags & LoadFlags::Physics) == LoadFlags::None) {
+		if((flags & LoadFlags::SoftBodies) == LoadFlags::None || version < 2.1f)
+			return mdlData;
+		timer.Begin(LoadSection::RigidBodies);
+		skip_rigid_bodies(f, boneIndexSize);
+		timer.Begin(LoadSection::Joints);
+		skip_joints(f, rigidBodyIndexSize);
+	}
+	else {
+		timer.Begin(LoadSection::RigidBodies);
+		read_rigid_bodies(f, textEncoding, boneIndexSize, mdlData->rigidBodies);
+		timer.Begin(LoadSection::Joints);
+		read_joints(f, textEncoding, rigidBodyIndexSize, mdlData->joints);
+		compute_rigid_body_transforms(*mdlData);
+	}
+
+	if(version >= 2.1f && (flags & LoadFlags::SoftBodies) != LoadFlags::None) {
+		timer.Begin(LoadSection::SoftBodies);
+		auto numSoftBodies = read_count(f, 142);
+		mdlData->softBodies.reserve(numSoftBodies);
+		for(auto i = decltype(numSoftBodies) {0}; i < numSoftBodies; ++i) {
+			auto &softBody = mdlData->softBodies.emplace_back();
+			read_text(f, textEncoding, softBody.nameLocal);
+			read_text(f, textEncoding, softBody.nameGlobal);
+			softBody.shape = f.Read<SoftBodyShape>();
+			softBody.materialIndex = read_index(f, materialIndexSize);
+			softBody.group = f.Read<uint8_t>();
+			softBody.noCollisionMask = f.Read<uint16_t>();
+			softBody.flags = f.Read<SoftBodyFlag>();
+			softBody.bLinkDistance = f.Read<int32_t>();
+			softBody.clusterCount = f.Read<int32_t>();
+			softBody.totalMass = f.Read<float>();
+			softBody.collisionMargin = f.Read<float>();
+			softBody.aeroModel = f.Read<SoftBodyAeroModel>();
+			softBody.config = f.Read<SoftBodyConfig>();
+			softBody.cluster = f.Read<SoftBodyClusterConfig>();
+			softBody.iterations = f.Read<SoftBodyIterations>();
+			softBody.material = f.Read<SoftBodyMaterial>();
+
+			auto numAnchors = read_count(f, 3);
+			softBody.anchorOffset = mdlData->softBodyAnchors.size();
+			softBody.anchorCount = numAnchors;
+			for(auto j = decltype(numAnchors) {0}; j < numAnchors; ++j) {
+				auto &anchor = mdlData->softBodyAnchors.emplace_back();
+				anchor.rigidBodyIndex = read_index(f, rigidBodyIndexSize);
+				anchor.vertexIndex = read_vertex_index(f, vertexIndexSize);
+				anchor.nearMode = (f.Read<uint8_t>() != 0);
+			}
+
+			auto numPinnedVertices = read_count(f, 1);
+			softBody.pinnedVertexOffset = mdlData->softBodyPinnedVertices.size();
+			softBody.pinnedVertexCount = numPinnedVertices;
+			for(auto j = decltype(numPinnedVertices) {0}; j < numPinnedVertices; ++j)
+				mdlData->softBodyPinnedVertices.push_back(read_vertex_index(f, vertexIndexSize));
 		}
-	}*/
+	}
 
 	return mdlData;
 }
 
-std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(const std::string &path)
+mmd::pmx::NameIndexMap::NameIndexMap(const ModelData &mdlData)
+{
+	m_bones.reserve(mdlData.bones.size());
+	for(auto i = decltype(mdlData.bones.size()) {0u}; i < mdlData.bones.size(); ++i)
+		m_bones.insert(std::make_pair(mdlData.bones[i].nameJp, static_cast<int32_t>(i)));
+	m_morphs.reserve(mdlData.morphs.size());
+	for(auto i = decltype(mdlData.morphs.size()) {0u}; i < mdlData.morphs.size(); ++i)
+		m_morphs.insert(std::make_pair(mdlData.morphs[i]->nameLocal, static_cast<int32_t>(i)));
+}
+int32_t mmd::pmx::NameIndexMap::FindBone(std::string_view name) const
 {
-	VFilePtr f = FileManager::OpenSystemFile(path.c_str(), "rb");
-	if(f == nullptr)
+	auto it = m_bones.find(name);
+	return (it != m_bones.end()) ? it->second : -1;
+}
+int32_t mmd::pmx::NameIndexMap::FindMorph(std::string_view name) const
+{
+	auto it = m_morphs.find(name);
+	return (it != m_morphs.end()) ? it->second : -1;
+}
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmx::load(const std::string &path, LoadFlags flags, LoadStats *stats, std::pmr::memory_resource *resource, IoBackend *io)
+{
+	auto f = (io ? *io : get_default_io_backend()).Open(path);
+	if(!f)
 		return nullptr;
-	fsys::File fp {f};
-	return load(fp);
+	return load(*f, flags, stats, resource);
 }
 
-std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::load(const std::string &path)
+std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::load(const std::string &path, LoadStats *stats, std::pmr::memory_resource *resource, IoBackend *io)
 {
-	VFilePtr f = FileManager::OpenSystemFile(path.c_str(), "rb");
-	if(f == nullptr)
+	auto f = (io ? *io : get_default_io_backend()).Open(path);
+	if(!f)
 		return nullptr;
-	fsys::File fp {f};
-	return load(fp);
+	return load(*f, stats, resource);
 }
 
+// Older VMD files end after any of the sections, so the presence of each section has to be determined
+// from the remaining file size.
+static bool read_section_count(ufile::IFile &f, size_t minRecordSize, uint32_t &outCount)
+{
+	if(get_remaining_size(f) < sizeof(uint32_t))
+		return false;
+	outCount = f.Read<uint32_t>();
+	return static_cast<uint64_t>(outCount) * minRecordSize <= get_remaining_size(f);
+}
 template<class T>
-std::vector<T> read_keyframe_data(ufile::IFile &f)
+static bool read_keyframe_data(ufile::IFile &f, std::pmr::vector<T> &outKeyframes)
 {
-	auto n = f.Read<uint32_t>();
-	std::vector<T> keyframes;
-	keyframes.resize(n);
-	f.Read(keyframes.data(), keyframes.size() * sizeof(keyframes.front()));
-	std::sort(keyframes.begin(), keyframes.end(), [](const T &a, const T &b) { return a.frameIndex < b.frameIndex; });
-	return keyframes;
+	uint32_t n;
+	if(!read_section_count(f, sizeof(T), n))
+		return false;
+	outKeyframes.resize(n);
+	f.Read(outKeyframes.data(), outKeyframes.size() * sizeof(outKeyframes.front()));
+	std::stable_sort(outKeyframes.begin(), outKeyframes.end(), [](const T &a, const T &b) { return a.frameIndex < b.frameIndex; });
+	return true;
 }
-std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::load(ufile::IFile &f)
+static bool read_show_ik_data(ufile::IFile &f, mmd::vmd::AnimationData &animData)
 {
+	constexpr auto minRecordSize = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t);
+	uint32_t n;
+	if(!read_section_count(f, minRecordSize, n))
+		return false;
+	animData.showIks.reserve(n);
+	for(auto i = decltype(n) {0u}; i < n; ++i) {
+		if(get_remaining_size(f) < minRecordSize)
+			break;
+		auto &showIk = animData.showIks.emplace_back();
+		showIk.frameIndex = f.Read<uint32_t>();
+		showIk.show = f.Read<uint8_t>() != 0;
+		auto numIkStates = f.Read<uint32_t>();
+		if(static_cast<uint64_t>(numIkStates) * sizeof(mmd::vmd::IkState) > get_remaining_size(f)) {
+			animData.showIks.pop_back();
+			break;
+		}
+		showIk.ikStateOffset = animData.ikStates.size();
+		showIk.ikStateCount = numIkStates;
+		animData.ikStates.resize(animData.ikStates.size() + numIkStates);
+		f.Read(animData.ikStates.data() + showIk.ikStateOffset, numIkStates * sizeof(mmd::vmd::IkState));
+	}
+	// IK state ranges stay valid, since only the keyframes themselves are reordered
+	std::stable_sort(animData.showIks.begin(), animData.showIks.end(), [](const mmd::vmd::ShowIk &a, const mmd::vmd::ShowIk &b) { return a.frameIndex < b.frameIndex; });
+	return true;
+}
+static std::shared_ptr<mmd::vmd::AnimationData> load_animation(ufile::IFile &f, mmd::LoadStats *stats, std::pmr::memory_resource *resource)
+{
+	using namespace mmd::vmd;
+	mmd::SectionTimer timer {f, stats};
+	timer.Begin(mmd::LoadSection::MotionHeader);
 	std::array<char, 30> ident;
 	f.Read(ident.data(), ident.size() * sizeof(ident.front()));
 	uint32_t version;
@@ -480,28 +846,116 @@ std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::load(ufile::IFile &f)
 	else
 		return nullptr;
 
-	auto animData = std::make_shared<mmd::vmd::AnimationData>();
+	auto animData = std::allocate_shared<mmd::vmd::AnimationData>(std::pmr::polymorphic_allocator<mmd::vmd::AnimationData> {resource ? resource : std::pmr::get_default_resource()});
 
 	std::array<char, 20> mdlName;
 	uint32_t mdlNameLen = (version == 1) ? 10 : 20;
 	f.Read(mdlName.data(), mdlNameLen * sizeof(mdlName.front()));
-	animData->modelName = std::string {mdlName.data(), mdlNameLen};
-
-	animData->keyframes = read_keyframe_data<Keyframe>(f);
-	animData->morphs = read_keyframe_data<Morph>(f);
-	animData->cameras = read_keyframe_data<Camera>(f);
-	animData->lights = read_keyframe_data<Light>(f);
+	std::string_view sjisName {mdlName.data(), strnlen(mdlName.data(), mdlNameLen)};
+	animData->modelName = mmd::shift_jis_to_utf8(sjisName);
+	if(stats)
+		stats->bytesTranscoded += sjisName.size();
+
+	// Each section is optional; Parsing stops at the first section that is missing or truncated
+	timer.Begin(mmd::LoadSection::Keyframes);
+	if(!read_keyframe_data<Keyframe>(f, animData->keyframes))
+		return animData;
+	timer.Begin(mmd::LoadSection::MorphKeys);
+	if(!read_keyframe_data<Morph>(f, animData->morphs))
+		return animData;
+	timer.Begin(mmd::LoadSection::Cameras);
+	if(!read_keyframe_data<Camera>(f, animData->cameras))
+		return animData;
+	timer.Begin(mmd::LoadSection::Lights);
+	if(!read_keyframe_data<Light>(f, animData->lights))
+		return animData;
+	timer.Begin(mmd::LoadSection::SelfShadows);
+	if(!read_keyframe_data<SelfShadow>(f, animData->selfShadows))
+		return animData;
+	timer.Begin(mmd::LoadSection::ShowIk);
+	read_show_ik_data(f, *animData);
+	return animData;
+}
+std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::load(ufile::IFile &f, LoadStats *stats, std::pmr::memory_resource *resource)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::load");
+	if(!stats)
+		return load_animation(f, nullptr, resource);
+	*stats = {};
+	CountingFile countingFile {f};
+	auto animData = load_animation(countingFile, stats, resource);
+	stats->readCalls = countingFile.GetReadCalls();
+	stats->bytesRead = countingFile.GetBytesRead();
+	if(animData) {
+		auto footprint = get_memory_footprint(*animData);
+		stats->allocationCount = footprint.GetAllocationCount();
+		stats->memoryFootprint = footprint.GetCapacityBytes();
+	}
 	return animData;
 }
-#pragma optimize("", on)
-#ifdef MMD_TEST
-int main(int argc, char *argv[])
+void mmd::vmd::canonicalize_interpolation(std::array<uint8_t, 64> &interpolation)
 {
-	auto mdlData = mmd::pmx::load("mdl.pmx");
+	// Every row is the previous row shifted by one byte, padded with 01 00 00
+	constexpr std::array<uint8_t, 3> padding {1, 0, 0};
+	for(uint32_t row = 1; row < 4; ++row) {
+		auto *dst = interpolation.data() + row * 16;
+		std::copy(interpolation.begin() + row, interpolation.begin() + 16, dst);
+		std::copy(padding.begin(), padding.begin() + row, dst + 16 - row);
+	}
+}
 
-	for(;;)
-		;
-	return EXIT_SUCCESS;
+static bool write_data(ufile::IFile &f, const void *data, size_t size) { return f.Write(data, size) == size; }
+template<class T>
+static bool write_keyframe_data(ufile::IFile &f, const std::pmr::vector<T> &keyframes)
+{
+	uint32_t n = keyframes.size();
+	return write_data(f, &n, sizeof(n)) && write_data(f, keyframes.data(), keyframes.size() * sizeof(T));
+}
+bool mmd::vmd::write(const AnimationData &animData, ufile::IFile &f)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::write");
+	std::array<char, 30> ident {};
+	constexpr std::string_view identStr = "Vocaloid Motion Data 0002";
+	std::copy(identStr.begin(), identStr.end(), ident.begin());
+	if(!write_data(f, ident.data(), ident.size()))
+		return false;
+
+	std::array<char, 20> mdlName;
+	encode_name(animData.modelName, mdlName);
+	if(!write_data(f, mdlName.data(), mdlName.size()))
+		return false;
+
+	// Bone keyframes are canonicalized in fixed-size chunks, so that large motions aren't copied as a whole
+	auto &keyframes = animData.keyframes;
+	uint32_t numKeyframes = keyframes.size();
+	if(!write_data(f, &numKeyframes, sizeof(numKeyframes)))
+		return false;
+	std::array<Keyframe, 256> chunk;
+	for(size_t offset = 0; offset < keyframes.size(); offset += chunk.size()) {
+		auto n = std::min(chunk.size(), keyframes.size() - offset);
+		std::copy_n(keyframes.begin() + offset, n, chunk.begin());
+		for(size_t i = 0; i < n; ++i)
+			canonicalize_interpolation(chunk[i].interpolation);
+		if(!write_data(f, chunk.data(), n * sizeof(Keyframe)))
+			return false;
+	}
+
+	if(!write_keyframe_data(f, animData.morphs) || !write_keyframe_data(f, animData.cameras) || !write_keyframe_data(f, animData.lights) || !write_keyframe_data(f, animData.selfShadows))
+		return false;
+
+	std::vector<uint8_t> showIkData;
+	showIkData.reserve(sizeof(uint32_t) + animData.showIks.size() * (sizeof(uint32_t) * 2 + sizeof(uint8_t)) + animData.ikStates.size() * sizeof(IkState));
+	auto append = [&showIkData](const void *data, size_t size) { showIkData.insert(showIkData.end(), static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size); };
+	uint32_t numShowIks = animData.showIks.size();
+	append(&numShowIks, sizeof(numShowIks));
+	for(auto &showIk : animData.showIks) {
+		if(showIk.ikStateOffset > animData.ikStates.size() || showIk.ikStateCount > animData.ikStates.size() - showIk.ikStateOffset)
+			return false;
+		uint8_t show = showIk.show ? 1 : 0;
+		append(&showIk.frameIndex, sizeof(showIk.frameIndex));
+		append(&show, sizeof(show));
+		append(&showIk.ikStateCount, sizeof(showIk.ikStateCount));
+		append(animData.ikStates.data() + showIk.ikStateOffset, showIk.ikStateCount * sizeof(IkState));
+	}
+	return write_data(f, showIkData.data(), showIkData.size());
 }
-#pragma optimize("", on)
-#endif
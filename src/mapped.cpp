@@ -0,0 +1,200 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_mapped.hpp"
+#include "util_mmd_trace.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_encoding.hpp"
+#include "span_reader.hpp"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <unordered_map>
+
+static_assert(alignof(mmd::vmd::Keyframe) == 1 && alignof(mmd::vmd::Morph) == 1 && alignof(mmd::vmd::Camera) == 1 && alignof(mmd::vmd::Light) == 1 && alignof(mmd::vmd::SelfShadow) == 1, "VMD records must be packed to be accessed in place");
+
+namespace mmd {
+	namespace vmd {
+		template<class T>
+		static std::span<const T> read_section(SpanReader &reader)
+		{
+			uint32_t n;
+			if(!reader.Read(n))
+				return {};
+			return reader.ReadSpan<T>(n);
+		}
+
+		template<class T>
+		static std::vector<uint32_t> build_sorted_order(std::span<const T> keys)
+		{
+			auto isSorted = std::is_sorted(keys.begin(), keys.end(), [](const T &a, const T &b) { return a.frameIndex < b.frameIndex; });
+			if(isSorted)
+				return {};
+			std::vector<uint32_t> order(keys.size());
+			std::iota(order.begin(), order.end(), 0);
+			std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return keys[a].frameIndex < keys[b].frameIndex; });
+			return order;
+		}
+
+		template<class T, class TGetName>
+		static TrackIndex build_track_index(std::span<const T> keys, const TGetName &getName)
+		{
+			TrackIndex trackIndex {};
+			std::unordered_map<std::string_view, uint32_t> nameToTrack;
+			std::vector<uint32_t> trackOfKey;
+			trackOfKey.reserve(keys.size());
+			for(auto &key : keys) {
+				auto &name = getName(key);
+				std::string_view nameView {name.data(), strnlen(name.data(), name.size())};
+				auto it = nameToTrack.find(nameView);
+				if(it == nameToTrack.end()) {
+					it = nameToTrack.insert(std::make_pair(nameView, static_cast<uint32_t>(trackIndex.names.size()))).first;
+					trackIndex.names.push_back(std::string {nameView});
+				}
+				trackOfKey.push_back(it->second);
+			}
+
+			// Counting sort by track, followed by a sort by frame index within every track
+			trackIndex.offsets.resize(trackIndex.names.size() + 1, 0);
+			for(auto track : trackOfKey)
+				++trackIndex.offsets[track + 1];
+			std::partial_sum(trackIndex.offsets.begin(), trackIndex.offsets.end(), trackIndex.offsets.begin());
+			trackIndex.keys.resize(keys.size());
+			auto insertPos = trackIndex.offsets;
+			for(uint32_t i = 0; i < trackOfKey.size(); ++i)
+				trackIndex.keys[insertPos[trackOfKey[i]]++] = i;
+			for(size_t i = 0; i < trackIndex.names.size(); ++i) {
+				auto begin = trackIndex.keys.begin() + trackIndex.offsets[i];
+				auto end = trackIndex.keys.begin() + trackIndex.offsets[i + 1];
+				std::stable_sort(begin, end, [&keys](uint32_t a, uint32_t b) { return keys[a].frameIndex < keys[b].frameIndex; });
+			}
+			return trackIndex;
+		}
+	};
+};
+
+mmd::vmd::TrackIndex mmd::vmd::build_track_index(std::span<const Keyframe> keyframes)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::build_track_index");
+	return build_track_index(keyframes, [](const Keyframe &key) -> const auto & { return key.boneName; });
+}
+mmd::vmd::TrackIndex mmd::vmd::build_track_index(std::span<const Morph> morphs)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::build_track_index");
+	return build_track_index(morphs, [](const Morph &key) -> const auto & { return key.morphName; });
+}
+
+std::shared_ptr<mmd::vmd::MappedAnimation> mmd::vmd::MappedAnimation::Open(const std::string &path)
+{
+	auto file = MappedFile::Open(path);
+	if(!file)
+		return nullptr;
+	std::shared_ptr<MappedAnimation> anim {new MappedAnimation {}};
+	if(!anim->Parse(file->GetData()))
+		return nullptr;
+	anim->m_file = std::move(file);
+	return anim;
+}
+
+std::shared_ptr<mmd::vmd::MappedAnimation> mmd::vmd::MappedAnimation::Create(std::span<const uint8_t> data)
+{
+	std::shared_ptr<MappedAnimation> anim {new MappedAnimation {}};
+	if(!anim->Parse(data))
+		return nullptr;
+	return anim;
+}
+
+mmd::vmd::MappedAnimation::~MappedAnimation() {}
+
+bool mmd::vmd::MappedAnimation::Parse(std::span<const uint8_t> data)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::MappedAnimation::Parse");
+	m_data = data;
+	SpanReader reader {data};
+	auto ident = reader.ReadBytes(30);
+	if(reader.Failed())
+		return false;
+	uint32_t mdlNameLen;
+	auto *identStr = reinterpret_cast<const char *>(ident.data());
+	if(strncmp(identStr, "Vocaloid Motion Data file", 26) == 0)
+		mdlNameLen = 10;
+	else if(strncmp(identStr, "Vocaloid Motion Data 0002", 26) == 0)
+		mdlNameLen = 20;
+	else
+		return false;
+	auto mdlName = reader.ReadBytes(mdlNameLen);
+	if(reader.Failed())
+		return false;
+	auto *mdlNameStr = reinterpret_cast<const char *>(mdlName.data());
+	m_modelName = shift_jis_to_utf8(std::string_view {mdlNameStr, strnlen(mdlNameStr, mdlName.size())});
+
+	// Same as vmd::load, every section is optional
+	m_keyframes = read_section<Keyframe>(reader);
+	m_morphs = read_section<Morph>(reader);
+	m_cameras = read_section<Camera>(reader);
+	m_lights = read_section<Light>(reader);
+	m_selfShadows = read_section<SelfShadow>(reader);
+	if(!reader.Read(m_showIkCount) || reader.Failed()) {
+		m_showIkCount = 0;
+		return true;
+	}
+	// The data ends after the last complete record
+	auto sectionStart = reader.Tell();
+	auto sectionEnd = sectionStart;
+	uint32_t numValid = 0;
+	for(; numValid < m_showIkCount; ++numValid) {
+		uint32_t numIkStates;
+		if(!reader.Skip(sizeof(uint32_t) + sizeof(uint8_t)) || !reader.Read(numIkStates) || !reader.Skip(static_cast<size_t>(numIkStates) * sizeof(IkState)))
+			break;
+		sectionEnd = reader.Tell();
+	}
+	m_showIkCount = numValid;
+	m_showIkData = data.subspan(sectionStart, sectionEnd - sectionStart);
+	return true;
+}
+
+std::span<const uint32_t> mmd::vmd::MappedAnimation::GetSortedOrder(Section section) const
+{
+	auto &lazy = m_sortedOrders[umath::to_integral(section)];
+	std::call_once(lazy.flag, [this, section, &lazy]() {
+		switch(section) {
+		case Section::Keyframes:
+			lazy.order = build_sorted_order(m_keyframes);
+			break;
+		case Section::Morphs:
+			lazy.order = build_sorted_order(m_morphs);
+			break;
+		case Section::Cameras:
+			lazy.order = build_sorted_order(m_cameras);
+			break;
+		case Section::Lights:
+			lazy.order = build_sorted_order(m_lights);
+			break;
+		case Section::SelfShadows:
+			lazy.order = build_sorted_order(m_selfShadows);
+			break;
+		default:
+			break;
+		}
+	});
+	return lazy.order;
+}
+
+const mmd::vmd::TrackIndex &mmd::vmd::MappedAnimation::GetBoneTrackIndex() const
+{
+	std::call_once(m_boneTrackFlag, [this]() { m_boneTracks = build_track_index(m_keyframes); });
+	return m_boneTracks;
+}
+const mmd::vmd::TrackIndex &mmd::vmd::MappedAnimation::GetMorphTrackIndex() const
+{
+	std::call_once(m_morphTrackFlag, [this]() { m_morphTracks = build_track_index(m_morphs); });
+	return m_morphTracks;
+}
+
+std::shared_ptr<mmd::vmd::AnimationData> mmd::vmd::MappedAnimation::ToAnimationData() const
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::MappedAnimation::ToAnimationData");
+	SpanFile f {m_data};
+	return load(f);
+}
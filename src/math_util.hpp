@@ -0,0 +1,83 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_MATH_UTIL_HPP__
+#define __UTIL_MMD_MATH_UTIL_HPP__
+
+#include <mathutil/umath.h>
+#include <mathutil/uvec.h>
+#include <algorithm>
+#include <cmath>
+
+// Quaternion helpers for quaternions stored as Vector4 (x, y, z, w), which is the layout used by
+// the MMD file formats.
+namespace mmd {
+	namespace math {
+		inline Vector4 quat_identity() { return Vector4 {0.f, 0.f, 0.f, 1.f}; }
+		inline Vector4 quat_mul(const Vector4 &a, const Vector4 &b)
+		{
+			return Vector4 {a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y, a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x, a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w, a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z};
+		}
+		inline Vector4 quat_conjugate(const Vector4 &q) { return Vector4 {-q.x, -q.y, -q.z, q.w}; }
+		inline Vector4 quat_normalize(const Vector4 &q)
+		{
+			auto len = std::sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+			if(len < 1e-12f)
+				return quat_identity();
+			return Vector4 {q.x / len, q.y / len, q.z / len, q.w / len};
+		}
+		inline Vector3 quat_rotate(const Vector4 &q, const Vector3 &v)
+		{
+			Vector3 u {q.x, q.y, q.z};
+			auto t = uvec::cross(u, v) * 2.f;
+			return v + t * q.w + uvec::cross(u, t);
+		}
+		inline Vector4 quat_from_axis_angle(const Vector3 &axis, float angle)
+		{
+			auto s = std::sin(angle * 0.5f);
+			return Vector4 {axis.x * s, axis.y * s, axis.z * s, std::cos(angle * 0.5f)};
+		}
+		// Rotation order used by MMD for rigid bodies and joints: Y, then X, then Z
+		inline Vector4 quat_from_euler_yxz(const Vector3 &angles)
+		{
+			auto qx = quat_from_axis_angle(Vector3 {1.f, 0.f, 0.f}, angles.x);
+			auto qy = quat_from_axis_angle(Vector3 {0.f, 1.f, 0.f}, angles.y);
+			auto qz = quat_from_axis_angle(Vector3 {0.f, 0.f, 1.f}, angles.z);
+			return quat_mul(quat_mul(qy, qx), qz);
+		}
+		// Inverse of quat_from_euler_yxz, the x angle is in [-pi/2, pi/2]
+		inline Vector3 quat_to_euler_yxz(const Vector4 &q)
+		{
+			auto m02 = 2.f * (q.x * q.z + q.w * q.y);
+			auto m22 = 1.f - 2.f * (q.x * q.x + q.y * q.y);
+			auto m12 = 2.f * (q.y * q.z - q.w * q.x);
+			auto m10 = 2.f * (q.x * q.y + q.w * q.z);
+			auto m11 = 1.f - 2.f * (q.x * q.x + q.z * q.z);
+			auto x = std::asin(std::clamp(-m12, -1.f, 1.f));
+			return Vector3 {x, std::atan2(m02, m22), std::atan2(m10, m11)};
+		}
+		inline Vector4 quat_slerp(const Vector4 &a, Vector4 b, float t)
+		{
+			auto cosTheta = a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+			if(cosTheta < 0.f) {
+				b = Vector4 {-b.x, -b.y, -b.z, -b.w};
+				cosTheta = -cosTheta;
+			}
+			float wa, wb;
+			if(cosTheta > 0.9995f) {
+				wa = 1.f - t;
+				wb = t;
+			}
+			else {
+				auto theta = std::acos(cosTheta);
+				auto sinTheta = std::sin(theta);
+				wa = std::sin((1.f - t) * theta) / sinTheta;
+				wb = std::sin(t * theta) / sinTheta;
+			}
+			return quat_normalize(Vector4 {a.x * wa + b.x * wb, a.y * wa + b.y * wb, a.z * wa + b.z * wb, a.w * wa + b.w * wb});
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,71 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_PARALLEL_HPP__
+#define __UTIL_MMD_PARALLEL_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mmd {
+	inline uint32_t get_thread_count(uint32_t numThreads, size_t numItems)
+	{
+		if(numThreads == 0)
+			numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		return static_cast<uint32_t>(std::min<size_t>(numThreads, numItems));
+	}
+	// Calls func(i) for every i in [0, count), distributed dynamically across numThreads threads
+	// (0 = hardware concurrency). The calling thread participates in the work.
+	// If func throws, no further items are started and the first exception is rethrown once all threads have finished.
+	template<class TFunc>
+	void parallel_for(size_t count, uint32_t numThreads, const TFunc &func)
+	{
+		numThreads = get_thread_count(numThreads, count);
+		if(numThreads <= 1) {
+			for(size_t i = 0; i < count; ++i)
+				func(i);
+			return;
+		}
+		std::atomic<size_t> next {0};
+		std::exception_ptr error;
+		std::mutex errorMutex;
+		auto worker = [&next, count, &func, &error, &errorMutex]() {
+			try {
+				for(auto i = next++; i < count; i = next++)
+					func(i);
+			}
+			catch(...) {
+				next = count;
+				std::scoped_lock lock {errorMutex};
+				if(!error)
+					error = std::current_exception();
+			}
+		};
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads - 1);
+		try {
+			for(uint32_t i = 1; i < numThreads; ++i)
+				threads.emplace_back(worker);
+		}
+		catch(...) {
+			// The threads that were started have to be joined before the exception leaves the function
+			next = count;
+			for(auto &t : threads)
+				t.join();
+			throw;
+		}
+		worker();
+		for(auto &t : threads)
+			t.join();
+		if(error)
+			std::rethrow_exception(error);
+	}
+};
+
+#endif
@@ -0,0 +1,57 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd.hpp"
+#include "util_mmd_trace.hpp"
+#include "math_util.hpp"
+
+void mmd::pmx::compute_rigid_body_transforms(ModelData &mdlData)
+{
+	UTIL_MMD_TRACE_SCOPE("pmx::compute_rigid_body_transforms");
+	auto &rigidBodies = mdlData.rigidBodies;
+	auto n = rigidBodies.size();
+	rigidBodies.orientations.resize(n);
+	rigidBodies.boneOffsets.resize(n);
+	rigidBodies.aabbMin.resize(n);
+	rigidBodies.aabbMax.resize(n);
+	for(size_t i = 0; i < n; ++i) {
+		auto rot = math::quat_from_euler_yxz(rigidBodies.rotations[i]);
+		rigidBodies.orientations[i] = rot;
+
+		auto &pos = rigidBodies.positions[i];
+		auto boneIdx = rigidBodies.boneIndices[i];
+		rigidBodies.boneOffsets[i] = (boneIdx >= 0 && boneIdx < static_cast<int32_t>(mdlData.bones.size())) ? (pos - mdlData.bones[boneIdx].position) : pos;
+
+		// Half extents of the shape in world space
+		auto &size = rigidBodies.sizes[i];
+		auto axisX = math::quat_rotate(rot, Vector3 {1.f, 0.f, 0.f});
+		auto axisY = math::quat_rotate(rot, Vector3 {0.f, 1.f, 0.f});
+		auto axisZ = math::quat_rotate(rot, Vector3 {0.f, 0.f, 1.f});
+		Vector3 extents;
+		switch(rigidBodies.shapes[i]) {
+		case RigidBodyShape::Sphere:
+			extents = Vector3 {size.x, size.x, size.x};
+			break;
+		case RigidBodyShape::Box:
+			for(uint8_t j = 0; j < 3; ++j)
+				extents[j] = std::abs(axisX[j]) * size.x + std::abs(axisY[j]) * size.y + std::abs(axisZ[j]) * size.z;
+			break;
+		case RigidBodyShape::Capsule:
+			// The capsule is aligned to the local y-axis
+			for(uint8_t j = 0; j < 3; ++j)
+				extents[j] = std::abs(axisY[j]) * size.y * 0.5f + size.x;
+			break;
+		default:
+			extents = Vector3 {0.f, 0.f, 0.f};
+			break;
+		}
+		rigidBodies.aabbMin[i] = pos - extents;
+		rigidBodies.aabbMax[i] = pos + extents;
+	}
+
+	auto &joints = mdlData.joints;
+	joints.orientations.resize(joints.size());
+	for(size_t i = 0; i < joints.size(); ++i)
+		joints.orientations[i] = math::quat_from_euler_yxz(joints.rotations[i]);
+}
@@ -0,0 +1,350 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd.hpp"
+#include "util_mmd_trace.hpp"
+#include "util_mmd_encoding.hpp"
+#include "util_mmd_io.hpp"
+#include "span_reader.hpp"
+#include <sharedutils/util_ifile.hpp>
+#include <algorithm>
+#include <cstdio>
+
+namespace mmd {
+	namespace pmd {
+		enum class BoneType : uint8_t { Rotate = 0, RotateMove, IK, Unknown, IKInfluenced, RotateInfluenced, IKTarget, Invisible, Twist, RotateMotion };
+
+#pragma pack(push, 1)
+		struct Vertex {
+			std::array<float, 3> position;
+			std::array<float, 3> normal;
+			std::array<float, 2> uv;
+			std::array<uint16_t, 2> boneIds;
+			uint8_t boneWeight; // Weight of the first bone in percent
+			uint8_t edgeFlag;
+		};
+		struct Material {
+			std::array<float, 4> diffuseColor;
+			float specularity;
+			std::array<float, 3> specularColor;
+			std::array<float, 3> ambientColor;
+			uint8_t toonIndex;
+			uint8_t edgeFlag;
+			uint32_t faceCount;
+			std::array<char, 20> textureFileName;
+		};
+		struct Bone {
+			std::array<char, 20> name;
+			uint16_t parentBoneIdx;
+			uint16_t tailBoneIdx;
+			BoneType type;
+			uint16_t ikParentBoneIdx;
+			std::array<float, 3> position;
+		};
+		struct SkinVertex {
+			uint32_t index;
+			std::array<float, 3> offset;
+		};
+		struct RigidBody {
+			std::array<char, 20> name;
+			uint16_t boneIdx;
+			uint8_t group;
+			uint16_t noCollisionMask;
+			pmx::RigidBodyShape shape;
+			std::array<float, 3> size;
+			std::array<float, 3> position; // Relative to the bone
+			std::array<float, 3> rotation;
+			float mass;
+			float linearDamping;
+			float angularDamping;
+			float restitution;
+			float friction;
+			pmx::PhysicsMode physicsMode;
+		};
+		struct Joint {
+			std::array<char, 20> name;
+			uint32_t rigidBodyA;
+			uint32_t rigidBodyB;
+			std::array<std::array<float, 3>, 8> values;
+		};
+#pragma pack(pop)
+		static_assert(sizeof(Vertex) == 38 && sizeof(Material) == 70 && sizeof(Bone) == 39 && sizeof(SkinVertex) == 16 && sizeof(RigidBody) == 83 && sizeof(Joint) == 124);
+
+		static Vector3 to_vector(const std::array<float, 3> &v) { return Vector3 {v[0], v[1], v[2]}; }
+
+		constexpr uint16_t INVALID_INDEX = 0xFFFF;
+		constexpr uint32_t TOON_COUNT = 10;
+
+		static int32_t to_index(uint16_t idx) { return (idx == INVALID_INDEX) ? -1 : idx; }
+
+		static int32_t add_texture(pmx::ModelData &mdlData, std::string_view name)
+		{
+			auto it = std::find(mdlData.textures.begin(), mdlData.textures.end(), name);
+			if(it != mdlData.textures.end())
+				return it - mdlData.textures.begin();
+			mdlData.textures.emplace_back(name);
+			return mdlData.textures.size() - 1;
+		}
+	};
+};
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmd::load(std::span<const uint8_t> data)
+{
+	UTIL_MMD_TRACE_SCOPE("pmd::load");
+	SpanReader reader {data};
+	auto signature = reader.Read<std::array<char, 3>>();
+	if(signature[0] != 'P' || signature[1] != 'm' || signature[2] != 'd')
+		return nullptr;
+	auto mdlData = std::make_shared<pmx::ModelData>();
+	mdlData->version = reader.Read<float>();
+	auto name = reader.Read<std::array<char, 20>>();
+	auto comment = reader.Read<std::array<char, 256>>();
+	mdlData->characterName = decode_name(name);
+	mdlData->comment = decode_name(comment);
+
+	auto vertices = reader.ReadSpan<Vertex>(reader.Read<uint32_t>());
+	auto faces = reader.ReadSpan<std::array<uint8_t, 2>>(reader.Read<uint32_t>());
+	auto materials = reader.ReadSpan<Material>(reader.Read<uint32_t>());
+	auto bones = reader.ReadSpan<Bone>(reader.Read<uint16_t>());
+	if(reader.Failed())
+		return nullptr;
+
+	mdlData->vertices.reserve(vertices.size());
+	for(auto &vIn : vertices) {
+		auto &v = mdlData->vertices.emplace_back();
+		v.position = vIn.position;
+		v.normal = vIn.normal;
+		v.uv = vIn.uv;
+		v.boneIds[0] = to_index(vIn.boneIds[0]);
+		v.boneIds[1] = to_index(vIn.boneIds[1]);
+		v.boneWeights[0] = vIn.boneWeight / 100.f;
+		v.boneWeights[1] = 1.f - v.boneWeights[0];
+	}
+
+	mdlData->faces.reserve(faces.size());
+	for(auto &idx : faces)
+		mdlData->faces.push_back(idx[0] | (idx[1] << 8));
+
+	mdlData->materials.reserve(materials.size());
+	for(auto &matIn : materials) {
+		auto &mat = mdlData->materials.emplace_back();
+		mat.diffuseColor = matIn.diffuseColor;
+		mat.specularColor = matIn.specularColor;
+		mat.specularity = matIn.specularity;
+		mat.ambientColor = matIn.ambientColor;
+		// MMD renders translucent PMD materials double-sided and disables self-shadows for an alpha of exactly 0.98
+		mat.drawingMode = pmx::DrawingMode::GroundShadow;
+		if(matIn.diffuseColor[3] < 1.f)
+			mat.drawingMode |= pmx::DrawingMode::NoCull;
+		if(matIn.diffuseColor[3] != 0.98f)
+			mat.drawingMode |= pmx::DrawingMode::DrawShadow | pmx::DrawingMode::ReceiveShadow;
+		if(matIn.edgeFlag != 0)
+			mat.drawingMode |= pmx::DrawingMode::HasEdge;
+		mat.edgeColor = {0.f, 0.f, 0.f, 1.f};
+		mat.edgeSize = 1.f;
+		mat.faceCount = matIn.faceCount;
+		// Texture and sphere map are stored in the same field as "texture*sphere"
+		std::string texName {matIn.textureFileName.data(), strnlen(matIn.textureFileName.data(), matIn.textureFileName.size())};
+		std::string sphereName;
+		auto sep = texName.find('*');
+		if(sep != std::string::npos) {
+			sphereName = texName.substr(sep + 1);
+			texName.resize(sep);
+		}
+		else if(texName.ends_with(".sph") || texName.ends_with(".spa")) {
+			sphereName = std::move(texName);
+			texName.clear();
+		}
+		if(!texName.empty())
+			mat.textureIndex = add_texture(*mdlData, shift_jis_to_utf8(texName));
+		if(!sphereName.empty()) {
+			mat.sphereIndex = add_texture(*mdlData, shift_jis_to_utf8(sphereName));
+			mat.sphereMode = sphereName.ends_with(".spa") ? 2 : 1;
+		}
+		// Resolved after the toon texture list has been read
+		mat.toonIndex = (matIn.toonIndex < TOON_COUNT) ? matIn.toonIndex : -1;
+	}
+
+	mdlData->bones.reserve(bones.size());
+	for(auto &boneIn : bones) {
+		auto &bone = mdlData->bones.emplace_back();
+		bone.nameJp = decode_name(boneIn.name);
+		bone.position = {boneIn.position[0], boneIn.position[1], boneIn.position[2]};
+		bone.parentBoneIdx = to_index(boneIn.parentBoneIdx);
+		bone.layer = 0;
+		bone.flags = pmx::BoneFlag::IndexedTailPosition | pmx::BoneFlag::Rotatable | pmx::BoneFlag::Enabled;
+		if(boneIn.type != BoneType::Invisible && boneIn.type != BoneType::IKTarget)
+			bone.flags |= pmx::BoneFlag::IsVisible;
+		if(boneIn.type == BoneType::RotateMove || boneIn.type == BoneType::IK)
+			bone.flags |= pmx::BoneFlag::Translatable;
+		if(boneIn.type == BoneType::RotateInfluenced) {
+			// The IK field holds the bone whose rotation is inherited in full
+			bone.flags |= pmx::BoneFlag::InheritRotation;
+			bone.inheritBoneIdx = to_index(boneIn.ikParentBoneIdx);
+			bone.inheritInfluence = 1.f;
+		}
+		if(boneIn.type == BoneType::Twist)
+			bone.flags |= pmx::BoneFlag::FixedAxis;
+	}
+
+	auto numIkChains = reader.Read<uint16_t>();
+	for(auto i = decltype(numIkChains) {0u}; i < numIkChains && !reader.Failed(); ++i) {
+		auto boneIdx = to_index(reader.Read<uint16_t>());
+		auto &chain = mdlData->ikChains.emplace_back();
+		chain.boneIndex = boneIdx;
+		chain.targetBoneIndex = to_index(reader.Read<uint16_t>());
+		auto linkCount = reader.Read<uint8_t>();
+		chain.loopCount = reader.Read<uint16_t>();
+		// PMD stores the limit in units of 4 radians
+		chain.limitAngle = reader.Read<float>() * 4.f;
+		chain.linkOffset = mdlData->ikLinks.size();
+		chain.linkCount = linkCount;
+		for(auto linkBoneIdx : reader.ReadSpan<std::array<uint8_t, 2>>(linkCount)) {
+			auto &link = mdlData->ikLinks.emplace_back();
+			link.boneIndex = to_index(linkBoneIdx[0] | (linkBoneIdx[1] << 8));
+			// Knees have an implicit rotation limit around the x-axis in MMD
+			if(link.boneIndex >= 0 && link.boneIndex < static_cast<int32_t>(mdlData->bones.size()) && mdlData->bones[link.boneIndex].nameJp.find("ひざ") != std::string::npos) {
+				link.hasLimits = true;
+				link.minAngle = {-umath::pi, 0.f, 0.f};
+				link.maxAngle = {umath::deg_to_rad(-0.5f), 0.f, 0.f};
+			}
+		}
+		if(boneIdx >= 0 && boneIdx < static_cast<int32_t>(mdlData->bones.size())) {
+			auto &bone = mdlData->bones[boneIdx];
+			bone.flags |= pmx::BoneFlag::IK;
+			bone.ikChainIndex = mdlData->ikChains.size() - 1;
+		}
+	}
+
+	// Face morphs are stored relative to the base morph, which lists the affected vertices
+	auto numSkins = reader.Read<uint16_t>();
+	std::span<const SkinVertex> baseVertices;
+	std::vector<pmx::Morph *> skinMorphs;
+	for(auto i = decltype(numSkins) {0u}; i < numSkins && !reader.Failed(); ++i) {
+		auto skinName = reader.Read<std::array<char, 20>>();
+		auto numSkinVertices = reader.Read<uint32_t>();
+		auto type = reader.Read<uint8_t>();
+		auto skinVertices = reader.ReadSpan<SkinVertex>(numSkinVertices);
+		if(type == 0) {
+			baseVertices = skinVertices;
+			continue;
+		}
+		auto morph = pmx::Morph::Create(mdlData->morphs.get_allocator());
+		morph->nameLocal = decode_name(skinName);
+		morph->panelType = type;
+		morph->type = pmx::MorphType::Vertex;
+		auto *vertexMorphs = morph->AllocateMorphs<pmx::VertexMorph>(skinVertices.size());
+		for(size_t j = 0; j < skinVertices.size(); ++j) {
+			auto &skinVertex = skinVertices[j];
+			auto &m = vertexMorphs[j];
+			m.index = (skinVertex.index < baseVertices.size()) ? static_cast<int32_t>(baseVertices[skinVertex.index].index) : -1;
+			m.offset = {skinVertex.offset[0], skinVertex.offset[1], skinVertex.offset[2]};
+		}
+		skinMorphs.push_back(morph.get());
+		mdlData->morphs.push_back(std::move(morph));
+	}
+	if(reader.Failed())
+		return nullptr;
+
+	// Display lists; These are not part of the model data
+	reader.Skip(reader.Read<uint8_t>() * sizeof(uint16_t));
+	auto numBoneDisplayNames = reader.Read<uint8_t>();
+	reader.Skip(numBoneDisplayNames * 50);
+	reader.Skip(reader.Read<uint32_t>() * (sizeof(uint16_t) + sizeof(uint8_t)));
+
+	// The remaining sections are extensions that may be missing in older files
+	if(reader.Read<uint8_t>() == 1) {
+		auto nameEn = reader.Read<std::array<char, 20>>();
+		auto commentEn = reader.Read<std::array<char, 256>>();
+		auto boneNamesEn = reader.ReadSpan<std::array<char, 20>>(mdlData->bones.size());
+		auto skinNamesEn = reader.ReadSpan<std::array<char, 20>>((numSkins > 0) ? (numSkins - 1) : 0);
+		reader.Skip(numBoneDisplayNames * 50);
+		if(!reader.Failed()) {
+			mdlData->characterName = decode_name(nameEn);
+			mdlData->comment = decode_name(commentEn);
+			for(size_t i = 0; i < boneNamesEn.size(); ++i)
+				mdlData->bones[i].name = decode_name(boneNamesEn[i]);
+			for(size_t i = 0; i < std::min(skinNamesEn.size(), skinMorphs.size()); ++i)
+				skinMorphs[i]->nameGlobal = decode_name(skinNamesEn[i]);
+		}
+	}
+
+	// Toon textures that match MMD's default names use the shared toon textures, all others become regular textures
+	auto toonNames = reader.ReadSpan<std::array<char, 100>>(TOON_COUNT);
+	for(auto &mat : mdlData->materials) {
+		if(mat.toonIndex < 0)
+			continue;
+		std::array<char, 16> defaultName;
+		// toonIndex is below TOON_COUNT
+		snprintf(defaultName.data(), defaultName.size(), "toon%02u.bmp", static_cast<uint8_t>(mat.toonIndex + 1));
+		if(toonNames.empty() || decode_name(toonNames[mat.toonIndex]) == defaultName.data()) {
+			mat.toonFlag = 1;
+			continue;
+		}
+		mat.toonFlag = 0;
+		mat.toonIndex = add_texture(*mdlData, decode_name(toonNames[mat.toonIndex]));
+	}
+
+	auto rigidBodies = reader.ReadSpan<RigidBody>(reader.Read<uint32_t>());
+	auto &rbs = mdlData->rigidBodies;
+	for(auto &rb : rigidBodies) {
+		auto boneIdx = to_index(rb.boneIdx);
+		rbs.namesLocal.emplace_back(decode_name(rb.name));
+		rbs.namesGlobal.emplace_back();
+		rbs.boneIndices.push_back(boneIdx);
+		rbs.groups.push_back(rb.group);
+		rbs.noCollisionMasks.push_back(rb.noCollisionMask);
+		rbs.shapes.push_back(rb.shape);
+		rbs.sizes.push_back(to_vector(rb.size));
+		// PMD positions are relative to the bone, or to the first bone if there is none
+		auto refBoneIdx = (boneIdx >= 0) ? boneIdx : 0;
+		auto pos = to_vector(rb.position);
+		if(refBoneIdx < static_cast<int32_t>(mdlData->bones.size()))
+			pos = pos + mdlData->bones[refBoneIdx].position;
+		rbs.positions.push_back(pos);
+		rbs.rotations.push_back(to_vector(rb.rotation));
+		rbs.masses.push_back(rb.mass);
+		rbs.linearDampings.push_back(rb.linearDamping);
+		rbs.angularDampings.push_back(rb.angularDamping);
+		rbs.restitutions.push_back(rb.restitution);
+		rbs.frictions.push_back(rb.friction);
+		rbs.physicsModes.push_back(rb.physicsMode);
+	}
+
+	auto joints = reader.ReadSpan<Joint>(reader.Read<uint32_t>());
+	auto &js = mdlData->joints;
+	for(auto &joint : joints) {
+		js.namesLocal.emplace_back(decode_name(joint.name));
+		js.namesGlobal.emplace_back();
+		js.types.push_back(pmx::JointType::Spring6Dof);
+		js.rigidBodyA.push_back(joint.rigidBodyA);
+		js.rigidBodyB.push_back(joint.rigidBodyB);
+		js.positions.push_back(to_vector(joint.values[0]));
+		js.rotations.push_back(to_vector(joint.values[1]));
+		js.positionMin.push_back(to_vector(joint.values[2]));
+		js.positionMax.push_back(to_vector(joint.values[3]));
+		js.rotationMin.push_back(to_vector(joint.values[4]));
+		js.rotationMax.push_back(to_vector(joint.values[5]));
+		js.springPositions.push_back(to_vector(joint.values[6]));
+		js.springRotations.push_back(to_vector(joint.values[7]));
+	}
+	pmx::compute_rigid_body_transforms(*mdlData);
+	return mdlData;
+}
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmd::load(ufile::IFile &f)
+{
+	std::vector<uint8_t> data;
+	data.resize(f.GetSize() - f.Tell());
+	data.resize(f.Read(data.data(), data.size()));
+	return load(std::span<const uint8_t> {data});
+}
+
+std::shared_ptr<mmd::pmx::ModelData> mmd::pmd::load(const std::string &path)
+{
+	auto f = MappedFile::Open(path);
+	if(!f)
+		return nullptr;
+	return load(f->GetData());
+}
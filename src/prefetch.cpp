@@ -0,0 +1,168 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_prefetch.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_textures.hpp"
+#include "util_mmd_trace.hpp"
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mmd {
+	static bool advise_will_need(const std::string &path)
+	{
+#ifdef _WIN32
+		return true;
+#else
+		auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1)
+			return false;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+		return true;
+#endif
+	}
+};
+
+mmd::TexturePrefetcher::TexturePrefetcher(const PrefetchSettings &settings) : m_settings {settings}
+{
+	auto numThreads = std::max(settings.numThreads, 1u);
+	m_threads.reserve(numThreads);
+	for(uint32_t i = 0; i < numThreads; ++i)
+		m_threads.emplace_back([this]() { RunWorker(); });
+}
+
+mmd::TexturePrefetcher::~TexturePrefetcher()
+{
+	{
+		std::scoped_lock lock {m_mutex};
+		m_closed = true;
+	}
+	m_queueCond.notify_all();
+	for(auto &t : m_threads)
+		t.join();
+}
+
+void mmd::TexturePrefetcher::Prefetch(const std::string &path)
+{
+	{
+		std::scoped_lock lock {m_mutex};
+		if(!m_items.try_emplace(path).second)
+			return;
+		m_queue.push_back(path);
+		++m_stats.requested;
+	}
+	m_queueCond.notify_one();
+}
+
+std::vector<int32_t> mmd::TexturePrefetcher::Prefetch(TextureResolver &resolver, const std::string &modelRoot, const pmx::ModelData &mdlData)
+{
+	auto indices = resolver.Resolve(modelRoot, mdlData);
+	for(auto idx : indices) {
+		if(idx != -1)
+			Prefetch(resolver.GetPaths()[idx]);
+	}
+	return indices;
+}
+
+void mmd::TexturePrefetcher::RunWorker()
+{
+	std::unique_lock lock {m_mutex};
+	for(;;) {
+		m_queueCond.wait(lock, [this]() { return !m_queue.empty() || m_closed; });
+		if(m_closed)
+			return;
+		auto path = std::move(m_queue.front());
+		m_queue.pop_front();
+		auto it = m_items.find(path);
+		// The file may have been accessed before its read started
+		if(it == m_items.end() || it->second.state != State::Queued)
+			continue;
+		// Items are only removed by Take, which waits while the state is Reading, so the reference stays valid
+		auto &item = it->second;
+		item.state = State::Reading;
+		lock.unlock();
+
+		UTIL_MMD_TRACE_SCOPE("TexturePrefetcher::Read");
+		std::error_code ec;
+		auto size = std::filesystem::file_size(path, ec);
+		auto cache = false;
+		if(!ec) {
+			// Space is reserved up front so that concurrent reads can't exceed the cache size
+			std::scoped_lock cacheLock {m_mutex};
+			cache = (m_cacheBytes <= m_settings.cacheSize && size <= m_settings.cacheSize - m_cacheBytes);
+			if(cache)
+				m_cacheBytes += size;
+		}
+		std::vector<uint8_t> data;
+		auto success = !ec && (cache ? read_file(path, data) : advise_will_need(path));
+
+		lock.lock();
+		if(cache)
+			m_cacheBytes = m_cacheBytes - size + (success ? data.size() : 0);
+		if(!success) {
+			item.state = State::Failed;
+			++m_stats.failed;
+		}
+		else if(cache) {
+			item.state = State::Cached;
+			item.data = std::move(data);
+			++m_stats.cached;
+			m_stats.bytesCached += item.data.size();
+		}
+		else {
+			item.state = State::Advised;
+			++m_stats.advised;
+		}
+		m_readCond.notify_all();
+	}
+}
+
+bool mmd::TexturePrefetcher::Take(const std::string &path, std::vector<uint8_t> &outData)
+{
+	std::unique_lock lock {m_mutex};
+	auto it = m_items.find(path);
+	auto late = false;
+	if(it != m_items.end() && it->second.state == State::Reading) {
+		late = true;
+		// Another thread may take the file in the meantime
+		m_readCond.wait(lock, [this, &path, &it]() {
+			it = m_items.find(path);
+			return it == m_items.end() || it->second.state != State::Reading;
+		});
+	}
+	if(it == m_items.end()) {
+		++m_stats.misses;
+		return false;
+	}
+	auto &item = it->second;
+	auto result = false;
+	switch(item.state) {
+	case State::Cached:
+		outData = std::move(item.data);
+		m_cacheBytes -= outData.size();
+		result = true;
+		[[fallthrough]];
+	case State::Advised:
+		++(late ? m_stats.lateHits : m_stats.hits);
+		break;
+	default:
+		// The queued read is skipped by the workers
+		++m_stats.misses;
+		break;
+	}
+	m_items.erase(it);
+	return result;
+}
+
+bool mmd::TexturePrefetcher::ReadFile(const std::string &path, std::vector<uint8_t> &outData) { return Take(path, outData) || read_file(path, outData); }
+
+mmd::PrefetchStats mmd::TexturePrefetcher::GetStats() const
+{
+	std::scoped_lock lock {m_mutex};
+	return m_stats;
+}
@@ -0,0 +1,259 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_probe.hpp"
+#include "util_mmd_trace.hpp"
+#include "util_mmd_io.hpp"
+#include "util_mmd_mapped.hpp"
+#include "span_reader.hpp"
+#include "parallel.hpp"
+#include <utf8.h>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+namespace mmd {
+	namespace pmx {
+		static bool read_text(SpanReader &reader, TextEncoding encoding, std::string &outText)
+		{
+			int32_t len;
+			if(!reader.Read(len) || len < 0)
+				return false;
+			auto data = reader.ReadBytes(len);
+			if(reader.Failed())
+				return false;
+			if(encoding == TextEncoding::UTF8) {
+				outText.assign(reinterpret_cast<const char *>(data.data()), data.size());
+				return true;
+			}
+			// The text is not necessarily aligned in the file
+			std::vector<uint16_t> utf16(data.size() / 2);
+			memcpy(utf16.data(), data.data(), utf16.size() * sizeof(utf16.front()));
+			outText.clear();
+			utf8::utf16to8(utf16.begin(), utf16.end(), std::back_inserter(outText));
+			return true;
+		}
+		static bool skip_text(SpanReader &reader)
+		{
+			int32_t len;
+			return reader.Read(len) && len >= 0 && reader.Skip(len);
+		}
+		static bool read_count(SpanReader &reader, uint32_t &outCount)
+		{
+			int32_t count;
+			if(!reader.Read(count) || count < 0)
+				return false;
+			outCount = count;
+			return true;
+		}
+		static bool skip_vertices(SpanReader &reader, const Header &header, uint32_t count)
+		{
+			enum class WeightType : uint8_t { BDEF1 = 0, BDEF2, BDEF4, SDEF, QDEF };
+			auto boneIndexSize = static_cast<size_t>(umath::to_integral(header.boneIndexSize));
+			// Position, normal, uv and additional uvs
+			auto baseSize = sizeof(float) * (3 + 3 + 2) + sizeof(float) * 4 * header.appendixDataCount;
+			for(uint32_t i = 0; i < count; ++i) {
+				if(!reader.Skip(baseSize))
+					return false;
+				size_t weightSize;
+				switch(reader.Read<WeightType>()) {
+				case WeightType::BDEF1:
+					weightSize = boneIndexSize;
+					break;
+				case WeightType::BDEF2:
+					weightSize = boneIndexSize * 2 + sizeof(float);
+					break;
+				case WeightType::BDEF4:
+				case WeightType::QDEF:
+					weightSize = (boneIndexSize + sizeof(float)) * 4;
+					break;
+				case WeightType::SDEF:
+					weightSize = boneIndexSize * 2 + sizeof(float) + sizeof(float) * 3 * 3;
+					break;
+				default:
+					return false;
+				}
+				// Weights and edge scale
+				if(!reader.Skip(weightSize + sizeof(float)))
+					return false;
+			}
+			return true;
+		}
+		static bool skip_materials(SpanReader &reader, const Header &header, uint32_t count)
+		{
+			auto textureIndexSize = static_cast<size_t>(umath::to_integral(header.textureIndexSize));
+			// Diffuse, specular, specularity, ambient, drawing mode, edge color, edge size
+			constexpr auto colorSize = sizeof(float) * (4 + 3 + 1 + 3) + sizeof(DrawingMode) + sizeof(float) * (4 + 1);
+			for(uint32_t i = 0; i < count; ++i) {
+				if(!skip_text(reader) || !skip_text(reader) || !reader.Skip(colorSize + textureIndexSize * 2 + sizeof(int8_t)))
+					return false;
+				auto toonFlag = reader.Read<int8_t>();
+				if(!reader.Skip((toonFlag == 0) ? textureIndexSize : sizeof(int8_t)) || !skip_text(reader) || !reader.Skip(sizeof(int32_t)))
+					return false;
+			}
+			return true;
+		}
+		static bool skip_bones(SpanReader &reader, const Header &header, uint32_t count)
+		{
+			auto boneIndexSize = static_cast<size_t>(umath::to_integral(header.boneIndexSize));
+			auto isSet = [](BoneFlag flags, BoneFlag flag) { return (flags & flag) != BoneFlag::None; };
+			for(uint32_t i = 0; i < count; ++i) {
+				if(!skip_text(reader) || !skip_text(reader) || !reader.Skip(sizeof(Vector3) + boneIndexSize + sizeof(int32_t)))
+					return false;
+				auto flags = reader.Read<BoneFlag>();
+				size_t size = isSet(flags, BoneFlag::IndexedTailPosition) ? boneIndexSize : sizeof(float) * 3;
+				if(isSet(flags, BoneFlag::InheritRotation | BoneFlag::InheritTranslation))
+					size += boneIndexSize + sizeof(float);
+				if(isSet(flags, BoneFlag::FixedAxis))
+					size += sizeof(float) * 3;
+				if(isSet(flags, BoneFlag::LocalCoordinate))
+					size += sizeof(float) * 3 * 2;
+				if(isSet(flags, BoneFlag::ExternalParentDeform))
+					size += boneIndexSize;
+				if(!reader.Skip(size))
+					return false;
+				if(!isSet(flags, BoneFlag::IK))
+					continue;
+				// Target, loop count, limit angle
+				uint32_t linkCount;
+				if(!reader.Skip(boneIndexSize + sizeof(int32_t) + sizeof(float)) || !read_count(reader, linkCount))
+					return false;
+				for(uint32_t j = 0; j < linkCount; ++j) {
+					if(!reader.Skip(boneIndexSize))
+						return false;
+					auto hasLimits = reader.Read<int8_t>();
+					if(hasLimits == 1 && !reader.Skip(sizeof(float) * 3 * 2))
+						return false;
+				}
+			}
+			return !reader.Failed();
+		}
+	};
+};
+
+std::optional<mmd::pmx::ProbeInfo> mmd::pmx::probe(std::span<const uint8_t> data)
+{
+	SpanReader reader {data};
+	auto signature = reader.Read<std::array<char, 4>>();
+	if(reader.Failed() || signature[0] != 'P' || signature[1] != 'M' || signature[2] != 'X' || (signature[3] != ' ' && signature[3] != '@'))
+		return {};
+	ProbeInfo info {};
+	info.version = reader.Read<float>();
+	if(info.version != 2.f && info.version != 2.1f)
+		return {};
+	auto headerSize = reader.Read<uint8_t>();
+	auto headerData = reader.ReadBytes(headerSize);
+	if(reader.Failed() || headerSize < 8)
+		return {};
+	auto &header = info.header;
+	header.textEncoding = static_cast<TextEncoding>(headerData[0]);
+	header.appendixDataCount = headerData[1];
+	std::array<IndexType *, 6> indexSizes {&header.vertexIndexSize, &header.textureIndexSize, &header.materialIndexSize, &header.boneIndexSize, &header.morphIndexSize, &header.rigidBodyIndexSize};
+	for(size_t i = 0; i < indexSizes.size(); ++i) {
+		auto size = headerData[2 + i];
+		if(size != 1 && size != 2 && size != 4)
+			return {};
+		*indexSizes[i] = static_cast<IndexType>(size);
+	}
+	if(!read_text(reader, header.textEncoding, info.nameLocal) || !read_text(reader, header.textEncoding, info.nameGlobal) || !read_text(reader, header.textEncoding, info.commentLocal)
+	  || !read_text(reader, header.textEncoding, info.commentGlobal))
+		return {};
+
+	if(!read_count(reader, info.vertexCount) || !skip_vertices(reader, header, info.vertexCount))
+		return {};
+	if(!read_count(reader, info.faceCount) || !reader.Skip(static_cast<size_t>(info.faceCount) * umath::to_integral(header.vertexIndexSize)))
+		return {};
+	if(!read_count(reader, info.textureCount))
+		return {};
+	for(uint32_t i = 0; i < info.textureCount; ++i) {
+		if(!skip_text(reader))
+			return {};
+	}
+	if(!read_count(reader, info.materialCount) || !skip_materials(reader, header, info.materialCount))
+		return {};
+	if(!read_count(reader, info.boneCount) || !skip_bones(reader, header, info.boneCount))
+		return {};
+	// Everything that was requested is known at this point, the remaining sections are never touched
+	if(!read_count(reader, info.morphCount))
+		return {};
+	return info;
+}
+
+std::optional<mmd::pmx::ProbeInfo> mmd::pmx::probe(const std::string &path)
+{
+	auto file = MappedFile::Open(path);
+	if(!file)
+		return {};
+	return probe(file->GetData());
+}
+
+std::vector<std::optional<mmd::pmx::ProbeInfo>> mmd::pmx::probe(const std::vector<std::string> &paths, uint32_t numThreads)
+{
+	UTIL_MMD_TRACE_SCOPE("pmx::probe_batch");
+	std::vector<std::optional<ProbeInfo>> infos;
+	infos.resize(paths.size());
+	parallel_for(paths.size(), numThreads, [&paths, &infos](size_t i) { infos[i] = probe(paths[i]); });
+	return infos;
+}
+
+std::optional<mmd::vmd::ProbeInfo> mmd::vmd::probe(std::span<const uint8_t> data)
+{
+	// MappedAnimation only validates the section bounds, none of the keys are copied
+	auto anim = MappedAnimation::Create(data);
+	if(!anim)
+		return {};
+	ProbeInfo info {};
+	info.modelName = anim->GetModelName();
+	info.keyframeCount = anim->GetKeyframes().size();
+	info.morphCount = anim->GetMorphs().size();
+	info.cameraCount = anim->GetCameras().size();
+	info.lightCount = anim->GetLights().size();
+	info.selfShadowCount = anim->GetSelfShadows().size();
+	info.showIkCount = anim->GetShowIkCount();
+
+	auto minFrame = std::numeric_limits<uint32_t>::max();
+	auto maxFrame = std::numeric_limits<uint32_t>::lowest();
+	auto addFrame = [&minFrame, &maxFrame](uint32_t frameIndex) {
+		minFrame = std::min(minFrame, frameIndex);
+		maxFrame = std::max(maxFrame, frameIndex);
+	};
+	auto addFrames = [&addFrame](const auto &keys) {
+		for(auto &key : keys)
+			addFrame(key.frameIndex);
+	};
+	addFrames(anim->GetKeyframes());
+	addFrames(anim->GetMorphs());
+	addFrames(anim->GetCameras());
+	addFrames(anim->GetLights());
+	addFrames(anim->GetSelfShadows());
+
+	SpanReader reader {anim->GetShowIkData()};
+	for(uint32_t i = 0; i < info.showIkCount; ++i) {
+		addFrame(reader.Read<uint32_t>());
+		reader.Skip(sizeof(uint8_t));
+		reader.Skip(static_cast<size_t>(reader.Read<uint32_t>()) * sizeof(IkState));
+	}
+	if(minFrame <= maxFrame) {
+		info.minFrame = minFrame;
+		info.maxFrame = maxFrame;
+	}
+	return info;
+}
+
+std::optional<mmd::vmd::ProbeInfo> mmd::vmd::probe(const std::string &path)
+{
+	auto file = MappedFile::Open(path);
+	if(!file)
+		return {};
+	return probe(file->GetData());
+}
+
+std::vector<std::optional<mmd::vmd::ProbeInfo>> mmd::vmd::probe(const std::vector<std::string> &paths, uint32_t numThreads)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::probe_batch");
+	std::vector<std::optional<ProbeInfo>> infos;
+	infos.resize(paths.size());
+	parallel_for(paths.size(), numThreads, [&paths, &infos](size_t i) { infos[i] = probe(paths[i]); });
+	return infos;
+}
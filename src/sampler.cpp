@@ -0,0 +1,220 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_sampler.hpp"
+#include "util_mmd_trace.hpp"
+#include "key_cursor.hpp"
+#include <mathutil/uvec.h>
+#include <algorithm>
+#include <cstring>
+
+namespace mmd {
+	namespace vmd {
+		template<size_t N>
+		static std::string_view get_name(const std::array<char, N> &name)
+		{
+			return std::string_view {name.data(), strnlen(name.data(), name.size())};
+		}
+	};
+};
+
+mmd::vmd::BezierCurve mmd::vmd::BezierCurve::FromBytes(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2)
+{
+	BezierCurve curve {};
+	curve.x1 = x1 / 127.f;
+	curve.y1 = y1 / 127.f;
+	curve.x2 = x2 / 127.f;
+	curve.y2 = y2 / 127.f;
+	curve.linear = (x1 == y1 && x2 == y2);
+	return curve;
+}
+
+float mmd::vmd::BezierCurve::Evaluate(float x) const
+{
+	if(linear)
+		return x;
+	x = std::clamp(x, 0.f, 1.f);
+	auto bezier = [](float p1, float p2, float t) {
+		auto it = 1.f - t;
+		return 3.f * it * it * t * p1 + 3.f * it * t * t * p2 + t * t * t;
+	};
+	// Newton iterations converge quickly for well-behaved curves, bisection is used as fallback
+	auto t = x;
+	for(uint8_t i = 0; i < 8; ++i) {
+		auto err = bezier(x1, x2, t) - x;
+		if(std::abs(err) < 1e-5f)
+			return bezier(y1, y2, t);
+		auto it = 1.f - t;
+		auto slope = 3.f * it * it * x1 + 6.f * it * t * (x2 - x1) + 3.f * t * t * (1.f - x2);
+		if(std::abs(slope) < 1e-6f)
+			break;
+		t -= err / slope;
+		if(t < 0.f || t > 1.f)
+			break;
+	}
+	auto lo = 0.f;
+	auto hi = 1.f;
+	t = x;
+	for(uint8_t i = 0; i < 32; ++i) {
+		auto err = bezier(x1, x2, t) - x;
+		if(std::abs(err) < 1e-5f)
+			break;
+		if(err < 0.f)
+			lo = t;
+		else
+			hi = t;
+		t = (lo + hi) * 0.5f;
+	}
+	return bezier(y1, y2, t);
+}
+
+mmd::vmd::CameraSampler::CameraSampler(const AnimationData &animData)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::CameraSampler::CameraSampler");
+	m_keys.reserve(animData.cameras.size());
+	for(auto &cam : animData.cameras) {
+		auto &key = m_keys.emplace_back();
+		key.frameIndex = cam.frameIndex;
+		key.target = {cam.position[0], cam.position[1], cam.position[2]};
+		key.angles = {cam.angles[0], cam.angles[1], cam.angles[2]};
+		key.distance = cam.negDistance;
+		key.fov = umath::deg_to_rad(static_cast<float>(cam.viewingngle));
+		key.perspective = (cam.perspective == 0);
+		// Each curve is stored as x1, x2, y1, y2
+		auto &interp = cam.interpolation;
+		for(uint8_t i = 0; i < key.curves.size(); ++i)
+			key.curves[i] = BezierCurve::FromBytes(interp[i * 4], interp[i * 4 + 2], interp[i * 4 + 1], interp[i * 4 + 3]);
+	}
+}
+
+bool mmd::vmd::CameraSampler::Sample(float frame, CameraState &outState)
+{
+	if(m_keys.empty())
+		return false;
+	m_cursor = advance_cursor(m_cursor, m_keys.size(), frame, [this](uint32_t i) { return m_keys[i].frameIndex; });
+	auto &key0 = m_keys[m_cursor];
+	outState.target = key0.target;
+	outState.angles = key0.angles;
+	outState.distance = key0.distance;
+	outState.fov = key0.fov;
+	outState.perspective = key0.perspective;
+	// Keys on consecutive frames denote a camera cut and are not interpolated
+	if(m_cursor + 1 < m_keys.size() && frame > static_cast<float>(key0.frameIndex) && m_keys[m_cursor + 1].frameIndex - key0.frameIndex > 1) {
+		auto &key1 = m_keys[m_cursor + 1];
+		auto t = (frame - key0.frameIndex) / static_cast<float>(key1.frameIndex - key0.frameIndex);
+		auto lerp = [t, &key1](float a, float b, Curve curve) { return a + (b - a) * key1.curves[umath::to_integral(curve)].Evaluate(t); };
+		outState.target = {lerp(key0.target.x, key1.target.x, Curve::X), lerp(key0.target.y, key1.target.y, Curve::Y), lerp(key0.target.z, key1.target.z, Curve::Z)};
+		auto tRot = key1.curves[umath::to_integral(Curve::Rotation)].Evaluate(t);
+		outState.angles = key0.angles + (key1.angles - key0.angles) * tRot;
+		outState.distance = lerp(key0.distance, key1.distance, Curve::Distance);
+		outState.fov = lerp(key0.fov, key1.fov, Curve::Fov);
+	}
+
+	// MMD applies the camera rotation in Y-X-Z order and places the eye at the (negative) distance along the rotated z-axis
+	auto rotate = [&angles = outState.angles](const Vector3 &v) {
+		auto sx = std::sin(angles.x), cx = std::cos(angles.x);
+		auto sy = std::sin(angles.y), cy = std::cos(angles.y);
+		auto sz = std::sin(angles.z), cz = std::cos(angles.z);
+		Vector3 r {v.x * cz - v.y * sz, v.x * sz + v.y * cz, v.z};
+		r = {r.x, r.y * cx - r.z * sx, r.y * sx + r.z * cx};
+		return Vector3 {r.x * cy + r.z * sy, r.y, -r.x * sy + r.z * cy};
+	};
+	auto forward = rotate(Vector3 {0.f, 0.f, 1.f});
+	auto up = rotate(Vector3 {0.f, 1.f, 0.f});
+	outState.position = outState.target + forward * outState.distance;
+
+	// Left-handed look-at matrix
+	auto z = forward;
+	auto x = uvec::cross(up, z);
+	uvec::normalize(&x);
+	auto y = uvec::cross(z, x);
+	auto &eye = outState.position;
+	outState.viewMatrix = Mat4 {x.x, y.x, z.x, 0.f, x.y, y.y, z.y, 0.f, x.z, y.z, z.z, 0.f, -uvec::dot(x, eye), -uvec::dot(y, eye), -uvec::dot(z, eye), 1.f};
+	return true;
+}
+
+mmd::vmd::LightSampler::LightSampler(const AnimationData &animData) : m_lights {animData.lights}, m_selfShadows {animData.selfShadows} {}
+
+void mmd::vmd::LightSampler::Reset()
+{
+	m_lightCursor = 0;
+	m_shadowCursor = 0;
+}
+
+bool mmd::vmd::LightSampler::Sample(float frame, LightingState &outState)
+{
+	if(m_lights.empty() && m_selfShadows.empty())
+		return false;
+	if(!m_lights.empty()) {
+		m_lightCursor = advance_cursor(m_lightCursor, m_lights.size(), frame, [this](uint32_t i) { return m_lights[i].frameIndex; });
+		auto &key0 = m_lights[m_lightCursor];
+		auto toVec = [](const std::array<float, 3> &v) { return Vector3 {v[0], v[1], v[2]}; };
+		outState.color = toVec(key0.color);
+		outState.direction = toVec(key0.position);
+		if(m_lightCursor + 1 < m_lights.size() && frame > static_cast<float>(key0.frameIndex)) {
+			auto &key1 = m_lights[m_lightCursor + 1];
+			auto t = (frame - key0.frameIndex) / static_cast<float>(key1.frameIndex - key0.frameIndex);
+			outState.color = outState.color + (toVec(key1.color) - outState.color) * t;
+			outState.direction = outState.direction + (toVec(key1.position) - outState.direction) * t;
+		}
+	}
+	if(!m_selfShadows.empty()) {
+		m_shadowCursor = advance_cursor(m_shadowCursor, m_selfShadows.size(), frame, [this](uint32_t i) { return m_selfShadows[i].frameIndex; });
+		auto &key = m_selfShadows[m_shadowCursor];
+		outState.shadowMode = key.mode;
+		outState.shadowDistance = key.distance;
+	}
+	return true;
+}
+
+mmd::vmd::IkStateSampler::IkStateSampler(const AnimationData &animData)
+{
+	UTIL_MMD_TRACE_SCOPE("vmd::IkStateSampler::IkStateSampler");
+	for(auto &ikState : animData.ikStates) {
+		auto name = get_name(ikState.boneName);
+		if(FindTrack(name) == -1)
+			m_trackNames.push_back(std::string {name});
+	}
+	auto numTracks = m_trackNames.size();
+	auto numKeys = animData.showIks.size();
+	m_keyFrames.reserve(numKeys);
+	m_visible.reserve(numKeys + 1);
+	m_states.resize((numKeys + 1) * numTracks, 1);
+	m_visible.push_back(1);
+
+	// Every key starts with the state of the previous one, in case it doesn't list all IK bones
+	for(size_t i = 0; i < numKeys; ++i) {
+		auto &showIk = animData.showIks[i];
+		m_keyFrames.push_back(showIk.frameIndex);
+		m_visible.push_back(showIk.show ? 1 : 0);
+		auto *row = m_states.data() + (i + 1) * numTracks;
+		std::copy(row - numTracks, row, row);
+		for(auto j = showIk.ikStateOffset; j < showIk.ikStateOffset + showIk.ikStateCount; ++j) {
+			auto &ikState = animData.ikStates[j];
+			row[FindTrack(get_name(ikState.boneName))] = (ikState.enabled != 0) ? 1 : 0;
+		}
+	}
+}
+
+int32_t mmd::vmd::IkStateSampler::FindTrack(std::string_view boneName) const
+{
+	auto it = std::find(m_trackNames.begin(), m_trackNames.end(), boneName);
+	return (it != m_trackNames.end()) ? (it - m_trackNames.begin()) : -1;
+}
+
+uint32_t mmd::vmd::IkStateSampler::FindRow(float frame)
+{
+	if(m_keyFrames.empty() || frame < static_cast<float>(m_keyFrames.front()))
+		return 0;
+	m_cursor = advance_cursor(m_cursor, m_keyFrames.size(), frame, [this](uint32_t i) { return m_keyFrames[i]; });
+	return m_cursor + 1;
+}
+
+std::span<const uint8_t> mmd::vmd::IkStateSampler::Sample(float frame)
+{
+	auto numTracks = m_trackNames.size();
+	return std::span<const uint8_t> {m_states.data() + FindRow(frame) * numTracks, numTracks};
+}
+
+bool mmd::vmd::IkStateSampler::IsVisible(float frame) { return m_visible[FindRow(frame)] != 0; }
@@ -0,0 +1,84 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef __UTIL_MMD_SPAN_READER_HPP__
+#define __UTIL_MMD_SPAN_READER_HPP__
+
+#include <cinttypes>
+#include <cstring>
+#include <span>
+#include <type_traits>
+
+namespace mmd {
+	// Bounds-checked cursor over a block of memory. Reads past the end fail instead of throwing,
+	// after which the reader stays in the failed state.
+	class SpanReader {
+	  public:
+		SpanReader(std::span<const uint8_t> data) : m_data {data} {}
+		template<typename T>
+		bool Read(T &outValue)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+			if(!Require(sizeof(T)))
+				return false;
+			memcpy(&outValue, m_data.data() + m_offset, sizeof(T));
+			m_offset += sizeof(T);
+			return true;
+		}
+		template<typename T>
+		T Read()
+		{
+			T value {};
+			Read(value);
+			return value;
+		}
+		// Returns a view of count records without copying them. T must have an alignment of 1
+		// (i.e. a packed on-disk record) so that the memory can be accessed in place.
+		template<typename T>
+		std::span<const T> ReadSpan(size_t count)
+		{
+			static_assert(alignof(T) == 1);
+			if(count > Remaining() / sizeof(T)) {
+				m_failed = true;
+				return {};
+			}
+			std::span<const T> result {reinterpret_cast<const T *>(m_data.data() + m_offset), count};
+			m_offset += count * sizeof(T);
+			return result;
+		}
+		std::span<const uint8_t> ReadBytes(size_t size)
+		{
+			if(!Require(size))
+				return {};
+			auto result = m_data.subspan(m_offset, size);
+			m_offset += size;
+			return result;
+		}
+		bool Skip(size_t size)
+		{
+			if(!Require(size))
+				return false;
+			m_offset += size;
+			return true;
+		}
+		size_t Remaining() const { return m_failed ? 0 : (m_data.size() - m_offset); }
+		size_t Tell() const { return m_offset; }
+		bool Failed() const { return m_failed; }
+		std::span<const uint8_t> GetData() const { return m_data; }
+	  private:
+		bool Require(size_t size)
+		{
+			if(m_failed || size > m_data.size() - m_offset) {
+				m_failed = true;
+				return false;
+			}
+			return true;
+		}
+		std::span<const uint8_t> m_data;
+		size_t m_offset = 0;
+		bool m_failed = false;
+	};
+};
+
+#endif
@@ -0,0 +1,240 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_springs.hpp"
+#include "util_mmd_trace.hpp"
+#include "math_util.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+
+namespace mmd {
+	namespace springs {
+		static Vector3 transform_point(const BoneTransform &t, const Vector3 &p) { return math::quat_rotate(t.rotation, p) + t.translation; }
+		// Shortest rotation from direction a to direction b
+		static Vector4 rotation_between(Vector3 a, Vector3 b)
+		{
+			uvec::normalize(&a);
+			uvec::normalize(&b);
+			auto d = uvec::dot(a, b);
+			if(d < -0.9999f) {
+				auto axis = uvec::cross(Vector3 {1.f, 0.f, 0.f}, a);
+				if(uvec::length(axis) < 1e-4f)
+					axis = uvec::cross(Vector3 {0.f, 1.f, 0.f}, a);
+				uvec::normalize(&axis);
+				return math::quat_from_axis_angle(axis, umath::pi);
+			}
+			auto c = uvec::cross(a, b);
+			return math::quat_normalize(Vector4 {c.x, c.y, c.z, 1.f + d});
+		}
+		// Closest point to p on the segment [a,b]
+		static Vector3 closest_point_on_segment(const Vector3 &p, const Vector3 &a, const Vector3 &b)
+		{
+			auto ab = b - a;
+			auto lenSqr = uvec::dot(ab, ab);
+			if(lenSqr < 1e-12f)
+				return a;
+			auto t = std::clamp(uvec::dot(p - a, ab) / lenSqr, 0.f, 1.f);
+			return a + ab * t;
+		}
+	};
+};
+
+std::shared_ptr<mmd::springs::Rig> mmd::springs::Rig::Create(const pmx::ModelData &mdlData)
+{
+	UTIL_MMD_TRACE_SCOPE("springs::Rig::Create");
+	std::shared_ptr<Rig> rig {new Rig {}};
+	rig->m_boneCount = mdlData.bones.size();
+	auto &rbs = mdlData.rigidBodies;
+	auto n = rbs.size();
+	rig->m_boneIndices.assign(rbs.boneIndices.begin(), rbs.boneIndices.end());
+	rig->m_restPositions.assign(rbs.positions.begin(), rbs.positions.end());
+	rig->m_invMasses.resize(n);
+	rig->m_radii.resize(n);
+	rig->m_groups.resize(n);
+	rig->m_masks.assign(rbs.noCollisionMasks.begin(), rbs.noCollisionMasks.end());
+	rig->m_parents.resize(n, -1);
+	for(size_t i = 0; i < n; ++i) {
+		auto dynamic = (rbs.physicsModes[i] != pmx::PhysicsMode::FollowBone);
+		auto mass = (rbs.masses[i] > 0.f) ? rbs.masses[i] : 1.f;
+		rig->m_invMasses[i] = dynamic ? (1.f / mass) : 0.f;
+		auto &size = rbs.sizes[i];
+		rig->m_radii[i] = (rbs.shapes[i] == pmx::RigidBodyShape::Box) ? std::min({size.x, size.y, size.z}) : size.x;
+		rig->m_groups[i] = static_cast<uint16_t>(1u << (rbs.groups[i] & 15));
+		if(rig->m_boneIndices[i] >= static_cast<int32_t>(mdlData.bones.size()))
+			rig->m_boneIndices[i] = -1;
+
+		if(!dynamic && rbs.shapes[i] != pmx::RigidBodyShape::Box) {
+			rig->m_colliderBodies.push_back(i);
+			rig->m_colliderAxes.push_back(math::quat_rotate(rbs.orientations[i], Vector3 {0.f, 1.f, 0.f}));
+			rig->m_colliderHalfHeights.push_back((rbs.shapes[i] == pmx::RigidBodyShape::Capsule) ? (size.y * 0.5f) : 0.f);
+		}
+	}
+
+	auto &joints = mdlData.joints;
+	for(size_t i = 0; i < joints.size(); ++i) {
+		auto a = joints.rigidBodyA[i];
+		auto b = joints.rigidBodyB[i];
+		if(a < 0 || b < 0 || a >= static_cast<int32_t>(n) || b >= static_cast<int32_t>(n) || a == b)
+			continue;
+		if(rig->m_invMasses[a] == 0.f && rig->m_invMasses[b] == 0.f)
+			continue;
+		rig->m_constraintA.push_back(a);
+		rig->m_constraintB.push_back(b);
+		rig->m_restLengths.push_back(uvec::length(rbs.positions[a] - rbs.positions[b]));
+		// MMD chains list the parent body first
+		if(rig->m_invMasses[b] > 0.f && rig->m_parents[b] == -1)
+			rig->m_parents[b] = a;
+		for(uint32_t c = 0; c < rig->m_colliderBodies.size(); ++c) {
+			auto body = rig->m_colliderBodies[c];
+			if(body == static_cast<uint32_t>(a))
+				rig->m_collisionExclusions.push_back((static_cast<uint64_t>(b) << 32) | c);
+			else if(body == static_cast<uint32_t>(b))
+				rig->m_collisionExclusions.push_back((static_cast<uint64_t>(a) << 32) | c);
+		}
+	}
+	std::sort(rig->m_collisionExclusions.begin(), rig->m_collisionExclusions.end());
+	return rig;
+}
+
+mmd::springs::Instance::Instance(std::shared_ptr<const Rig> rig) : m_rig {std::move(rig)}
+{
+	auto n = m_rig->GetParticleCount();
+	for(auto *v : {&m_px, &m_py, &m_pz, &m_prevX, &m_prevY, &m_prevZ})
+		v->resize(n, 0.f);
+	m_colliderCenters.resize(m_rig->GetColliderCount());
+	m_colliderDirs.resize(m_rig->GetColliderCount());
+}
+
+void mmd::springs::Instance::Initialize(std::span<const BoneTransform> boneTransforms)
+{
+	auto &rig = *m_rig;
+	for(uint32_t i = 0; i < rig.GetParticleCount(); ++i) {
+		auto boneIdx = rig.m_boneIndices[i];
+		auto pos = (boneIdx >= 0) ? transform_point(boneTransforms[boneIdx], rig.m_restPositions[i]) : rig.m_restPositions[i];
+		m_px[i] = m_prevX[i] = pos.x;
+		m_py[i] = m_prevY[i] = pos.y;
+		m_pz[i] = m_prevZ[i] = pos.z;
+	}
+	m_initialized = true;
+}
+
+void mmd::springs::Instance::Step(std::span<const BoneTransform> boneTransforms, float dt, const Settings &settings)
+{
+	UTIL_MMD_TRACE_SCOPE("springs::Instance::Step");
+	auto &rig = *m_rig;
+	if(boneTransforms.size() < rig.GetBoneCount())
+		return;
+	if(!m_initialized)
+		Initialize(boneTransforms);
+	auto n = rig.GetParticleCount();
+
+	// Kinematic particles follow their bones
+	for(uint32_t i = 0; i < n; ++i) {
+		if(rig.m_invMasses[i] != 0.f)
+			continue;
+		auto boneIdx = rig.m_boneIndices[i];
+		auto pos = (boneIdx >= 0) ? transform_point(boneTransforms[boneIdx], rig.m_restPositions[i]) : rig.m_restPositions[i];
+		m_px[i] = m_prevX[i] = pos.x;
+		m_py[i] = m_prevY[i] = pos.y;
+		m_pz[i] = m_prevZ[i] = pos.z;
+	}
+	for(uint32_t c = 0; c < rig.GetColliderCount(); ++c) {
+		auto body = rig.m_colliderBodies[c];
+		auto boneIdx = rig.m_boneIndices[body];
+		m_colliderCenters[c] = GetParticlePosition(body);
+		m_colliderDirs[c] = (boneIdx >= 0) ? math::quat_rotate(boneTransforms[boneIdx].rotation, rig.m_colliderAxes[c]) : rig.m_colliderAxes[c];
+	}
+
+	// Verlet integration; Kept branch-free over the component arrays so that it can be vectorized
+	auto damping = 1.f - std::clamp(settings.damping, 0.f, 1.f);
+	auto dt2 = dt * dt;
+	auto integrate = [n, damping, &invMasses = rig.m_invMasses](std::vector<float> &p, std::vector<float> &prev, float accel) {
+		auto *pp = p.data();
+		auto *pprev = prev.data();
+		auto *w = invMasses.data();
+		for(uint32_t i = 0; i < n; ++i) {
+			auto dynamic = (w[i] > 0.f) ? 1.f : 0.f;
+			auto cur = pp[i];
+			pp[i] = cur + dynamic * ((cur - pprev[i]) * damping + accel);
+			pprev[i] = cur;
+		}
+	};
+	integrate(m_px, m_prevX, settings.gravity.x * dt2);
+	integrate(m_py, m_prevY, settings.gravity.y * dt2);
+	integrate(m_pz, m_prevZ, settings.gravity.z * dt2);
+
+	auto iterations = std::min(settings.iterations, Settings::MAX_ITERATIONS);
+	for(uint32_t it = 0; it < iterations; ++it) {
+		for(uint32_t c = 0; c < rig.GetConstraintCount(); ++c) {
+			auto a = rig.m_constraintA[c];
+			auto b = rig.m_constraintB[c];
+			auto wa = rig.m_invMasses[a];
+			auto wb = rig.m_invMasses[b];
+			auto delta = GetParticlePosition(b) - GetParticlePosition(a);
+			auto len = uvec::length(delta);
+			if(len < 1e-6f)
+				continue;
+			auto corr = delta * ((len - rig.m_restLengths[c]) / (len * (wa + wb)));
+			m_px[a] += corr.x * wa;
+			m_py[a] += corr.y * wa;
+			m_pz[a] += corr.z * wa;
+			m_px[b] -= corr.x * wb;
+			m_py[b] -= corr.y * wb;
+			m_pz[b] -= corr.z * wb;
+		}
+
+		for(uint32_t i = 0; i < n; ++i) {
+			if(rig.m_invMasses[i] == 0.f)
+				continue;
+			auto pos = GetParticlePosition(i);
+			for(uint32_t c = 0; c < rig.GetColliderCount(); ++c) {
+				auto body = rig.m_colliderBodies[c];
+				if((rig.m_groups[body] & rig.m_masks[i]) == 0 || (rig.m_groups[i] & rig.m_masks[body]) == 0)
+					continue;
+				if(std::binary_search(rig.m_collisionExclusions.begin(), rig.m_collisionExclusions.end(), (static_cast<uint64_t>(i) << 32) | c))
+					continue;
+				auto &center = m_colliderCenters[c];
+				auto halfAxis = m_colliderDirs[c] * rig.m_colliderHalfHeights[c];
+				auto closest = closest_point_on_segment(pos, center - halfAxis, center + halfAxis);
+				auto delta = pos - closest;
+				auto minDist = rig.m_radii[body] + rig.m_radii[i];
+				auto distSqr = uvec::dot(delta, delta);
+				if(distSqr >= minDist * minDist || distSqr < 1e-12f)
+					continue;
+				pos = closest + delta * (minDist / std::sqrt(distSqr));
+			}
+			m_px[i] = pos.x;
+			m_py[i] = pos.y;
+			m_pz[i] = pos.z;
+		}
+	}
+}
+
+void mmd::springs::Instance::ApplyToBones(std::span<BoneTransform> boneTransforms) const
+{
+	auto &rig = *m_rig;
+	for(uint32_t i = 0; i < rig.GetParticleCount(); ++i) {
+		auto boneIdx = rig.m_boneIndices[i];
+		auto parent = rig.m_parents[i];
+		if(rig.m_invMasses[i] == 0.f || boneIdx < 0 || boneIdx >= static_cast<int32_t>(boneTransforms.size()) || parent < 0)
+			continue;
+		// The bone pivots around the body it hangs from
+		auto &restParent = rig.m_restPositions[parent];
+		auto curParent = GetParticlePosition(parent);
+		auto rot = rotation_between(rig.m_restPositions[i] - restParent, GetParticlePosition(i) - curParent);
+		auto &t = boneTransforms[boneIdx];
+		t.rotation = rot;
+		t.translation = curParent - math::quat_rotate(rot, restParent);
+	}
+}
+
+void mmd::springs::step(std::span<const StepInput> inputs, float dt, const Settings &settings, uint32_t numThreads)
+{
+	UTIL_MMD_TRACE_SCOPE("springs::step");
+	parallel_for(inputs.size(), numThreads, [inputs, dt, &settings](size_t i) {
+		auto &input = inputs[i];
+		if(input.instance)
+			input.instance->Step(input.boneTransforms, dt, settings);
+	});
+}
@@ -0,0 +1,52 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_stats.hpp"
+
+std::string_view mmd::to_string(LoadSection section)
+{
+	switch(section) {
+	case LoadSection::Header:
+		return "header";
+	case LoadSection::Text:
+		return "text";
+	case LoadSection::Vertices:
+		return "vertices";
+	case LoadSection::Faces:
+		return "faces";
+	case LoadSection::Textures:
+		return "textures";
+	case LoadSection::Materials:
+		return "materials";
+	case LoadSection::Bones:
+		return "bones";
+	case LoadSection::Morphs:
+		return "morphs";
+	case LoadSection::DisplayFrames:
+		return "display_frames";
+	case LoadSection::RigidBodies:
+		return "rigid_bodies";
+	case LoadSection::Joints:
+		return "joints";
+	case LoadSection::SoftBodies:
+		return "soft_bodies";
+	case LoadSection::MotionHeader:
+		return "motion_header";
+	case LoadSection::Keyframes:
+		return "keyframes";
+	case LoadSection::MorphKeys:
+		return "morph_keys";
+	case LoadSection::Cameras:
+		return "cameras";
+	case LoadSection::Lights:
+		return "lights";
+	case LoadSection::SelfShadows:
+		return "self_shadows";
+	case LoadSection::ShowIk:
+		return "show_ik";
+	default:
+		break;
+	}
+	return "unknown";
+}
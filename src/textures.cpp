@@ -0,0 +1,124 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_textures.hpp"
+#include "util_mmd_encoding.hpp"
+#include "util_mmd_trace.hpp"
+#include <utf8.h>
+#include <filesystem>
+
+namespace mmd {
+	static bool is_absolute_texture_path(std::string_view path) { return (!path.empty() && (path[0] == '/' || path[0] == '\\')) || (path.size() >= 2 && path[1] == ':'); }
+};
+
+std::string mmd::TextureResolver::NormalizeRoot(const std::string &modelRoot)
+{
+	std::error_code ec;
+	auto root = std::filesystem::absolute(modelRoot.empty() ? std::string {"."} : modelRoot, ec).lexically_normal().generic_string();
+	while(root.size() > 1 && root.back() == '/' && root[root.size() - 2] != ':')
+		root.pop_back();
+	return root;
+}
+
+int32_t mmd::TextureResolver::Resolve(const std::string &modelRoot, std::string_view texturePath) { return ResolveFrom(NormalizeRoot(modelRoot), texturePath); }
+
+std::vector<int32_t> mmd::TextureResolver::Resolve(const std::string &modelRoot, const pmx::ModelData &mdlData)
+{
+	UTIL_MMD_TRACE_SCOPE("TextureResolver::Resolve");
+	auto root = NormalizeRoot(modelRoot);
+	std::vector<int32_t> indices;
+	indices.reserve(mdlData.textures.size());
+	for(auto &texPath : mdlData.textures)
+		indices.push_back(ResolveFrom(root, texPath));
+	return indices;
+}
+
+int32_t mmd::TextureResolver::ResolveFrom(const std::string &root, std::string_view texturePath)
+{
+	// Absolute paths usually point to the author's machine
+	if(is_absolute_texture_path(texturePath)) {
+		auto sep = texturePath.find_last_of("/\\");
+		texturePath = texturePath.substr((sep != std::string_view::npos) ? (sep + 1) : 2);
+	}
+	auto path = root;
+	const DirectoryItem *item = nullptr;
+	size_t offset = 0;
+	while(offset < texturePath.size()) {
+		auto end = texturePath.find_first_of("/\\", offset);
+		if(end == std::string_view::npos)
+			end = texturePath.size();
+		auto component = texturePath.substr(offset, end - offset);
+		offset = end + 1;
+		if(component.empty() || component == ".")
+			continue;
+		if(component == "..") {
+			auto sep = path.rfind('/');
+			if(sep != std::string::npos)
+				path.resize((sep == 0 || path[sep - 1] == ':') ? (sep + 1) : sep);
+			item = nullptr;
+			continue;
+		}
+		// Looking up a name in a file yields an empty listing, so only the last item has to be checked
+		item = FindItem(path, component);
+		if(!item)
+			return -1;
+		if(path.back() != '/')
+			path += '/';
+		path += item->name;
+	}
+	if(!item || item->directory)
+		return -1;
+	return AddPath(std::move(path));
+}
+
+const mmd::TextureResolver::Directory &mmd::TextureResolver::GetDirectory(const std::string &path)
+{
+	auto it = m_directories.find(path);
+	if(it != m_directories.end())
+		return it->second;
+	UTIL_MMD_TRACE_SCOPE("TextureResolver::GetDirectory");
+	auto &dir = m_directories[path];
+	// The file type is usually known from the directory listing itself, so this doesn't stat every file
+	std::error_code ec;
+	std::string key;
+	auto addItem = [&dir](const std::string &key, const std::string &name, bool directory) {
+		auto [it, inserted] = dir.try_emplace(key, DirectoryItem {name, directory});
+		// Names that only differ in case are resolved to the same file regardless of the listing order
+		if(!inserted && name < it->second.name)
+			it->second = DirectoryItem {name, directory};
+	};
+	for(std::filesystem::directory_iterator it {path, std::filesystem::directory_options::skip_permission_denied, ec}; !ec && it != std::filesystem::directory_iterator {}; it.increment(ec)) {
+		auto name = it->path().filename().string();
+		std::error_code typeEc;
+		auto directory = it->is_directory(typeEc);
+		to_lower_ascii(name, key);
+		addItem(key, name, directory);
+		if(!utf8::is_valid(name.begin(), name.end())) {
+			to_lower_ascii(shift_jis_to_utf8(name), key);
+			addItem(key, name, directory);
+		}
+	}
+	return dir;
+}
+
+const mmd::TextureResolver::DirectoryItem *mmd::TextureResolver::FindItem(const std::string &dirPath, std::string_view name)
+{
+	auto &dir = GetDirectory(dirPath);
+	to_lower_ascii(name, m_key);
+	auto it = dir.find(m_key);
+	return (it != dir.end()) ? &it->second : nullptr;
+}
+
+int32_t mmd::TextureResolver::AddPath(std::string &&path)
+{
+	auto it = m_pathToIndex.find(path);
+	if(it != m_pathToIndex.end())
+		return it->second;
+	auto index = static_cast<uint32_t>(m_paths.size());
+	m_pathToIndex.emplace(path, index);
+	m_paths.push_back(std::move(path));
+	return index;
+}
+
+void mmd::TextureResolver::ClearDirectoryCache() { m_directories.clear(); }
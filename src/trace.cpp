@@ -0,0 +1,83 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd_trace.hpp"
+#include <fsys/filesystem.h>
+#include <fsys/ifile.hpp>
+#include <array>
+#include <atomic>
+#include <cstdio>
+
+static std::atomic<mmd::trace::Tracer *> g_tracer = nullptr;
+
+void mmd::trace::set_tracer(Tracer *tracer) { g_tracer = tracer; }
+mmd::trace::Tracer *mmd::trace::get_tracer() { return g_tracer.load(std::memory_order_relaxed); }
+
+mmd::trace::ChromeTraceWriter::ChromeTraceWriter(const std::string &path) : m_path {path}, m_start {std::chrono::steady_clock::now()} {}
+mmd::trace::ChromeTraceWriter::~ChromeTraceWriter() { Flush(); }
+
+void mmd::trace::ChromeTraceWriter::BeginScope(const char *name) { AddEvent(name, true); }
+void mmd::trace::ChromeTraceWriter::EndScope(const char *name) { AddEvent(name, false); }
+
+void mmd::trace::ChromeTraceWriter::AddEvent(const char *name, bool begin)
+{
+	auto time = std::chrono::steady_clock::now() - m_start;
+	std::scoped_lock lock {m_mutex};
+	auto it = m_threadIds.find(std::this_thread::get_id());
+	if(it == m_threadIds.end())
+		it = m_threadIds.insert(std::make_pair(std::this_thread::get_id(), static_cast<uint32_t>(m_threadIds.size()))).first;
+	m_events.push_back({name, it->second, begin, time});
+}
+
+static void append_json_string(std::string &out, const char *str)
+{
+	out += '"';
+	for(auto *c = str; *c != '\0'; ++c) {
+		switch(*c) {
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		default:
+			if(static_cast<unsigned char>(*c) < 0x20) {
+				std::array<char, 8> buf;
+				snprintf(buf.data(), buf.size(), "\\u%04x", *c);
+				out += buf.data();
+			}
+			else
+				out += *c;
+			break;
+		}
+	}
+	out += '"';
+}
+
+bool mmd::trace::ChromeTraceWriter::Flush()
+{
+	std::string json = "{\"traceEvents\":[";
+	{
+		std::scoped_lock lock {m_mutex};
+		json.reserve(json.size() + m_events.size() * 80);
+		for(size_t i = 0; i < m_events.size(); ++i) {
+			auto &ev = m_events[i];
+			if(i > 0)
+				json += ',';
+			json += "\n{\"name\":";
+			append_json_string(json, ev.name);
+			// Timestamps are in microseconds
+			std::array<char, 96> buf;
+			snprintf(buf.data(), buf.size(), ",\"cat\":\"util_mmd\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", ev.begin ? 'B' : 'E', std::chrono::duration<double, std::micro> {ev.time}.count(), ev.threadId);
+			json += buf.data();
+		}
+	}
+	json += "\n]}\n";
+
+	VFilePtr f = FileManager::OpenSystemFile(m_path.c_str(), "wb");
+	if(f == nullptr)
+		return false;
+	fsys::File fp {f};
+	return fp.Write(json.data(), json.size()) == json.size();
+}
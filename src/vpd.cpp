@@ -0,0 +1,190 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "util_mmd.hpp"
+#include "util_mmd_trace.hpp"
+#include "util_mmd_encoding.hpp"
+#include "util_mmd_io.hpp"
+#include "parallel.hpp"
+#include <sharedutils/util_ifile.hpp>
+#include <algorithm>
+#include <charconv>
+
+namespace mmd {
+	namespace vpd {
+		// Minimal tokenizer for the VPD text format. VPD files are Shift-JIS encoded, but all structural
+		// characters (';', ',', line breaks) are below 0x40 and can never be mistaken for a trail byte.
+		class Tokenizer {
+		  public:
+			Tokenizer(std::string_view data) : m_data {data} {}
+			// Skips whitespace and '//' comments
+			void SkipWhitespace()
+			{
+				while(m_pos < m_data.size()) {
+					auto c = m_data[m_pos];
+					if(c == ' ' || c == '\t' || c == '\r' || c == '\n')
+						++m_pos;
+					else if(c == '/' && m_pos + 1 < m_data.size() && m_data[m_pos + 1] == '/') {
+						auto end = m_data.find('\n', m_pos);
+						m_pos = (end != std::string_view::npos) ? end : m_data.size();
+					}
+					else
+						break;
+				}
+			}
+			bool Consume(char c)
+			{
+				SkipWhitespace();
+				if(m_pos >= m_data.size() || m_data[m_pos] != c)
+					return false;
+				++m_pos;
+				return true;
+			}
+			bool ConsumeKeyword(std::string_view keyword)
+			{
+				SkipWhitespace();
+				if(m_data.substr(m_pos, keyword.size()) != keyword)
+					return false;
+				m_pos += keyword.size();
+				return true;
+			}
+			// Reads everything up to the delimiter (exclusive) and skips the delimiter
+			std::string_view ReadUntil(char delimiter)
+			{
+				SkipWhitespace();
+				auto end = m_data.find(delimiter, m_pos);
+				if(end == std::string_view::npos)
+					end = m_data.size();
+				auto result = m_data.substr(m_pos, end - m_pos);
+				m_pos = std::min(end + 1, m_data.size());
+				while(!result.empty() && (result.back() == ' ' || result.back() == '\t' || result.back() == '\r'))
+					result.remove_suffix(1);
+				return result;
+			}
+			template<typename T>
+			bool ReadNumber(T &outValue)
+			{
+				SkipWhitespace();
+				auto *begin = m_data.data() + m_pos;
+				auto *end = m_data.data() + m_data.size();
+				if(begin != end && *begin == '+')
+					++begin;
+				auto res = std::from_chars(begin, end, outValue);
+				if(res.ec != std::errc {})
+					return false;
+				m_pos = res.ptr - m_data.data();
+				return true;
+			}
+			// Reads a comma-separated list of numbers terminated by ';'
+			template<size_t N>
+			bool ReadNumbers(std::array<float, N> &outValues)
+			{
+				for(size_t i = 0; i < N; ++i) {
+					if(!ReadNumber(outValues[i]) || !Consume((i + 1 < N) ? ',' : ';'))
+						return false;
+				}
+				return true;
+			}
+			bool AtEnd()
+			{
+				SkipWhitespace();
+				return m_pos >= m_data.size();
+			}
+		  private:
+			std::string_view m_data;
+			size_t m_pos = 0;
+		};
+	};
+};
+
+std::shared_ptr<mmd::vpd::Pose> mmd::vpd::load(std::string_view data)
+{
+	UTIL_MMD_TRACE_SCOPE("vpd::load");
+	Tokenizer tokenizer {data};
+	if(!tokenizer.ConsumeKeyword("Vocaloid Pose Data file"))
+		return nullptr;
+	auto pose = std::make_shared<Pose>();
+	pose->modelFileName = shift_jis_to_utf8(tokenizer.ReadUntil(';'));
+	uint32_t numBones;
+	if(!tokenizer.ReadNumber(numBones) || !tokenizer.Consume(';'))
+		return nullptr;
+	// The count is not trusted, a bone entry takes at least "Bone0{\n0,0,0;0,0,0,0;}" (22 bytes)
+	constexpr size_t minBoneEntrySize = 22;
+	pose->bones.reserve(std::min<size_t>(numBones, data.size() / minBoneEntrySize));
+
+	while(!tokenizer.AtEnd()) {
+		uint32_t index;
+		if(tokenizer.ConsumeKeyword("Bone")) {
+			if(!tokenizer.ReadNumber(index) || !tokenizer.Consume('{'))
+				return nullptr;
+			auto &bone = pose->bones.emplace_back();
+			bone.name = shift_jis_to_utf8(tokenizer.ReadUntil('\n'));
+			std::array<float, 3> translation;
+			std::array<float, 4> rotation;
+			if(!tokenizer.ReadNumbers(translation) || !tokenizer.ReadNumbers(rotation) || !tokenizer.Consume('}'))
+				return nullptr;
+			bone.translation = {translation[0], translation[1], translation[2]};
+			bone.rotation = {rotation[0], rotation[1], rotation[2], rotation[3]};
+		}
+		else if(tokenizer.ConsumeKeyword("Morph")) {
+			if(!tokenizer.ReadNumber(index) || !tokenizer.Consume('{'))
+				return nullptr;
+			auto &morph = pose->morphs.emplace_back();
+			morph.name = shift_jis_to_utf8(tokenizer.ReadUntil('\n'));
+			std::array<float, 1> weight;
+			if(!tokenizer.ReadNumbers(weight) || !tokenizer.Consume('}'))
+				return nullptr;
+			morph.weight = weight[0];
+		}
+		else
+			return nullptr;
+	}
+	return pose;
+}
+
+std::shared_ptr<mmd::vpd::Pose> mmd::vpd::load(ufile::IFile &f)
+{
+	std::string data;
+	data.resize(f.GetSize() - f.Tell());
+	data.resize(f.Read(data.data(), data.size()));
+	return load(std::string_view {data});
+}
+
+std::shared_ptr<mmd::vpd::Pose> mmd::vpd::load(const std::string &path)
+{
+	auto f = MappedFile::Open(path);
+	if(!f)
+		return nullptr;
+	auto data = f->GetData();
+	return load(std::string_view {reinterpret_cast<const char *>(data.data()), data.size()});
+}
+
+std::vector<std::shared_ptr<mmd::vpd::Pose>> mmd::vpd::load(const std::vector<std::string> &paths, uint32_t numThreads)
+{
+	UTIL_MMD_TRACE_SCOPE("vpd::load_batch");
+	std::vector<std::shared_ptr<Pose>> poses;
+	poses.resize(paths.size());
+	parallel_for(paths.size(), numThreads, [&paths, &poses](size_t i) {
+		// Malformed files only fail their own entry
+		try {
+			poses[i] = load(paths[i]);
+		}
+		catch(const std::exception &) {
+			poses[i] = nullptr;
+		}
+	});
+	return poses;
+}
+
+mmd::vpd::PoseBinding mmd::vpd::bind(const Pose &pose, const pmx::NameIndexMap &nameMap)
+{
+	PoseBinding binding {};
+	binding.boneIndices.reserve(pose.bones.size());
+	for(auto &bone : pose.bones)
+		binding.boneIndices.push_back(nameMap.FindBone(bone.name));
+	binding.morphIndices.reserve(pose.morphs.size());
+	for(auto &morph : pose.morphs)
+		binding.morphIndices.push_back(nameMap.FindMorph(morph.name));
+	return binding;
+}